@@ -0,0 +1,146 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+#include <math.h>
+#include <string.h>
+
+/*
+ * Adaptive refinement. Readings are sorted into sectors by their
+ * compass heading under the active calibration. The plane is fitted to
+ * the sector means. The origin is the centre of the circle through
+ * them (Kasa's algebraic fit), which unlike their mean does not depend
+ * on how many readings each sector had.
+ *
+ * A sector mean lies inside the circle by as much as its readings
+ * spread along it: for readings on a circle of radius r around c,
+ * |mean - c|^2 = r^2 - scatter. Fitting |mean - c|^2 + scatter to r^2
+ * instead keeps a sector swept by a turn from pulling the centre
+ * towards it, relative to one the boat held a course in.
+ */
+
+#define ALL_SECTORS ((uint8_t)((1 << ADAPTIVE_SECTORS) - 1))
+
+short startAdaptiveCalibration(AdaptiveCalibration* ad, const Calibration* initial, uint16_t interval) {
+  ad->buffers[0] = *initial;
+  ad->buffers[1] = *initial;
+  ad->active = 0;
+  memset(ad->sectorMean, 0, sizeof(ad->sectorMean));
+  memset(ad->sectorScatter, 0, sizeof(ad->sectorScatter));
+  memset(ad->sectorCount, 0, sizeof(ad->sectorCount));
+  ad->fresh = 0;
+  ad->interval = interval > 0 ? interval : 1;
+  ad->sinceRefine = 0;
+  ad->published = 0;
+  return E_SUCCESS;
+}
+
+const Calibration* adaptiveCalibration(const AdaptiveCalibration* ad) {
+  return &(ad->buffers[ad->active]);
+}
+
+/*
+ * Centre of the least squares circle x^2 + y^2 + D x + E y + F = 0
+ * through the sector means, in plane coordinates along u and v from
+ * centre, which is updated in place.
+ */
+short sectorCircleCentre(const AdaptiveCalibration* ad, const Point* u, const Point* v, Point* centre) {
+  float ata[9] = { 0 };
+  float atb[3] = { 0 };
+  short i, j, k;
+  for (k=0; k<ADAPTIVE_SECTORS; k++) {
+    Point d;
+    pointVec(centre, &(ad->sectorMean[k]), &d);
+    float row[3] = { dotProduct(u, &d), dotProduct(v, &d), 1 };
+    float rhs = -(row[0] * row[0] + row[1] * row[1] + ad->sectorScatter[k]);
+    for (i=0; i<3; i++) {
+      for (j=0; j<3; j++)
+	ata[i * 3 + j] += row[i] * row[j];
+      atb[i] += row[i] * rhs;
+    }
+  }
+  short rc = solveLinear(ata, atb, 3);
+  if (rc != E_SUCCESS)
+    return rc;
+
+  Point along = *u;
+  mulByScalar(&along, -atb[0] / 2);
+  addTo(centre, &along);
+  along = *v;
+  mulByScalar(&along, -atb[1] / 2);
+  addTo(centre, &along);
+  return E_SUCCESS;
+}
+
+void refineAdaptive(AdaptiveCalibration* ad) {
+  const Calibration* current = &(ad->buffers[ad->active]);
+  Calibration* next = &(ad->buffers[ad->active ^ 1]);
+
+  CalibrationCtxPoint means[ADAPTIVE_SECTORS];
+  short k;
+  for (k=0; k<ADAPTIVE_SECTORS; k++)
+    means[k].sensorData = ad->sectorMean[k];
+  Point centre;
+  CovarianceMatrix covar;
+  centroid(means, ADAPTIVE_SECTORS, &centre);
+  covariance(means, ADAPTIVE_SECTORS, &centre, &covar);
+
+  *next = *current;
+  if (fitPlane(&centre, &covar, next) != E_SUCCESS)
+    return;
+
+  // Compass north keeps its direction, projected onto the new plane.
+  Point normal = { next->planeA, next->planeB, next->planeC };
+  normalize(&normal);
+  Point u = current->transform.axisU;
+  Point across = normal;
+  mulByScalar(&across, -dotProduct(&u, &normal));
+  addTo(&u, &across);
+  normalize(&u);
+  Point v;
+  crossProduct(&normal, &u, &v);
+  if (sectorCircleCentre(ad, &u, &v, &centre) != E_SUCCESS)
+    return;
+
+  Point cartesian = { next->planeA, next->planeB, next->planeC };
+  Point north;
+  pointVec(&(current->origin), &(current->compassNorth), &north);
+  float northLength = vecLength(&north);
+  projectPoint(&centre, &cartesian, &(next->origin), NULL);
+  north = u;
+  mulByScalar(&north, northLength);
+  addTo(&north, &(next->origin));
+  next->compassNorth = north;
+  compileTransform(next);
+
+  // Everything written to next must land before readers switch to it.
+  MEMORY_BARRIER();
+  ad->active ^= 1;
+  ad->fresh = 0;
+  ad->published++;
+}
+
+short addAdaptiveSample(AdaptiveCalibration* ad, const Point* sensorData) {
+  const HeadingTransform* t = &(ad->buffers[ad->active].transform);
+  float u = dotProduct(&(t->axisU), sensorData) - t->offsetU;
+  float v = dotProduct(&(t->axisV), sensorData) - t->offsetV;
+  short k = coverageSector(u, v) / (COVERAGE_SECTORS / ADAPTIVE_SECTORS);
+
+  // Plain mean and variance of the first ADAPTIVE_WINDOW readings,
+  // then decaying with weight 1 / ADAPTIVE_WINDOW.
+  if (ad->sectorCount[k] < ADAPTIVE_WINDOW)
+    ad->sectorCount[k]++;
+  float weight = 1.0f / ad->sectorCount[k];
+  Point delta;
+  pointVec(&(ad->sectorMean[k]), sensorData, &delta);
+  ad->sectorScatter[k] = (1 - weight) * (ad->sectorScatter[k] + weight * dotProduct(&delta, &delta));
+  mulByScalar(&delta, weight);
+  addTo(&(ad->sectorMean[k]), &delta);
+  ad->fresh |= (uint8_t)(1 << k);
+
+  if (++ad->sinceRefine >= ad->interval) {
+    ad->sinceRefine = 0;
+    if (ad->fresh == ALL_SECTORS)
+      refineAdaptive(ad);
+  }
+  return E_SUCCESS;
+}
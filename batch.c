@@ -0,0 +1,163 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+#include <math.h>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define BATCH_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BATCH_SSE2
+#endif
+
+/*
+ * All kernels share the polynomial of fastAtan2f, so a batch agrees to
+ * rounding whichever kernel handled a given sample.
+ */
+
+static float batchHeading(const HeadingTransform* t, float x, float y, float z) {
+  float u = t->axisU.x * x + t->axisU.y * y + t->axisU.z * z - t->offsetU;
+  float v = t->axisV.x * x + t->axisV.y * y + t->axisV.z * z - t->offsetV;
+
+  float degrees = fastAtan2f(v, u) * RAD_TO_DEG_F;
+  if (degrees < 0.0f)
+    degrees += 360.0f;
+  if (degrees > 359.99f)
+    degrees = 0.0f;
+  return degrees;
+}
+
+#ifdef BATCH_AVX2
+
+static long batchKernel(const HeadingTransform* t, const float* xs, const float* ys, const float* zs,
+			long n, float* headings) {
+  const __m256 ux = _mm256_set1_ps(t->axisU.x);
+  const __m256 uy = _mm256_set1_ps(t->axisU.y);
+  const __m256 uz = _mm256_set1_ps(t->axisU.z);
+  const __m256 vx = _mm256_set1_ps(t->axisV.x);
+  const __m256 vy = _mm256_set1_ps(t->axisV.y);
+  const __m256 vz = _mm256_set1_ps(t->axisV.z);
+  const __m256 ou = _mm256_set1_ps(t->offsetU);
+  const __m256 ov = _mm256_set1_ps(t->offsetV);
+  const __m256 signMask = _mm256_set1_ps(-0.0f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 tiny = _mm256_set1_ps(1e-30f);
+  const __m256 halfPi = _mm256_set1_ps(PI_F / 2);
+  const __m256 pi = _mm256_set1_ps(PI_F);
+  const __m256 toDeg = _mm256_set1_ps(RAD_TO_DEG_F);
+  const __m256 full = _mm256_set1_ps(360.0f);
+  const __m256 snap = _mm256_set1_ps(359.99f);
+
+  long i;
+  for (i=0; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(xs + i);
+    __m256 y = _mm256_loadu_ps(ys + i);
+    __m256 z = _mm256_loadu_ps(zs + i);
+
+    __m256 u = _mm256_fmadd_ps(ux, x, _mm256_fmadd_ps(uy, y, _mm256_fmsub_ps(uz, z, ou)));
+    __m256 v = _mm256_fmadd_ps(vx, x, _mm256_fmadd_ps(vy, y, _mm256_fmsub_ps(vz, z, ov)));
+
+    __m256 au = _mm256_andnot_ps(signMask, u);
+    __m256 av = _mm256_andnot_ps(signMask, v);
+    __m256 mx = _mm256_max_ps(_mm256_max_ps(au, av), tiny);
+    __m256 mn = _mm256_min_ps(au, av);
+    __m256 a = _mm256_div_ps(mn, mx);
+    __m256 a2 = _mm256_mul_ps(a, a);
+
+    __m256 p = _mm256_fmadd_ps(_mm256_set1_ps(ATAN_C9), a2, _mm256_set1_ps(ATAN_C7));
+    p = _mm256_fmadd_ps(p, a2, _mm256_set1_ps(ATAN_C5));
+    p = _mm256_fmadd_ps(p, a2, _mm256_set1_ps(ATAN_C3));
+    p = _mm256_fmadd_ps(p, a2, _mm256_set1_ps(ATAN_C1));
+    __m256 r = _mm256_mul_ps(p, a);
+
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(halfPi, r), _mm256_cmp_ps(av, au, _CMP_GT_OQ));
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(pi, r), _mm256_cmp_ps(u, zero, _CMP_LT_OQ));
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(zero, r), _mm256_cmp_ps(v, zero, _CMP_LT_OQ));
+
+    __m256 degrees = _mm256_mul_ps(r, toDeg);
+    degrees = _mm256_add_ps(degrees, _mm256_and_ps(_mm256_cmp_ps(degrees, zero, _CMP_LT_OQ), full));
+    degrees = _mm256_andnot_ps(_mm256_cmp_ps(degrees, snap, _CMP_GT_OQ), degrees);
+    _mm256_storeu_ps(headings + i, degrees);
+  }
+  return i;
+}
+
+#elif defined(BATCH_SSE2)
+
+static __m128 select4(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static long batchKernel(const HeadingTransform* t, const float* xs, const float* ys, const float* zs,
+			long n, float* headings) {
+  const __m128 ux = _mm_set1_ps(t->axisU.x);
+  const __m128 uy = _mm_set1_ps(t->axisU.y);
+  const __m128 uz = _mm_set1_ps(t->axisU.z);
+  const __m128 vx = _mm_set1_ps(t->axisV.x);
+  const __m128 vy = _mm_set1_ps(t->axisV.y);
+  const __m128 vz = _mm_set1_ps(t->axisV.z);
+  const __m128 ou = _mm_set1_ps(t->offsetU);
+  const __m128 ov = _mm_set1_ps(t->offsetV);
+  const __m128 signMask = _mm_set1_ps(-0.0f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 tiny = _mm_set1_ps(1e-30f);
+  const __m128 halfPi = _mm_set1_ps(PI_F / 2);
+  const __m128 pi = _mm_set1_ps(PI_F);
+  const __m128 toDeg = _mm_set1_ps(RAD_TO_DEG_F);
+  const __m128 full = _mm_set1_ps(360.0f);
+  const __m128 snap = _mm_set1_ps(359.99f);
+
+  long i;
+  for (i=0; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps(xs + i);
+    __m128 y = _mm_loadu_ps(ys + i);
+    __m128 z = _mm_loadu_ps(zs + i);
+
+    __m128 u = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ux, x), _mm_mul_ps(uy, y)), _mm_mul_ps(uz, z)), ou);
+    __m128 v = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, x), _mm_mul_ps(vy, y)), _mm_mul_ps(vz, z)), ov);
+
+    __m128 au = _mm_andnot_ps(signMask, u);
+    __m128 av = _mm_andnot_ps(signMask, v);
+    __m128 mx = _mm_max_ps(_mm_max_ps(au, av), tiny);
+    __m128 mn = _mm_min_ps(au, av);
+    __m128 a = _mm_div_ps(mn, mx);
+    __m128 a2 = _mm_mul_ps(a, a);
+
+    __m128 p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ATAN_C9), a2), _mm_set1_ps(ATAN_C7));
+    p = _mm_add_ps(_mm_mul_ps(p, a2), _mm_set1_ps(ATAN_C5));
+    p = _mm_add_ps(_mm_mul_ps(p, a2), _mm_set1_ps(ATAN_C3));
+    p = _mm_add_ps(_mm_mul_ps(p, a2), _mm_set1_ps(ATAN_C1));
+    __m128 r = _mm_mul_ps(p, a);
+
+    r = select4(_mm_cmpgt_ps(av, au), _mm_sub_ps(halfPi, r), r);
+    r = select4(_mm_cmplt_ps(u, zero), _mm_sub_ps(pi, r), r);
+    r = select4(_mm_cmplt_ps(v, zero), _mm_sub_ps(zero, r), r);
+
+    __m128 degrees = _mm_mul_ps(r, toDeg);
+    degrees = _mm_add_ps(degrees, _mm_and_ps(_mm_cmplt_ps(degrees, zero), full));
+    degrees = _mm_andnot_ps(_mm_cmpgt_ps(degrees, snap), degrees);
+    _mm_storeu_ps(headings + i, degrees);
+  }
+  return i;
+}
+
+#else
+
+static long batchKernel(const HeadingTransform* t, const float* xs, const float* ys, const float* zs,
+			long n, float* headings) {
+  return 0;
+}
+
+#endif
+
+short getHeadingBatch(const Calibration* cal, const float* xs, const float* ys, const float* zs,
+		      long n, float* headings) {
+  long i = batchKernel(&(cal->transform), xs, ys, zs, n, headings);
+  for (; i<n; i++)
+    headings[i] = batchHeading(&(cal->transform), xs[i], ys[i], zs[i]);
+
+  for (i=0; i<n; i++)
+    headings[i] = applyDeviation(cal, headings[i]);
+  return E_SUCCESS;
+}
@@ -0,0 +1,780 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "compaxx.h"
+#include "compaxx_int.h"
+#include "fleet.h"
+#include "sensorlog.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define PI 3.14159265
+#define BENCH_SAMPLES 1000000
+#define MAX_RESULTS 64
+#define FLEET_LOGS 2000
+#define FLEET_LOG_READINGS 300
+// Slowdowns smaller than this are timer noise, whatever the percentage.
+#define MIN_REGRESSION_NS 2.0
+
+/*
+ * Benchmark suite. Each benchmark times a number of operations and
+ * reports ns/op, cycles/op (TSC cycles where available) and heap
+ * allocations/op, taking the best of --repeat runs. Results go to
+ * stdout and, as CSV, to --out; with --baseline the run fails if any
+ * benchmark is more than --threshold percent slower than the stored
+ * baseline, once that is scaled to this machine by the reference
+ * kernel.
+ */
+
+typedef struct {
+  char name[48];
+  long ops;
+  double nsPerOp;
+  double cyclesPerOp;
+  double allocsPerOp;
+} BenchResult;
+
+BenchResult results[MAX_RESULTS];
+int resultCount = 0;
+
+/*
+ * Allocation counting. The bench binary defines malloc, calloc and
+ * realloc itself, on top of glibc's, so that allocations made inside
+ * libc (strdup, fopen, ...) are counted as well as the program's own:
+ * --wrap only reaches calls from the objects being linked.
+ */
+long allocations = 0;
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+  allocations++;
+  return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+  __libc_free(ptr);
+}
+
+typedef struct {
+  double start;
+  unsigned long long cycles;
+  long allocations;
+} Timer;
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+unsigned long long cycles() {
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+void startTimer(Timer* t) {
+  t->allocations = allocations;
+  t->cycles = cycles();
+  t->start = now();
+}
+
+/*
+ * Records a measurement. The suite runs several times and keeps the
+ * fastest run of each benchmark, which is the least disturbed by
+ * whatever else the machine was doing.
+ */
+void stopTimer(const Timer* t, const char* name, long ops) {
+  double seconds = now() - t->start;
+  unsigned long long elapsed = cycles() - t->cycles;
+  double nsPerOp = seconds * 1e9 / ops;
+
+  int i;
+  for (i=0; i<resultCount; i++)
+    if (strcmp(results[i].name, name) == 0)
+      break;
+  BenchResult* r = &results[i];
+  if (i == resultCount) {
+    resultCount++;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+  } else if (r->nsPerOp <= nsPerOp) {
+    return;
+  }
+  r->ops = ops;
+  r->nsPerOp = nsPerOp;
+  r->cyclesPerOp = (double)elapsed / ops;
+  r->allocsPerOp = (double)(allocations - t->allocations) / ops;
+}
+
+void printResults() {
+  int i;
+  for (i=0; i<resultCount; i++)
+    printf("%-32s %12.2f ns/op %12.1f cycles/op %8.3f allocs/op\n",
+	   results[i].name, results[i].nsPerOp, results[i].cyclesPerOp, results[i].allocsPerOp);
+}
+
+double resultNs(const char* name) {
+  int i;
+  for (i=0; i<resultCount; i++)
+    if (strcmp(results[i].name, name) == 0)
+      return results[i].nsPerOp;
+  return 0;
+}
+
+float randFloat(float from, float to) {
+  return (float)(rand()) * (to - from) / (float)RAND_MAX + from;
+}
+
+/*
+ * Readings on a tilted circle of radius 500 around (100, -200, 300),
+ * as the sensor would report them during a full turn.
+ */
+void syntheticPoint(float theta, float noise, Point* pt) {
+  float rad = theta * PI / 180;
+  pt->x = 100 + 500 * cos(rad) + randFloat(-noise, noise);
+  pt->y = -200 + 500 * sin(rad) * 0.9 + randFloat(-noise, noise);
+  pt->z = 300 + 500 * sin(rad) * 0.3 + randFloat(-noise, noise);
+}
+
+void syntheticContext(int finePoints, CalibrationContext* ctx) {
+  startCalibration(ctx);
+
+  int i;
+  for (i=0; i<MAX_SENSOR_POINTS - finePoints; i++) {
+    Point pt;
+    syntheticPoint(i * 360.0 / (MAX_SENSOR_POINTS - finePoints), 2, &pt);
+    addCalibrationPoint(ctx, &pt, NULL);
+  }
+  for (i=0; i<finePoints; i++) {
+    Point pt;
+    float theta = i * 360.0 / finePoints;
+    float magnetic = fmod(theta + 5 * sin(theta * PI / 180) + 360, 360);
+    syntheticPoint(theta, 0, &pt);
+    addCalibrationPoint(ctx, &pt, &magnetic);
+  }
+}
+
+void syntheticCalibration(int finePoints, Calibration* cal) {
+  CalibrationContext ctx;
+  syntheticContext(finePoints, &ctx);
+  finalizeCalibration(&ctx, cal, NULL);
+}
+
+/*
+ * Builds a calibration context from a sample log, every 10th reading
+ * becoming a fine point.
+ */
+int csvContext(const char* fileName, CalibrationContext* ctx) {
+  SensorLog log;
+  if (openSensorLog(&log, fileName) != E_SUCCESS) {
+    printf("Cannot open: %s\n", fileName);
+    return 0;
+  }
+
+  Point points[MAX_SENSOR_POINTS];
+  int n = readSensorLog(&log, points, MAX_SENSOR_POINTS), i;
+  closeSensorLog(&log);
+  startCalibration(ctx);
+  for (i=0; i<n; i++) {
+    float magnetic = fmod(i * 3.6, 360);
+    addCalibrationPoint(ctx, &points[i], (i % 10 == 0 && ctx->finePointCount < MAX_CALIBRATION_POINTS) ? &magnetic : NULL);
+  }
+  return n;
+}
+
+/*
+ * Plain float arithmetic over the readings, using nothing from the
+ * library, so that its time only depends on the machine. The serial
+ * dependency through acc keeps the compiler from vectorizing it.
+ */
+void benchReference(const Point* points) {
+  static volatile float sink;
+  float acc = 0;
+  Timer t;
+  long i;
+
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++) {
+    const Point* p = &points[i];
+    acc = acc * 0.999f + sqrtf(p->x * p->x + p->y * p->y + p->z * p->z) / (fabsf(p->z) + 1.0f);
+  }
+  stopTimer(&t, "reference", BENCH_SAMPLES);
+  sink = acc;
+}
+
+void benchHeading(const Point* points, const float* xs, const float* ys, const float* zs, float* headings) {
+  Calibration cal;
+  Timer t;
+  long i;
+
+  syntheticCalibration(MAX_CALIBRATION_POINTS, &cal);
+
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    getHeading(&cal, &points[i], &headings[i]);
+  stopTimer(&t, "getHeading", BENCH_SAMPLES);
+
+  // 20 degrees of heel and 3 of pitch
+  Point gravity = { 0.052f, 0.342f, 0.938f };
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    getHeadingTilt(&cal, &points[i], &gravity, &headings[i]);
+  stopTimer(&t, "getHeadingTilt", BENCH_SAMPLES);
+
+  // Straight from the stored calibration, and unpacking it at boot
+  static PackedCalibration packed;
+  static Calibration loaded;
+  saveCalibration(&cal, &packed, sizeof(packed));
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    getHeadingPacked(&packed, &points[i], &headings[i]);
+  stopTimer(&t, "getHeadingPacked", BENCH_SAMPLES);
+
+  startTimer(&t);
+  for (i=0; i<10000; i++)
+    loadCalibration(&packed, sizeof(packed), &loaded);
+  stopTimer(&t, "loadCalibration", 10000);
+
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    headings[i] = getCompassHeading(&cal, &points[i]);
+  stopTimer(&t, "getCompassHeading", BENCH_SAMPLES);
+
+  startTimer(&t);
+  getHeadingBatch(&cal, xs, ys, zs, BENCH_SAMPLES, headings);
+  stopTimer(&t, "getHeadingBatch", BENCH_SAMPLES);
+
+  // Pushes as an ISR would, draining whenever the ring is full.
+  static SampleRing ring;
+  sampleRingInit(&ring);
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++) {
+    if (sampleRingPush(&ring, &points[i]) == E_RING_FULL) {
+      processPending(&cal, &ring, headings, SAMPLE_RING_SIZE);
+      sampleRingPush(&ring, &points[i]);
+    }
+  }
+  processPending(&cal, &ring, headings, SAMPLE_RING_SIZE);
+  stopTimer(&t, "sampleRingPush+processPending", BENCH_SAMPLES);
+
+  // 200 Hz in, 10 Hz out.
+  HeadingFilter filter;
+  startHeadingFilter(&filter, 20);
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    filterHeading(&filter, &cal, &points[i], &headings[i / 20]);
+  stopTimer(&t, "filterHeading/20", BENCH_SAMPLES);
+
+  GyroFusion fusion;
+  startGyroFusion(&fusion, 2.0f);
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    fuseHeading(&fusion, fmodf(i * 0.1f, 360), 10.0f, 0.01f, &headings[i]);
+  stopTimer(&t, "fuseHeading", BENCH_SAMPLES);
+
+  // The atan2 tiers alone, on the same readings as (u, v).
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    headings[i] = atan2f(ys[i], xs[i]);
+  stopTimer(&t, "atan2/libm", BENCH_SAMPLES);
+
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    headings[i] = fastAtan2f(ys[i], xs[i]);
+  stopTimer(&t, "atan2/polynomial", BENCH_SAMPLES);
+
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    headings[i] = lutAtan2f(ys[i], xs[i]);
+  stopTimer(&t, "atan2/lut", BENCH_SAMPLES);
+
+  cal.deviationModel = DEVIATION_MODEL_HARMONIC;
+  fitHarmonics(&cal);
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    getHeading(&cal, &points[i], &headings[i]);
+  stopTimer(&t, "getHeading/harmonic", BENCH_SAMPLES);
+}
+
+// Deviation lookup cost should not depend on the number of fine points.
+void benchDeviation(const float* compass, float* headings) {
+  int finePoints[] = { 4, 12, MAX_CALIBRATION_POINTS, 0 };
+  Timer t;
+  long i;
+  int k;
+
+  for (k=0; finePoints[k] > 0; k++) {
+    Calibration fine;
+    syntheticCalibration(finePoints[k], &fine);
+    char name[48];
+
+    startTimer(&t);
+    for (i=0; i<BENCH_SAMPLES; i++)
+      headings[i] = applyDeviation(&fine, compass[i]);
+    sprintf(name, "applyDeviation/%i", finePoints[k]);
+    stopTimer(&t, name, BENCH_SAMPLES);
+
+    startTimer(&t);
+    for (i=0; i<BENCH_SAMPLES; i++)
+      headings[i] = scanDeviation(&fine, compass[i]);
+    sprintf(name, "scanDeviation/%i", finePoints[k]);
+    stopTimer(&t, name, BENCH_SAMPLES);
+  }
+}
+
+void benchCalibration(const Point* points) {
+  const char* files[] = {
+    "./data/flat1.csv",
+    "./data/flat2.csv",
+    "./data/rot45.csv",
+    NULL
+  };
+  static CalibrationContext ctx;
+  Calibration cal;
+  Timer t;
+  long i;
+  int k;
+  const int rounds = BENCH_SAMPLES / MAX_SENSOR_POINTS;
+
+  startTimer(&t);
+  for (k=0; k<rounds; k++) {
+    startCalibration(&ctx);
+    for (i=0; i<MAX_SENSOR_POINTS; i++)
+      addCalibrationPoint(&ctx, &points[k * MAX_SENSOR_POINTS + i], NULL);
+  }
+  stopTimer(&t, "addCalibrationPoint", (long)rounds * MAX_SENSOR_POINTS);
+
+  // Past MAX_SENSOR_POINTS every reading goes through the reservoir.
+  startCalibration(&ctx);
+  ctx.retention = RETENTION_RESERVOIR;
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    addCalibrationPoint(&ctx, &points[i], NULL);
+  stopTimer(&t, "addCalibrationPoint/reservoir", BENCH_SAMPLES);
+
+  startTimer(&t);
+  for (k=0; k<rounds; k++) {
+    startCalibration(&ctx);
+    enableCoverage(&ctx);
+    for (i=0; i<MAX_SENSOR_POINTS; i++)
+      addCalibrationPoint(&ctx, &points[k * MAX_SENSOR_POINTS + i], NULL);
+  }
+  stopTimer(&t, "addCalibrationPoint/coverage", (long)rounds * MAX_SENSOR_POINTS);
+
+  startTimer(&t);
+  for (i=0; i<1000; i++)
+    finalizeCalibration(&ctx, &cal, NULL);
+  stopTimer(&t, "finalizeCalibration/reservoir", 1000);
+
+  StreamCalibrationContext stream;
+  startStreamCalibration(&stream);
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    addStreamCalibrationPoint(&stream, &points[i], NULL);
+  stopTimer(&t, "addStreamCalibrationPoint", BENCH_SAMPLES);
+
+  // The same points summed in parallel, per point on 1 to 4 threads.
+  // Thread counts beyond the online cores would only time the scheduler,
+  // so they are left out rather than reported as a flat curve.
+  int threads;
+  int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  for (threads=1; threads<=4 && (threads == 1 || threads <= cores); threads*=2) {
+    char name[48];
+    StreamCalibrationContext parallel;
+    startStreamCalibration(&parallel);
+    snprintf(name, sizeof(name), "addStreamCalibrationPoints/%d", threads);
+    startTimer(&t);
+    addStreamCalibrationPoints(&parallel, points, BENCH_SAMPLES, threads);
+    stopTimer(&t, name, BENCH_SAMPLES);
+  }
+
+  startTimer(&t);
+  for (k=0; k<10000; k++)
+    finalizeStreamCalibration(&stream, &cal, NULL);
+  stopTimer(&t, "finalizeStreamCalibration", 10000);
+
+  for (k=0; files[k] != NULL; k++) {
+    char name[48];
+    if (csvContext(files[k], &ctx) == 0)
+      continue;
+    startTimer(&t);
+    for (i=0; i<1000; i++)
+      finalizeCalibration(&ctx, &cal, NULL);
+    sprintf(name, "finalizeCalibration/%s", strrchr(files[k], '/') + 1);
+    stopTimer(&t, name, 1000);
+  }
+
+  syntheticContext(MAX_CALIBRATION_POINTS, &ctx);
+  startTimer(&t);
+  for (i=0; i<1000; i++)
+    finalizeCalibration(&ctx, &cal, NULL);
+  stopTimer(&t, "finalizeCalibration/synthetic", 1000);
+
+  startTimer(&t);
+  for (i=0; i<100; i++)
+    finalizeCalibrationRobust(&ctx, &cal, NULL, NULL);
+  stopTimer(&t, "finalizeCalibrationRobust", 100);
+
+  ctx.deviationModel = DEVIATION_MODEL_HARMONIC;
+  startTimer(&t);
+  for (i=0; i<1000; i++)
+    finalizeCalibration(&ctx, &cal, NULL);
+  stopTimer(&t, "finalizeCalibration/harmonic", 1000);
+
+  ctx.deviationModel = DEVIATION_MODEL_TABLE;
+  ctx.originModel = ORIGIN_CIRCLE;
+  startTimer(&t);
+  for (i=0; i<1000; i++)
+    finalizeCalibration(&ctx, &cal, NULL);
+  stopTimer(&t, "finalizeCalibration/circle", 1000);
+
+  ctx.originModel = ORIGIN_ELLIPSE;
+  startTimer(&t);
+  for (i=0; i<1000; i++)
+    finalizeCalibration(&ctx, &cal, NULL);
+  stopTimer(&t, "finalizeCalibration/ellipse", 1000);
+
+  // One fine point corrected at a time, against finalizing again.
+  syntheticCalibration(MAX_CALIBRATION_POINTS, &cal);
+  startTimer(&t);
+  for (i=0; i<10000; i++)
+    replaceFinePoint(&cal, i % cal.pointCount, &points[i], fmodf(i * 3.6f, 360));
+  stopTimer(&t, "replaceFinePoint", 10000);
+
+  // Includes one refinement every 100 readings.
+  static AdaptiveCalibration ad;
+  startAdaptiveCalibration(&ad, &cal, 100);
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    addAdaptiveSample(&ad, &points[i]);
+  stopTimer(&t, "addAdaptiveSample", BENCH_SAMPLES);
+}
+
+// Plane normal from the covariance of each block of readings.
+void benchPlane(const Point* points) {
+  static CalibrationCtxPoint block[MAX_SENSOR_POINTS];
+  CovarianceMatrix covars[64];
+  Point normal;
+  float values[3];
+  Timer t;
+  long i;
+  int k;
+
+  for (k=0; k<64; k++) {
+    Point centroidPt;
+    for (i=0; i<MAX_SENSOR_POINTS; i++)
+      block[i].sensorData = points[k * MAX_SENSOR_POINTS + i];
+    centroid(block, MAX_SENSOR_POINTS, &centroidPt);
+    covariance(block, MAX_SENSOR_POINTS, &centroidPt, &covars[k]);
+  }
+
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    symmetricEigen(&covars[i & 63], values, &normal);
+  stopTimer(&t, "symmetricEigen", BENCH_SAMPLES);
+
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    weightedDir(&covars[i & 63], &normal);
+  stopTimer(&t, "weightedDir", BENCH_SAMPLES);
+
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES / 10; i++)
+    jacobiEigen(&covars[i & 63], values, &normal);
+  stopTimer(&t, "jacobiEigen", BENCH_SAMPLES / 10);
+}
+
+void benchFixed(const Point* points) {
+  FixedCalibrationContext ctx;
+  FixedCalibration cal;
+  RawPoint* raw = malloc(BENCH_SAMPLES * sizeof(RawPoint));
+  uint16_t* headings = malloc(BENCH_SAMPLES * sizeof(uint16_t));
+  Timer t;
+  long i;
+
+  for (i=0; i<BENCH_SAMPLES; i++) {
+    raw[i].x = (int16_t)points[i].x;
+    raw[i].y = (int16_t)points[i].y;
+    raw[i].z = (int16_t)points[i].z;
+  }
+
+  startFixedCalibration(&ctx);
+  startTimer(&t);
+  for (i=0; i<FIXED_MAX_SENSOR_POINTS; i++)
+    addFixedCalibrationPoint(&ctx, &raw[i], NULL);
+  stopTimer(&t, "addFixedCalibrationPoint", FIXED_MAX_SENSOR_POINTS);
+
+  startTimer(&t);
+  for (i=0; i<100000; i++)
+    finalizeFixedCalibration(&ctx, &cal, NULL);
+  stopTimer(&t, "finalizeFixedCalibration", 100000);
+
+  startTimer(&t);
+  for (i=0; i<BENCH_SAMPLES; i++)
+    getFixedHeading(&cal, &raw[i], &headings[i]);
+  stopTimer(&t, "getFixedHeading", BENCH_SAMPLES);
+
+  free(raw);
+  free(headings);
+}
+
+void writeResults(const char* fileName) {
+  FILE* out = fopen(fileName, "w");
+  if (out == NULL) {
+    printf("Cannot write: %s\n", fileName);
+    return;
+  }
+  fprintf(out, "name,ops,ns_per_op,cycles_per_op,allocs_per_op\n");
+  int i;
+  for (i=0; i<resultCount; i++)
+    fprintf(out, "%s,%ld,%.3f,%.1f,%.3f\n", results[i].name, results[i].ops,
+	    results[i].nsPerOp, results[i].cyclesPerOp, results[i].allocsPerOp);
+  fclose(out);
+}
+
+/*
+ * Returns the number of benchmarks slower than the baseline by more
+ * than threshold percent. A baseline recorded on another machine is
+ * first scaled by how much slower the reference kernel runs here than
+ * it did there, so that only changes in the code count.
+ */
+int compareBaseline(const char* fileName, float threshold) {
+  FILE* in = fopen(fileName, "r");
+  if (in == NULL) {
+    printf("Cannot open baseline: %s\n", fileName);
+    return 0;
+  }
+
+  double scale = 1.0;
+  char line[256];
+  char name[48];
+  double nsPerOp;
+  while (fgets(line, sizeof(line), in))
+    if (sscanf(line, "%47[^,],%*d,%lf", name, &nsPerOp) == 2 && strcmp(name, "reference") == 0 &&
+	nsPerOp > 0 && resultNs("reference") > 0)
+      scale = resultNs("reference") / nsPerOp;
+  printf("\nBaseline times scaled by %.2f, the reference kernel's time here over its time there\n", scale);
+  rewind(in);
+
+  int regressions = 0;
+  while (fgets(line, sizeof(line), in)) {
+    if (sscanf(line, "%47[^,],%*d,%lf", name, &nsPerOp) != 2)
+      continue;
+    nsPerOp *= scale;
+    int i;
+    for (i=0; i<resultCount; i++) {
+      if (strcmp(results[i].name, name) != 0)
+	continue;
+      double change = (results[i].nsPerOp - nsPerOp) / nsPerOp * 100;
+      if (change > threshold && results[i].nsPerOp - nsPerOp > MIN_REGRESSION_NS) {
+	printf("REGRESSION %-32s %10.2f -> %10.2f ns/op (%+.1f%%)\n", name, nsPerOp, results[i].nsPerOp, change);
+	regressions++;
+      }
+    }
+  }
+  fclose(in);
+  return regressions;
+}
+
+/*
+ * A synthetic fleet: one log per vessel in a temporary directory, each
+ * a noisy turn around its own hard iron offset.
+ */
+FleetJob* writeFleet(char* dir) {
+  if (mkdtemp(dir) == NULL)
+    return NULL;
+  FleetJob* jobs = calloc(FLEET_LOGS, sizeof(FleetJob));
+  int i, j;
+  for (i=0; i<FLEET_LOGS; i++) {
+    char* name = malloc(strlen(dir) + 16);
+    sprintf(name, "%s/%04d.csv", dir, i);
+    jobs[i].fileName = name;
+    FILE* stream = fopen(name, "w");
+    float offset = (i % 41) * 10.0f;
+    for (j=0; j<FLEET_LOG_READINGS; j++) {
+      Point p;
+      syntheticPoint(j * 360.0f / FLEET_LOG_READINGS, 5, &p);
+      fprintf(stream, "%.1f,%.1f,%.1f\n", p.x + offset, p.y - offset, p.z);
+    }
+    fclose(stream);
+  }
+  return jobs;
+}
+
+void removeFleet(char* dir, FleetJob* jobs) {
+  int i;
+  for (i=0; i<FLEET_LOGS; i++) {
+    unlink(jobs[i].fileName);
+    free((char*)jobs[i].fileName);
+  }
+  free(jobs);
+  rmdir(dir);
+}
+
+/*
+ * A long log of integer readings, as the sensors write them, in the
+ * fleet directory. Returns its size in bytes.
+ */
+long writeLongLog(const char* dir, const Point* points, char* name) {
+  sprintf(name, "%s/long.csv", dir);
+  FILE* stream = fopen(name, "w");
+  long i;
+  for (i=0; i<BENCH_SAMPLES; i++)
+    fprintf(stream, "%d,%d,%d\n", (int)points[i].x, (int)points[i].y, (int)points[i].z);
+  long size = ftell(stream);
+  fclose(stream);
+  return size;
+}
+
+/*
+ * Per reading, parsed as the tests used to (fgets, strdup, strtok and
+ * atof per line) and by readSensorLog from the mapped file.
+ */
+void benchLog(const char* name, float* xs) {
+  Timer t;
+  long n = 0;
+
+  startTimer(&t);
+  FILE* stream = fopen(name, "r");
+  char line[1024];
+  while (fgets(line, sizeof(line), stream)) {
+    char* tmp = strdup(line);
+    Point p;
+    p.x = atof(strtok(tmp, ","));
+    p.y = atof(strtok(NULL, ","));
+    p.z = atof(strtok(NULL, ",\n"));
+    xs[n++] = p.x + p.y + p.z;
+    free(tmp);
+  }
+  fclose(stream);
+  stopTimer(&t, "parseLog/strtok", n);
+
+  SensorLog log;
+  Point batch[256];
+  int k;
+  n = 0;
+  startTimer(&t);
+  openSensorLog(&log, name);
+  while ((k = readSensorLog(&log, batch, 256)) > 0)
+    xs[n++] = batch[k - 1].x + batch[k - 1].y + batch[k - 1].z;
+  closeSensorLog(&log);
+  stopTimer(&t, "parseLog/mapped", log.readingCount);
+}
+
+// Per log, on one thread and on one per CPU.
+void benchFleet(FleetJob* jobs) {
+  Timer t;
+
+  startTimer(&t);
+  calibrateFleet(jobs, FLEET_LOGS, 1);
+  stopTimer(&t, "calibrateFleet/serial", FLEET_LOGS);
+
+  startTimer(&t);
+  calibrateFleet(jobs, FLEET_LOGS, 0);
+  stopTimer(&t, "calibrateFleet/parallel", FLEET_LOGS);
+}
+
+int main(int argc, char** argv) {
+  const char* outFile = "bench_results.csv";
+  const char* baselineFile = NULL;
+  float threshold = 50;
+  int repeat = 5;
+  int i;
+
+  for (i=1; i<argc; i++) {
+    if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+      outFile = argv[++i];
+    else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+      baselineFile = argv[++i];
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+      threshold = atof(argv[++i]);
+    else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+      repeat = atoi(argv[++i]);
+    else {
+      printf("Usage: %s [--out FILE] [--baseline FILE] [--threshold PERCENT] [--repeat N]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  srand(123);
+
+  Point* points = malloc(BENCH_SAMPLES * sizeof(Point));
+  float* xs = malloc(BENCH_SAMPLES * sizeof(float));
+  float* ys = malloc(BENCH_SAMPLES * sizeof(float));
+  float* zs = malloc(BENCH_SAMPLES * sizeof(float));
+  float* compass = malloc(BENCH_SAMPLES * sizeof(float));
+  float* headings = malloc(BENCH_SAMPLES * sizeof(float));
+
+  long j;
+  for (j=0; j<BENCH_SAMPLES; j++) {
+    syntheticPoint(randFloat(0, 360), 5, &points[j]);
+    xs[j] = points[j].x;
+    ys[j] = points[j].y;
+    zs[j] = points[j].z;
+    compass[j] = randFloat(0, 360);
+  }
+
+  char fleetDir[] = "/tmp/compaxx-fleetXXXXXX";
+  FleetJob* fleet = writeFleet(fleetDir);
+  char longLog[64];
+  long longLogSize = fleet ? writeLongLog(fleetDir, points, longLog) : 0;
+
+  for (i=0; i<repeat; i++) {
+    benchReference(points);
+    benchHeading(points, xs, ys, zs, headings);
+    benchDeviation(compass, headings);
+    benchCalibration(points);
+    benchFixed(points);
+    benchPlane(points);
+    if (fleet) {
+      benchFleet(fleet);
+      benchLog(longLog, compass);
+    }
+  }
+  printResults();
+  if (fleet) {
+    printf("\nLog parsing: %.0f MB/s with strtok, %.0f MB/s mapped\n",
+	   longLogSize / 1e6 / (resultNs("parseLog/strtok") * BENCH_SAMPLES * 1e-9),
+	   longLogSize / 1e6 / (resultNs("parseLog/mapped") * BENCH_SAMPLES * 1e-9));
+    unlink(longLog);
+  }
+
+  if (fleet)
+    removeFleet(fleetDir, fleet);
+
+  free(points);
+  free(xs);
+  free(ys);
+  free(zs);
+  free(compass);
+  free(headings);
+
+  writeResults(outFile);
+  if (baselineFile && compareBaseline(baselineFile, threshold) > 0) {
+    printf("** Benchmark regressions over %.0f%%\n", threshold);
+    return 1;
+  }
+  return 0;
+}
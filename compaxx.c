@@ -3,11 +3,6 @@
 #include "compaxx_int.h"
 
 #include <math.h>
-#include <stdio.h>
-
-void printPt(const Point* pt, const char* msg) {
-  printf("%s: (%f, %f, %f)\n", msg, pt->x, pt->y, pt->z);
-}
 
 float sq(float n) {
   return n * n;
@@ -15,7 +10,7 @@ float sq(float n) {
 
 void centroid(const CalibrationCtxPoint* points, short numPoints, Point* result) {
   int i;
-  result->x = result->y = result->z = 0.0;
+  result->x = result->y = result->z = 0.0f;
   for (i=0; i<numPoints; i++) {
     result->x += points[i].sensorData.x;
     result->y += points[i].sensorData.y;
@@ -28,7 +23,7 @@ void centroid(const CalibrationCtxPoint* points, short numPoints, Point* result)
 }
 
 void covariance(const CalibrationCtxPoint* points, short numPoints, const Point* centroid, CovarianceMatrix* result) {
-  result->xx = result->xy = result->xz = result->yy = result->yz = result->zz = 0.0;
+  result->xx = result->xy = result->xz = result->yy = result->yz = result->zz = 0.0f;
   int i;
   for (i=0;  i<numPoints; i++) {
     Point r = {
@@ -85,68 +80,15 @@ float max3(float a, float b, float c) {
 
 void normalize(Point* pt) {
   // Divide by largest value first to avoid overflow.
-  float largest = max3(fabs(pt->x), fabs(pt->y), fabs(pt->z));
+  float largest = max3(fabsf(pt->x), fabsf(pt->y), fabsf(pt->z));
   pt->x /= largest;
   pt->y /= largest;
   pt->z /= largest;
 
-  float length = sqrt(sq(pt->x) + sq(pt->y) + sq(pt->z));
-  pt->x /= length;
-  pt->y /= length;
-  pt->z /= length;
-}
-
-short weightedDir(const CovarianceMatrix* covar, Point* weighted_dir) {
-  weighted_dir->x = weighted_dir->y = weighted_dir->z = 0.0;
-
-  float det_x = covar->yy * covar->zz - covar->yz * covar->yz;
-  float det_y = covar->xx * covar->zz - covar->xz * covar->xz;
-  float det_z = covar->xx * covar->yy - covar->xy * covar->xy;
-
-  float scaling = max3(fabs(det_x), fabs(det_y), fabs(det_z));
-
-  {
-    Point axis_dir = {
-      det_x,
-      covar->xz * covar->yz - covar->xy * covar->zz,
-      covar->xy * covar->yz - covar->xz * covar->yy
-    };
-    float weight = det_x * det_x;
-    if (dotProduct(weighted_dir, &axis_dir) < 0.0)
-      weight = -weight;
-    mulByScalar(&axis_dir, weight);
-    addTo(weighted_dir,&axis_dir);
-  }
-
-  {
-    Point axis_dir = {
-      covar->xz * covar->yz - covar->xy * covar->zz,
-      det_y,
-      covar->xy * covar->xz - covar->yz * covar->xx
-    };
-    float weight = det_y * det_y;
-    if (dotProduct(weighted_dir, &axis_dir) < 0.0)
-      weight = -weight;
-    mulByScalar(&axis_dir, weight);
-    addTo(weighted_dir,&axis_dir);
-  }
-
-  {
-    Point axis_dir = {
-      covar->xy * covar->yz - covar->xz * covar->yy,
-      covar->xy * covar->xz - covar->yz * covar->xx,
-      det_z,
-    };
-    float weight = det_z * det_z;
-    if (dotProduct(weighted_dir, &axis_dir) < 0.0)
-      weight = -weight;
-    mulByScalar(&axis_dir, weight);
-    addTo(weighted_dir,&axis_dir);
-  }
-
-  normalize(weighted_dir);
-
-  return E_SUCCESS;
+  float scale = 1.0f / sqrtf(sq(pt->x) + sq(pt->y) + sq(pt->z));
+  pt->x *= scale;
+  pt->y *= scale;
+  pt->z *= scale;
 }
 
 void normalToCartesian(const Point* normal, const Point* pt, Point* cartesian) {
@@ -168,7 +110,7 @@ void normalToCartesian(const Point* normal, const Point* pt, Point* cartesian) {
     d = -d;
   }
 
-  float length = sqrt(a*a + b*b + c*c + d*d);
+  float length = sqrtf(a*a + b*b + c*c + d*d);
   cartesian->x = a / length;
   cartesian->y = b / length;
   cartesian->z = c / length;
@@ -180,41 +122,65 @@ void pointVec(const Point* p1, const Point* p2, Point* v) {
   v->z = p2->z - p1->z;
 }
 
-float getCompassHeading(const Calibration* cal, const Point* sensorData) {
-  Point v1;
-  Point v2;
-
-  Point plane = { cal->planeA, cal->planeB, cal->planeC };
-  Point proj;
-
-  projectPoint(sensorData, &plane, &proj, NULL);
-  pointVec(&(cal->origin), &(cal->compassNorth), &v1);
-  pointVec(&(cal->origin), &proj, &v2);
-
-  Point cross;
-  crossProduct(&v1, &v2, &cross);
-
-  Point norm = { cal->planeA, cal->planeB, cal->planeC };
-  normalize(&norm);
-  float det = dotProduct(&norm, &cross);
-  float dot = dotProduct(&v1, &v2);
-
-  float rads = atan2(det, dot);
-  #define PI 3.14159265
-  float degrees = rads / PI * 180;
+float radsToHeading(float rads) {
+  float degrees = rads * RAD_TO_DEG_F;
   if (degrees < 0)
     degrees += 360;
-  if (fabs(degrees - 360.0) < 0.01)
+  if (fabsf(degrees - 360.0f) < 0.01f)
     degrees = 0;
   return degrees;
 }
 
-short getHeading(const Calibration* cal, const Point* sensorData, float* heading) {
-  float compassHeading = getCompassHeading(cal, sensorData);
+void compileTransform(Calibration* cal) {
+  HeadingTransform* t = &(cal->transform);
+  Point norm = { cal->planeA, cal->planeB, cal->planeC };
+  normalize(&norm);
+  t->normal = norm;
+
+  // Origin and compass north both lie on the plane, so the north
+  // vector is already perpendicular to the normal. Soft iron
+  // correction keeps it so, as it only acts within the plane.
+  Point north, u, v;
+  pointVec(&(cal->origin), &(cal->compassNorth), &north);
+  softIronApply(cal->softIron, &north, &u);
+  normalize(&u);
+  crossProduct(&norm, &u, &v);
+
+  // The correction is symmetric, so u . (S p) = (S u) . p
+  softIronApply(cal->softIron, &u, &(t->axisU));
+  softIronApply(cal->softIron, &v, &(t->axisV));
+  t->offsetU = dotProduct(&(t->axisU), &(cal->origin));
+  t->offsetV = dotProduct(&(t->axisV), &(cal->origin));
+}
+
+float getCompassHeading(const Calibration* cal, const Point* sensorData) {
+  /*
+   * Projecting the reading onto the plane only moves it along the
+   * normal, which both axes are perpendicular to, so the projection
+   * can be skipped entirely.
+   */
+  const HeadingTransform* t = &(cal->transform);
+  float u = dotProduct(&(t->axisU), sensorData) - t->offsetU;
+  float v = dotProduct(&(t->axisV), sensorData) - t->offsetV;
+  return radsToHeading(headingAtan2f(v, u));
+}
+
+float scanDeviation(const Calibration* cal, float compassHeading) {
   float magFrom, magTo, compFrom, compTo;
 
+  if (cal->pointCount == 0)
+    return compassHeading;
+  if (cal->pointCount == 1) {
+    float rawHeading = compassHeading + cal->calibrationData[0].magneticHeading - cal->calibrationData[0].compassHeading;
+    if (rawHeading < 0)
+      rawHeading += 360;
+    if (rawHeading > 360.0f)
+      rawHeading -= 360.0f;
+    return rawHeading;
+  }
+
   int i=0;
-  while (cal->calibrationData[i].compassHeading < compassHeading && i < cal->pointCount)
+  while (i < cal->pointCount && cal->calibrationData[i].compassHeading < compassHeading)
     i++;
 
   if (i == cal->pointCount || i == 0) {
@@ -229,42 +195,202 @@ short getHeading(const Calibration* cal, const Point* sensorData, float* heading
     compTo = cal->calibrationData[i].compassHeading;
   }
 
-  if (fabs(magTo - magFrom) > 180.0) {
+  if (fabsf(magTo - magFrom) > 180.0f) {
     if (magTo > magFrom)
       magFrom += 360;
     else
       magTo += 360;
   }
 
-  if (fabs(compTo - compFrom) > 180.0) {
+  if (fabsf(compTo - compFrom) > 180.0f) {
     if (compTo > compFrom)
       compFrom += 360;
     else
       compTo += 360;
   }
 
+  // Readings below the first entry fall in the wrapped segment.
+  if (compassHeading < compFrom)
+    compassHeading += 360;
+
   float proportion = (compassHeading - compFrom) / (compTo - compFrom);
   float rawHeading = (magTo - magFrom) * proportion + magFrom;
-  if (rawHeading > 360.0)
-    rawHeading -= 360.0;
-  *heading = rawHeading;
+  if (rawHeading > 360.0f)
+    rawHeading -= 360.0f;
+  return rawHeading;
+}
+
+/*
+ * Builds count bins of the deviation table starting with bin first,
+ * wrapping around past the last one.
+ */
+void buildDeviationBins(Calibration* cal, int first, int count) {
+#if DEVIATION_TABLE_BINS > 0
+  const float width = 360.0f / DEVIATION_TABLE_BINS;
+  float from = scanDeviation(cal, first * width);
+  int k;
+  for (k=0; k<count; k++) {
+    int i = (first + k) % DEVIATION_TABLE_BINS;
+    float to = scanDeviation(cal, i == DEVIATION_TABLE_BINS - 1 ? 0 : (i + 1) * width);
+
+    // Unwrap so the bin never interpolates the long way round.
+    float next = to;
+    if (to - from > 180.0f)
+      to -= 360;
+    else if (to - from < -180.0f)
+      to += 360;
+
+    DeviationBin* bin = &(cal->deviationTable[i]);
+    bin->slope = (to - from) / width;
+    bin->offset = from - bin->slope * i * width;
+    from = next;
+  }
+#endif
+}
+
+void buildDeviationTable(Calibration* cal) {
+  buildDeviationBins(cal, 0, DEVIATION_TABLE_BINS);
+}
+
+/*
+ * Least squares fit of the harmonic model to calibrationData, solved
+ * through the normal equations. Fewer points fit fewer terms, so the
+ * system is never underdetermined.
+ */
+short fitHarmonics(Calibration* cal) {
+  float ata[HARMONIC_COEFFICIENTS * HARMONIC_COEFFICIENTS];
+  float atb[HARMONIC_COEFFICIENTS];
+  short terms = cal->pointCount >= 5 ? 5 : (cal->pointCount >= 3 ? 3 : 1);
+  int i, j, k;
+
+  for (i=0; i<HARMONIC_COEFFICIENTS; i++)
+    cal->harmonics[i] = 0;
+  if (cal->pointCount == 0)
+    return E_SUCCESS;
+
+  for (i=0; i<terms * terms; i++)
+    ata[i] = 0;
+  for (i=0; i<terms; i++)
+    atb[i] = 0;
+
+  for (k=0; k<cal->pointCount; k++) {
+    float basis[HARMONIC_COEFFICIENTS];
+    harmonicBasis(cal->calibrationData[k].compassHeading, basis);
+    float deviation = cal->calibrationData[k].magneticHeading - cal->calibrationData[k].compassHeading;
+    if (deviation > 180.0f)
+      deviation -= 360;
+    else if (deviation < -180.0f)
+      deviation += 360;
+
+    for (i=0; i<terms; i++) {
+      for (j=0; j<terms; j++)
+	ata[i * terms + j] += basis[i] * basis[j];
+      atb[i] += basis[i] * deviation;
+    }
+  }
+
+  short rc = solveLinear(ata, atb, terms);
+  if (rc != E_SUCCESS)
+    return rc;
+  for (i=0; i<terms; i++)
+    cal->harmonics[i] = atb[i];
+  return E_SUCCESS;
+}
+
+void harmonicBasis(float compassHeading, float* basis) {
+  float rads = compassHeading * DEG_TO_RAD_F;
+  float s = sinf(rads);
+  float c = cosf(rads);
+  basis[0] = 1;
+  basis[1] = s;
+  basis[2] = c;
+  basis[3] = 2 * s * c;
+  basis[4] = c * c - s * s;
+}
+
+float applyHarmonics(const float* harmonics, float compassHeading) {
+  float basis[HARMONIC_COEFFICIENTS];
+  harmonicBasis(compassHeading, basis);
+  float rawHeading = compassHeading;
+  int i;
+  for (i=0; i<HARMONIC_COEFFICIENTS; i++)
+    rawHeading += harmonics[i] * basis[i];
+  if (rawHeading < 0)
+    rawHeading += 360;
+  else if (rawHeading >= 360.0f)
+    rawHeading -= 360.0f;
+  return rawHeading;
+}
+
+float applyDeviation(const Calibration* cal, float compassHeading) {
+  if (cal->deviationModel == DEVIATION_MODEL_HARMONIC)
+    return applyHarmonics(cal->harmonics, compassHeading);
+
+#if DEVIATION_TABLE_BINS > 0
+  int i = (int)(compassHeading * (DEVIATION_TABLE_BINS / 360.0f));
+  if (i >= DEVIATION_TABLE_BINS)
+    i = DEVIATION_TABLE_BINS - 1;
+  const DeviationBin* bin = &(cal->deviationTable[i]);
+  float rawHeading = bin->offset + bin->slope * compassHeading;
+  if (rawHeading < 0)
+    rawHeading += 360;
+  else if (rawHeading >= 360.0f)
+    rawHeading -= 360.0f;
+  return rawHeading;
+#else
+  return scanDeviation(cal, compassHeading);
+#endif
+}
+
+short getHeading(const Calibration* cal, const Point* sensorData, float* heading) {
+  *heading = applyDeviation(cal, getCompassHeading(cal, sensorData));
   return E_SUCCESS;
 }
 
+#define RETENTION_SEED 12345UL
+
 short startCalibration(CalibrationContext* ctx) {
   ctx->pointCount = 0;
   ctx->finePointCount = 0;
+  ctx->deviationModel = DEVIATION_MODEL_TABLE;
+  ctx->originModel = ORIGIN_CENTROID;
+  ctx->retention = RETENTION_NONE;
+  ctx->seenCount = 0;
+  ctx->retentionState = RETENTION_SEED;
+  ctx->trackCoverage = 0;
+  coverageReset(&(ctx->coverage));
   return E_SUCCESS;
 }
 
+/*
+ * Reservoir sampling (Vitter's algorithm R) over all points but the
+ * first: the n-th point replaces a random one of points[1..] with
+ * probability (MAX_SENSOR_POINTS - 1) / (n - 1), which leaves each
+ * point seen so far equally likely to be kept.
+ */
+void retainPoint(CalibrationContext* ctx, const Point* sensorData) {
+  uint32_t r = (uint32_t)robustRandom(&(ctx->retentionState)) << 16;
+  r |= robustRandom(&(ctx->retentionState));
+  uint32_t slot = 1 + r % (ctx->seenCount - 1);
+  if (slot < MAX_SENSOR_POINTS)
+    ctx->points[slot].sensorData = *sensorData;
+}
+
 short addCalibrationPoint(CalibrationContext* ctx, const Point* sensorData, const float* magneticHeading) {
-  if (ctx->pointCount == MAX_SENSOR_POINTS)
+  if (ctx->pointCount == MAX_SENSOR_POINTS && ctx->retention == RETENTION_NONE)
     return E_TOO_MANY_COARSE_POINTS;
   if (magneticHeading && ctx->finePointCount == MAX_CALIBRATION_POINTS)
     return E_TOO_MANY_FINE_POINTS;
 
-  ctx->points[ctx->pointCount].sensorData = *sensorData;
-  ctx->pointCount++;
+  ctx->seenCount++;
+  if (ctx->pointCount < MAX_SENSOR_POINTS) {
+    ctx->points[ctx->pointCount].sensorData = *sensorData;
+    ctx->pointCount++;
+  } else {
+    retainPoint(ctx, sensorData);
+  }
+  if (ctx->trackCoverage)
+    coverageAdd(ctx, sensorData);
   if (magneticHeading != NULL) {
     ctx->finePoints[ctx->finePointCount].sensorData = *sensorData;
     ctx->finePoints[ctx->finePointCount].magneticHeading = *magneticHeading;
@@ -274,29 +400,29 @@ short addCalibrationPoint(CalibrationContext* ctx, const Point* sensorData, cons
 }
 
 float ptPlaneDistance(const Point* pt, const Calibration* plane) {
-  float planeD = sqrt(1.0 - plane->planeA * plane->planeA - plane->planeB * plane->planeB - plane->planeC * plane->planeC);
+  float planeD = sqrtf(1.0f - plane->planeA * plane->planeA - plane->planeB * plane->planeB - plane->planeC * plane->planeC);
   return
-    fabs(plane->planeA * pt->x + plane->planeB * pt->y + plane->planeC * pt->z + planeD) /
-    sqrt(plane->planeA * plane->planeA + plane->planeB * plane->planeB + plane->planeC * plane->planeC);
+    fabsf(plane->planeA * pt->x + plane->planeB * pt->y + plane->planeC * pt->z + planeD) /
+    sqrtf(plane->planeA * plane->planeA + plane->planeB * plane->planeB + plane->planeC * plane->planeC);
 }
 
 float rmse(const CalibrationContext* ctx, const Calibration* cal) {
-  float mse = 0.0;
+  float mse = 0.0f;
   int i;
   for (i=0; i<ctx->pointCount; i++) {
     float dist = ptPlaneDistance(&(ctx->points[i].sensorData), cal);
     mse += dist * dist;
   }
-  return sqrt(mse / (float)(ctx->pointCount));
+  return sqrtf(mse / (float)(ctx->pointCount));
 }
 
 float vecLength(const Point* pt) {
-  return sqrt(sq((float)(pt->x)) + sq((float)(pt->y)) + sq((float)(pt->z)));
+  return sqrtf(sq((float)(pt->x)) + sq((float)(pt->y)) + sq((float)(pt->z)));
 }
 
 float meanLength(const CalibrationContext* ctx) {
   int i;
-  float totalLength = 0.0;
+  float totalLength = 0.0f;
   for (i=0; i<ctx->pointCount; i++) {
     totalLength += vecLength(&(ctx->points[i].sensorData));
   }
@@ -305,12 +431,12 @@ float meanLength(const CalibrationContext* ctx) {
 
 void pointOnPlane(const Point* plane, Point* pt) {
   float coords[3] = { plane->x, plane->y, plane->z };
-  float d = sqrt(1.0 - sq(plane->x) - sq(plane->y) - sq(plane->z));
+  float d = sqrtf(1.0f - sq(plane->x) - sq(plane->y) - sq(plane->z));
   int i;
-  int maxAbs = 0.0;
+  float maxAbs = 0.0f;
   int maxIdx = -1;
   for (i=0; i<3; i++) {
-    if (fabs(coords[i]) > fabs(maxAbs)) {
+    if (fabsf(coords[i]) > fabsf(maxAbs)) {
       maxAbs = coords[i];
       maxIdx = i;
     }
@@ -318,7 +444,7 @@ void pointOnPlane(const Point* plane, Point* pt) {
 
   for (i=0; i<3; i++) {
     if (i == maxIdx)
-      coords[i] = d / coords[i];
+      coords[i] = -d / coords[i];
     else
       coords[i] = 0;
   }
@@ -355,49 +481,160 @@ void sortTable(CalibrationPoint* data, int n) {
   }
 }
 
-short finalizeCalibration(const CalibrationContext* ctx, Calibration* cal, float* quality) {
-  // Coarse calibration
-
-  Point centroidPt;
-  CovarianceMatrix covar;
+short fitPlane(const Point* centroidPt, const CovarianceMatrix* covar, Calibration* cal) {
   Point normal;
   Point cartesian;
-  centroid(ctx->points, ctx->pointCount, &centroidPt);
-  covariance(ctx->points, ctx->pointCount, &centroidPt, &covar);
-
-  weightedDir(&covar, &normal);
-  normalToCartesian(&normal, &centroidPt, &cartesian);
+  float variances[3];
+  short rc = symmetricEigen(covar, variances, &normal);
+  if (rc != E_SUCCESS)
+    return rc;
+  if (!(variances[1] > variances[2] * PLANE_MIN_SPREAD) || variances[0] > variances[1] * PLANE_MAX_THICKNESS)
+    return E_DEGENERATE_CALIBRATION;
+
+  normalToCartesian(&normal, centroidPt, &cartesian);
   cal->planeA = cartesian.x;
   cal->planeB = cartesian.y;
   cal->planeC = cartesian.z;
+  return E_SUCCESS;
+}
 
-  if (quality)
-    *quality = 100.0 - rmse(ctx, cal) / meanLength(ctx) * 100;
-
+short finishCalibration(Calibration* cal, const Point* origin, const Point* rawCompassNorth, const float* softIron,
+		       const CalibrationCtxPoint* finePoints, int finePointCount, short deviationModel) {
   // Origin and compass north for compass heading
-  Point origin;
-  if (ctx->finePointCount > 4) // Minimum 4 points to get the centre
-    centroid(ctx->finePoints, ctx->finePointCount, &origin);
-  else
-    centroid(ctx->points, ctx->pointCount, &origin);
-
-  Point rawCompassNorth = { ctx->points[0].sensorData.x,
-			    ctx->points[0].sensorData.y,
-			    ctx->points[0].sensorData.z };
-  projectPoint(&origin, &cartesian, &(cal->origin), NULL);
-  projectPoint(&rawCompassNorth, &cartesian, &(cal->compassNorth), NULL);
+  Point cartesian = { cal->planeA, cal->planeB, cal->planeC };
+  projectPoint(origin, &cartesian, &(cal->origin), NULL);
+  projectPoint(rawCompassNorth, &cartesian, &(cal->compassNorth), NULL);
+  int i;
+  for (i=0; i<9; i++)
+    cal->softIron[i] = softIron ? softIron[i] : (i % 4 == 0 ? 1.0f : 0.0f);
+  compileTransform(cal);
+  cal->verticalField = 0.0f;
 
   // Fine calibration
-  int i;
-  for (i=0; i<ctx->finePointCount; i++) {
-    cal->calibrationData[i].compassHeading = getCompassHeading(cal, &(ctx->finePoints[i].sensorData));
-    cal->calibrationData[i].magneticHeading = ctx->finePoints[i].magneticHeading;
+  for (i=0; i<finePointCount; i++) {
+    cal->calibrationData[i].compassHeading = getCompassHeading(cal, &(finePoints[i].sensorData));
+    cal->calibrationData[i].magneticHeading = finePoints[i].magneticHeading;
   }
-  cal->pointCount = ctx->finePointCount;
+  cal->pointCount = finePointCount;
 
   //  for (i=0; i<cal->pointCount; i++)
   //  printf("C: %f M: %f\n", cal->calibrationData[i].compassHeading, cal->calibrationData[i].magneticHeading);
 
   sortTable(cal->calibrationData, cal->pointCount);
+  cal->deviationModel = deviationModel;
+  if (deviationModel == DEVIATION_MODEL_HARMONIC)
+    return fitHarmonics(cal);
+  buildDeviationTable(cal);
   return E_SUCCESS;
 }
+
+/*
+ * Brings the deviation model up to date after calibrationData changed
+ * between entries lo and hi, which are either side of an entry
+ * inserted or removed. Only bins between them depend on it, unless
+ * there are too few entries for interpolation, when all do.
+ */
+short updateDeviation(Calibration* cal, int lo, int hi) {
+  if (cal->deviationModel == DEVIATION_MODEL_HARMONIC)
+    return fitHarmonics(cal);
+#if DEVIATION_TABLE_BINS > 0
+  if (cal->pointCount < 3) {
+    buildDeviationTable(cal);
+    return E_SUCCESS;
+  }
+  int first = (int)(cal->calibrationData[lo].compassHeading * (DEVIATION_TABLE_BINS / 360.0f));
+  int last = (int)(cal->calibrationData[hi].compassHeading * (DEVIATION_TABLE_BINS / 360.0f));
+  if (first >= DEVIATION_TABLE_BINS)
+    first = DEVIATION_TABLE_BINS - 1;
+  if (last >= DEVIATION_TABLE_BINS)
+    last = DEVIATION_TABLE_BINS - 1;
+  int count = (last - first + DEVIATION_TABLE_BINS) % DEVIATION_TABLE_BINS + 1;
+  // A segment that wraps past 360 and ends in the bin it started in
+  // goes all the way round.
+  if (hi <= lo && last == first)
+    count = DEVIATION_TABLE_BINS;
+  buildDeviationBins(cal, first, count);
+#endif
+  return E_SUCCESS;
+}
+
+short insertFinePoint(Calibration* cal, const Point* sensorData, float magneticHeading) {
+  if (cal->pointCount == MAX_CALIBRATION_POINTS)
+    return E_TOO_MANY_FINE_POINTS;
+
+  // Binary search for the first entry with a greater compass heading.
+  float compassHeading = getCompassHeading(cal, sensorData);
+  int lo = 0, hi = cal->pointCount;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cal->calibrationData[mid].compassHeading > compassHeading)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  int i;
+  for (i=cal->pointCount; i>lo; i--)
+    cal->calibrationData[i] = cal->calibrationData[i - 1];
+  cal->calibrationData[lo].compassHeading = compassHeading;
+  cal->calibrationData[lo].magneticHeading = magneticHeading;
+  cal->pointCount++;
+  return updateDeviation(cal, (lo + cal->pointCount - 1) % cal->pointCount, (lo + 1) % cal->pointCount);
+}
+
+short removeFinePoint(Calibration* cal, int index) {
+  if (index < 0 || index >= cal->pointCount)
+    return E_NO_SUCH_POINT;
+
+  int i;
+  for (i=index; i<cal->pointCount - 1; i++)
+    cal->calibrationData[i] = cal->calibrationData[i + 1];
+  cal->pointCount--;
+  if (cal->pointCount == 0)
+    return updateDeviation(cal, 0, 0);
+  return updateDeviation(cal, (index + cal->pointCount - 1) % cal->pointCount, index % cal->pointCount);
+}
+
+short replaceFinePoint(Calibration* cal, int index, const Point* sensorData, float magneticHeading) {
+  short rc = removeFinePoint(cal, index);
+  if (rc != E_SUCCESS)
+    return rc;
+  return insertFinePoint(cal, sensorData, magneticHeading);
+}
+
+short finalizeCalibration(const CalibrationContext* ctx, Calibration* cal, float* quality) {
+  // Coarse calibration
+
+  Point centroidPt;
+  CovarianceMatrix covar;
+  centroid(ctx->points, ctx->pointCount, &centroidPt);
+  covariance(ctx->points, ctx->pointCount, &centroidPt, &covar);
+  short rc = fitPlane(&centroidPt, &covar, cal);
+  if (rc != E_SUCCESS)
+    return rc;
+
+  Point origin;
+  if (ctx->originModel != ORIGIN_CENTROID) {
+    float softIron[9];
+    float verticalField;
+    rc = fitOrigin(ctx, cal, &origin, softIron, &verticalField);
+    if (rc != E_SUCCESS)
+      return rc;
+    rc = finishCalibration(cal, &origin, &(ctx->points[0].sensorData), softIron, ctx->finePoints,
+			   ctx->finePointCount, ctx->deviationModel);
+    cal->verticalField = verticalField;
+  } else {
+    if (ctx->finePointCount > 4) // Minimum 4 points to get the centre
+      centroid(ctx->finePoints, ctx->finePointCount, &origin);
+    else
+      centroid(ctx->points, ctx->pointCount, &origin);
+
+    rc = finishCalibration(cal, &origin, &(ctx->points[0].sensorData), NULL, ctx->finePoints, ctx->finePointCount,
+			   ctx->deviationModel);
+  }
+
+  // The ellipsoid fit can tilt the plane, so quality comes after it.
+  if (rc == E_SUCCESS && quality)
+    *quality = 100.0f - rmse(ctx, cal) / meanLength(ctx) * 100;
+  return rc;
+}
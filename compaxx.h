@@ -4,20 +4,132 @@
 
 // The Compact Compass Library (CompaxxLib)
 
+#include <stdint.h>
+
 #define MAX_CALIBRATION_POINTS    36
 #define MAX_SENSOR_POINTS         200
 
+/*
+ * Work budget of finalizeCalibrationRobust: the number of candidate
+ * planes tried, and the number of least squares passes over the
+ * readings close to the best one. Each candidate costs one pass over
+ * the readings plus a median, so finalize time is bounded.
+ */
+#ifndef ROBUST_ITERATIONS
+#define ROBUST_ITERATIONS         32
+#endif
+#define ROBUST_REFINE_PASSES      2
+
 typedef struct {
   float compassHeading;
   float magneticHeading;
 } CalibrationPoint;
 
+/*
+ * Number of uniform bins in the deviation table that finalizeCalibration
+ * builds for getHeading. Each bin holds the slope and offset of the
+ * correction over 360 / DEVIATION_TABLE_BINS degrees, so lookup costs
+ * the same regardless of the number of fine calibration points. Bins
+ * take 8 bytes of RAM each; define as 0 to drop the table and scan
+ * calibrationData instead.
+ */
+#ifndef DEVIATION_TABLE_BINS
+#ifdef __AVR__
+#define DEVIATION_TABLE_BINS      0
+#else
+#define DEVIATION_TABLE_BINS      360
+#endif
+#endif
+
+typedef struct {
+  float slope;
+  float offset;
+} DeviationBin;
+
+/*
+ * How finalizeCalibration models deviation. The table interpolates
+ * linearly between fine calibration points. The harmonic model fits
+ * deviation = A + B sin(h) + C cos(h) + D sin(2h) + E cos(2h) by least
+ * squares, which needs only 5 coefficients and gives a smooth
+ * correction from as few as 5 fine points (with fewer points only A,
+ * or A to C, are fitted).
+ */
+#define DEVIATION_MODEL_TABLE     0
+#define DEVIATION_MODEL_HARMONIC  1
+#define HARMONIC_COEFFICIENTS     5
+
+/*
+ * How finalizeCalibration finds the origin, the centre of the readings
+ * in the calibration plane, from the coarse points. The centroid is
+ * only the centre when they cover the whole turn evenly; the fits find
+ * it from part of a turn. The ellipse and ellipsoid fits also find the
+ * soft iron correction that makes the readings round again.
+ *
+ * ORIGIN_CENTROID   Mean of the fine points if there are more than
+ *                   four, otherwise of the coarse points.
+ * ORIGIN_CIRCLE     Least squares circle in the plane, 3 or more points.
+ * ORIGIN_ELLIPSE    Least squares ellipse in the plane, 5 or more.
+ * ORIGIN_ELLIPSOID  Least squares ellipsoid, 9 or more points, which
+ *                   must include readings taken heeled or pitched.
+ *                   Also levels the plane, which soft iron tilts, and
+ *                   finds the hard iron offset in 3D, so setting
+ *                   verticalField. The soft iron correction is still
+ *                   only applied within the plane.
+ */
+#define ORIGIN_CENTROID           0
+#define ORIGIN_CIRCLE             1
+#define ORIGIN_ELLIPSE            2
+#define ORIGIN_ELLIPSOID          3
+
+/*
+ * How getHeading computes the angle of a reading in the calibration
+ * plane. The trade between cost and accuracy matters on targets
+ * without an FPU, where atan2 dominates the time of a heading:
+ *
+ * ATAN2_LIBM        atan2f from libm, exact to float precision.
+ * ATAN2_POLYNOMIAL  9th order polynomial, max error 0.0007 degrees.
+ * ATAN2_LUT         Linear interpolation in a 9 entry table, max
+ *                   error 0.08 degrees.
+ *
+ * ATAN2_LIBM is the default; builds opt in to a faster tier with, for
+ * example, -DHEADING_ATAN2=ATAN2_POLYNOMIAL.
+ */
+#define ATAN2_LIBM                0
+#define ATAN2_POLYNOMIAL          1
+#define ATAN2_LUT                 2
+
+#ifndef HEADING_ATAN2
+#define HEADING_ATAN2             ATAN2_LIBM
+#endif
+
 typedef struct {
   float x;
   float y;
   float z;
 } Point;
 
+/**
+ * Compiled form of the plane, origin and compass north, produced by
+ * finalizeCalibration or compileTransform. Compass heading of a
+ * sensor reading p is atan2(axisV . p - offsetV, axisU . p - offsetU),
+ * so the hot path needs two dot products and one atan2 instead of
+ * re-projecting the reading onto the plane on every call.
+ *
+ * axisU is the unit vector from origin towards compass north, axisV
+ * is the unit plane normal crossed with axisU. Headings agree with
+ * the geometric projection to within 0.01 degrees. A soft iron
+ * correction is folded into both axes, which are then multiplied by
+ * softIron and no longer of unit length. normal is the unit plane
+ * normal, which getHeadingTilt levels readings against.
+ */
+typedef struct {
+  Point axisU;
+  Point axisV;
+  float offsetU;
+  float offsetV;
+  Point normal;
+} HeadingTransform;
+
 typedef struct {
   /**
    * A plane is stored in cartesian representation (ax + by + cz + d = 0),
@@ -32,9 +144,47 @@ typedef struct {
   float planeC;
   Point compassNorth;
   Point origin;
+  HeadingTransform transform;
+
+  /**
+   * Earth's field along the unit plane normal, transform.normal, as
+   * found by estimateVerticalField or an ellipsoid fit; 0 until then.
+   * Readings taken level lie on a circle around origin, which is the
+   * hard iron offset plus this much of the normal. Only getHeadingTilt
+   * needs it.
+   */
+  float verticalField;
+
+  /**
+   * Soft iron correction, a symmetric 3 x 3 matrix stored by rows.
+   * Level readings relative to origin, multiplied by it, lie on a
+   * circle again. The identity unless finalizeCalibration fitted an
+   * ellipse or ellipsoid. It only acts within the plane.
+   */
+  float softIron[9];
 
   CalibrationPoint calibrationData[MAX_CALIBRATION_POINTS];
   int pointCount;
+
+  /**
+   * Magnetic heading for compass heading h in bin i is
+   * deviationTable[i].offset + deviationTable[i].slope * h. Bins
+   * follow the interpolated calibrationData exactly except where a
+   * bin contains a fine calibration point, where they follow the
+   * chord instead. The difference there is at most a quarter of the
+   * bin width times the change in slope, which with 1 degree bins
+   * stays below 0.05 degrees.
+   */
+#if DEVIATION_TABLE_BINS > 0
+  DeviationBin deviationTable[DEVIATION_TABLE_BINS];
+#endif
+
+  /**
+   * DEVIATION_MODEL_HARMONIC replaces the table above with the
+   * coefficients A to E of the harmonic deviation model.
+   */
+  short deviationModel;
+  float harmonics[HARMONIC_COEFFICIENTS];
 } Calibration;
 
 typedef struct {
@@ -42,18 +192,339 @@ typedef struct {
   float magneticHeading;
 } CalibrationCtxPoint;
 
+/**
+ * Running count, mean and second moments of sensor readings, updated
+ * one reading at a time with Welford's algorithm. mxx..mzz are the
+ * sums of products of deviations from the mean, so the covariance is
+ * mxx / count etc.
+ *
+ * Over millions of readings each update falls below the precision of
+ * a float sum, so every sum is kept with Kahan compensation: the
+ * *Comp fields hold what rounding has dropped from the field of the
+ * same name, to be subtracted from it. The error then stays at float
+ * precision whatever the count, without double arithmetic.
+ */
+typedef struct {
+  long count;
+  Point mean;
+  float mxx;
+  float mxy;
+  float mxz;
+  float myy;
+  float myz;
+  float mzz;
+  float sumLength;
+  Point meanComp;
+  float mxxComp;
+  float mxyComp;
+  float mxzComp;
+  float myyComp;
+  float myzComp;
+  float mzzComp;
+  float sumLengthComp;
+} MomentAccumulator;
+
+/*
+ * Number of angular sectors around the provisional plane that
+ * calibrationProgress reports coverage of (4 per octant, fixed), and
+ * how many coarse points are added at least between refits of that
+ * plane.
+ */
+#define COVERAGE_SECTORS          32
+#ifndef COVERAGE_FIT_INTERVAL
+#define COVERAGE_FIT_INTERVAL     16
+#endif
+
+/**
+ * Progress of a calibration, kept up to date by addCalibrationPoint
+ * once enableCoverage is called. moments and cubeMean, the mean of
+ * |d|^2 d over d = point - reference, accumulate every coarse point
+ * offered; cubeMeanComp is the compensation of cubeMean, as in
+ * MomentAccumulator. Every
+ * COVERAGE_FIT_INTERVAL points or more they are fitted to a
+ * provisional plane and a circle in it, and quality is estimated from
+ * the residual. Each new point marks the sector it falls in around
+ * centre, as seen along axisU and axisV in that plane. After a fit the
+ * kept points are marked again in recount, a few per point added from
+ * recountNext on, which then replaces sectors; recountNext is -1 when
+ * no recount is under way.
+ */
+typedef struct {
+  MomentAccumulator moments;
+  Point reference;
+  Point cubeMean;
+  Point cubeMeanComp;
+  Point centre;
+  Point axisU;
+  Point axisV;
+  float quality;
+  uint32_t sectors;
+  uint32_t recount;
+  short sectorCount;
+  short recountNext;
+  short sinceFit;
+  short status;
+} CoverageTracker;
+
+/*
+ * What addCalibrationPoint does with coarse points once points[] is
+ * full. RETENTION_NONE refuses them with E_TOO_MANY_COARSE_POINTS.
+ * RETENTION_RESERVOIR accepts any number and keeps a uniform random
+ * sample of all of them (reservoir sampling), so a slow turn logged
+ * at a high rate is still covered from start to end. The first point
+ * is always kept, as it defines compass north.
+ */
+#define RETENTION_NONE            0
+#define RETENTION_RESERVOIR       1
+
 typedef struct {
   CalibrationCtxPoint points[MAX_SENSOR_POINTS];
   CalibrationCtxPoint finePoints[MAX_CALIBRATION_POINTS];
   int pointCount;
   int finePointCount;
+  /**
+   * Deviation model to fit, DEVIATION_MODEL_TABLE unless changed
+   * after startCalibration.
+   */
+  short deviationModel;
+  /**
+   * How to find the origin, ORIGIN_CENTROID unless changed after
+   * startCalibration.
+   */
+  short originModel;
+  /**
+   * Retention mode, RETENTION_NONE unless changed after
+   * startCalibration. seenCount is the number of coarse points
+   * offered so far, of which pointCount are kept.
+   */
+  short retention;
+  uint32_t seenCount;
+  uint32_t retentionState;
+  /**
+   * Whether coverage is tracked, off unless enableCoverage is called
+   * after startCalibration.
+   */
+  short trackCoverage;
+  CoverageTracker coverage;
 } CalibrationContext;
 
+/**
+ * Calibration context that keeps running moments instead of the
+ * coarse calibration points, so it takes constant memory however
+ * many points are added. Only the first reading (used as compass
+ * north) and the fine calibration points are stored.
+ */
+typedef struct {
+  MomentAccumulator moments;
+  Point firstPoint;
+  CalibrationCtxPoint finePoints[MAX_CALIBRATION_POINTS];
+  int finePointCount;
+  short deviationModel;
+} StreamCalibrationContext;
+
+/*
+ * Adaptive refinement keeps a decaying mean of the readings in each of
+ * ADAPTIVE_SECTORS sectors of compass heading, over about the last
+ * ADAPTIVE_WINDOW readings in that sector. Balancing the sectors this
+ * way keeps a boat that mostly holds one course from pulling the
+ * estimate towards that heading.
+ */
+#define ADAPTIVE_SECTORS          8
+#ifndef ADAPTIVE_WINDOW
+#define ADAPTIVE_WINDOW           100
+#endif
+
+/**
+ * Calibration refined in the background from normal operating
+ * readings. Two Calibration buffers alternate: refinement writes the
+ * one readers are not using and then switches active over, so a
+ * reader never sees a half-written calibration.
+ */
+typedef struct {
+  Calibration buffers[2];
+  volatile uint8_t active;
+  Point sectorMean[ADAPTIVE_SECTORS];
+  /**
+   * Decaying mean squared distance of the readings in each sector from
+   * its mean.
+   */
+  float sectorScatter[ADAPTIVE_SECTORS];
+  uint16_t sectorCount[ADAPTIVE_SECTORS];
+  /**
+   * Bit i is set once sector i has had a reading since the last
+   * refinement. A refinement needs all of them.
+   */
+  uint8_t fresh;
+  uint16_t interval;
+  uint16_t sinceRefine;
+  uint32_t published;
+} AdaptiveCalibration;
+
+/*
+ * Capacity of SampleRing. Indices are 8-bit so that the ISR and the
+ * main loop can each update theirs in a single store on AVR, so this
+ * must be a power of two no greater than 128.
+ */
+#ifndef SAMPLE_RING_SIZE
+#define SAMPLE_RING_SIZE          16
+#endif
+
+#if SAMPLE_RING_SIZE > 128 || (SAMPLE_RING_SIZE & (SAMPLE_RING_SIZE - 1)) != 0
+#error SAMPLE_RING_SIZE must be a power of two no greater than 128
+#endif
+
+/**
+ * Single-producer, single-consumer queue of sensor readings, for
+ * passing them from a data-ready interrupt to the main loop without
+ * disabling interrupts. Only the producer writes head and only the
+ * consumer writes tail; both run freely and wrap at 256.
+ *
+ * Readings are stored as separate x, y and z arrays so that
+ * processPending can hand them to getHeadingBatch in place.
+ */
+typedef struct {
+  float xs[SAMPLE_RING_SIZE];
+  float ys[SAMPLE_RING_SIZE];
+  float zs[SAMPLE_RING_SIZE];
+  volatile uint8_t head;
+  volatile uint8_t tail;
+} SampleRing;
+
+/**
+ * Decimating heading filter. Averages readings as vectors in the
+ * calibration plane, which handles the wrap at 0/360 degrees, and
+ * computes one heading per ratio readings.
+ */
+typedef struct {
+  float sumU;
+  float sumV;
+  uint16_t ratio;
+  uint16_t count;
+} HeadingFilter;
+
+/**
+ * Fusion of magnetic heading with a yaw rate gyro, as a second order
+ * complementary filter: the gyro rate is integrated, and the
+ * difference from the magnetic heading pulls the estimate back and,
+ * more slowly, trims an estimate of the gyro bias. Headings and bias
+ * are in degrees and degrees per second.
+ */
+typedef struct {
+  float heading;
+  float bias;
+  float gain;
+  float biasGain;
+  short started;
+} GyroFusion;
+
+/**
+ * Raw 3-axis magnetometer reading, as the sensor reports it.
+ */
+typedef struct {
+  int16_t x;
+  int16_t y;
+  int16_t z;
+} RawPoint;
+
+/*
+ * Angles in the fixed-point API are binary angles: a full turn is
+ * 65536, so they wrap around on their own.
+ */
+#define ANGLE_FROM_DEGREES(d)     ((uint16_t)(((int32_t)(d) * 65536L + 180) / 360))
+#define FIXED_MAX_SENSOR_POINTS   32767
+
+/**
+ * Calibration context of the fixed-point pipeline. Keeps exact
+ * integer sums of the readings and their products rather than the
+ * readings themselves.
+ */
+typedef struct {
+  int32_t count;
+  int32_t sum[3];
+  int64_t sumProducts[6];
+  uint32_t sumLength;
+  RawPoint firstPoint;
+  RawPoint finePoints[MAX_CALIBRATION_POINTS];
+  uint16_t fineHeadings[MAX_CALIBRATION_POINTS];
+  int finePointCount;
+} FixedCalibrationContext;
+
+/**
+ * Fixed-point counterpart of Calibration. Holds the compiled heading
+ * transform with Q14 (16384 == 1.0) axes and offsets in Q14 sensor
+ * units, and the fine calibration table as binary angles sorted by
+ * compass heading.
+ */
+typedef struct {
+  int16_t axisU[3];
+  int16_t axisV[3];
+  int32_t offsetU;
+  int32_t offsetV;
+  uint16_t compassHeading[MAX_CALIBRATION_POINTS];
+  uint16_t magneticHeading[MAX_CALIBRATION_POINTS];
+  int pointCount;
+} FixedCalibration;
+
+/*
+ * Stored calibrations start with CALIBRATION_MAGIC, written in the
+ * byte order of the target, so one from a target of the other order
+ * is rejected rather than misread. CALIBRATION_VERSION changes with
+ * the layout of PackedCalibration.
+ */
+#define CALIBRATION_MAGIC         0x5843
+#define CALIBRATION_VERSION       1
+
+/**
+ * Calibration packed for storage, e.g. in EEPROM: 212 bytes against
+ * the 3 kB of a Calibration with its deviation table. Unit vectors,
+ * soft iron and the plane normal are Q14 (16384 == 1.0), positions
+ * are multiples of positionScale, headings are binary angles and
+ * harmonic coefficients are in 1/128 degrees. The table is rebuilt
+ * by loadCalibration; getHeadingPacked interpolates the fine points
+ * in place instead.
+ *
+ * crc is CRC-16/CCITT over everything after it. reserved and padding
+ * are written as 0; padding keeps the size a multiple of 4, so that
+ * there are no unwritten bytes for the CRC to cover.
+ */
+typedef struct {
+  uint16_t magic;
+  uint16_t crc;
+  uint8_t version;
+  uint8_t pointCount;
+  uint8_t deviationModel;
+  uint8_t reserved;
+  float positionScale;
+  int16_t axisU[3];
+  int16_t axisV[3];
+  int16_t normal[3];
+  int16_t origin[3];
+  int16_t compassNorth[3];
+  int16_t verticalField;
+  int16_t softIron[6];
+  int16_t harmonics[HARMONIC_COEFFICIENTS];
+  int16_t padding;
+  uint16_t compassHeading[MAX_CALIBRATION_POINTS];
+  uint16_t magneticHeading[MAX_CALIBRATION_POINTS];
+} PackedCalibration;
+
 #define E_SUCCESS                          0
 #define E_NEED_COARSE_CALIBRATION         -1
 #define E_NOT_ENOUGH_CALIBRATION_POINTS   -2
 #define E_TOO_MANY_COARSE_POINTS          -3
 #define E_TOO_MANY_FINE_POINTS            -4
+#define E_DEGENERATE_CALIBRATION          -5
+#define E_NO_SUCH_POINT                   -6
+#define E_RING_FULL                       -7
+#define E_BUFFER_TOO_SMALL                -8
+#define E_CORRUPT_CALIBRATION             -9
+#define E_UNREADABLE_LOG                  -10
+
+/*
+ * Not an error: a filter has taken the reading but has no new output
+ * yet.
+ */
+#define E_HEADING_PENDING                  1
 
 /**
  * Returns current compass or magnetic heading, given 3-axis sensor
@@ -78,6 +549,39 @@ typedef struct {
  */
 short getHeading(const Calibration* cal, const Point* sensorData, float* heading);
 
+/**
+ * Computes headings for a batch of sensor readings, as getHeading
+ * would for each of them. Readings are passed as separate x, y and z
+ * arrays so they can be processed several at a time with SSE2 or
+ * AVX2 where the compiler targets them; other targets use a scalar
+ * loop.
+ *
+ * The angle is always computed with the ATAN2_POLYNOMIAL tier, so
+ * results may differ from getHeading by that tier's 0.0007 degrees
+ * plus the error of the tier HEADING_ATAN2 selects.
+ *
+ * @param cal Existing calibration structure, as for getHeading.
+ * @param xs X components of the readings.
+ * @param ys Y components of the readings.
+ * @param zs Z components of the readings.
+ * @param n Number of readings.
+ * @param headings Array of n elements to store results in.
+ * @return Error code.
+ */
+short getHeadingBatch(const Calibration* cal, const float* xs, const float* ys, const float* zs,
+		      long n, float* headings);
+
+/**
+ * Recomputes cal->transform, the compiled form that getHeading and the
+ * other heading functions read, from the plane, origin, compassNorth
+ * and softIron of cal. The finalize and load functions do this
+ * themselves; call it after changing any of those fields directly, or
+ * headings go on using the old values.
+ *
+ * @param cal Calibration structure to update.
+ */
+void compileTransform(Calibration* cal);
+
 /**
  * Begins the process of calibrating the instrument.
  *
@@ -110,6 +614,9 @@ short startCalibration(CalibrationContext* ctx);
  * provided, then getHeading will start returning a more precise
  * magnetic heading instead.
  *
+ * At most MAX_SENSOR_POINTS coarse points are kept. What happens to
+ * the ones after that depends on ctx->retention.
+ *
  * @param ctx Existing calibration context
  * @param sensorData Sensor data as returned by the 3-axis instrument
  * @param magneticHeading Optional - if this is a fine calibration
@@ -131,8 +638,446 @@ short addCalibrationPoint(CalibrationContext* ctx, const Point* sensorData, cons
  * initialize it.
  * @param quality Optional quality output. Will contain quality metric
  * (in percent) of the calibration performed.
- * @return Error code.
+ * @return Error code. E_DEGENERATE_CALIBRATION if the coarse points
+ * do not determine a plane: they all lie close to one line, or they
+ * are more than half as thick across the best plane as they are wide
+ * along it. Versions before the eigen-solver fitted a plane to such
+ * points anyway, which gave meaningless headings.
  */
 short finalizeCalibration(const CalibrationContext* ctx, Calibration* cal, float* quality);
 
+/**
+ * Adds a fine calibration point to a finalized calibration, without
+ * the CalibrationContext it came from. The point is inserted in order
+ * of compass heading, and only the deviation bins between its
+ * neighbours are rebuilt; the harmonic model is refitted.
+ *
+ * @param cal Existing calibration structure
+ * @param sensorData Sensor data as returned by the 3-axis instrument
+ * @param magneticHeading Correct magnetic heading, as for
+ * addCalibrationPoint.
+ * @return E_TOO_MANY_FINE_POINTS if cal already holds
+ * MAX_CALIBRATION_POINTS, E_SUCCESS otherwise.
+ */
+short insertFinePoint(Calibration* cal, const Point* sensorData, float magneticHeading);
+
+/**
+ * Replaces fine calibration point index of a finalized calibration,
+ * as removeFinePoint followed by insertFinePoint. The new point may
+ * end up at a different index.
+ *
+ * @param cal Existing calibration structure
+ * @param index Index into cal->calibrationData
+ * @param sensorData Sensor data as returned by the 3-axis instrument
+ * @param magneticHeading Correct magnetic heading.
+ * @return E_NO_SUCH_POINT if index is out of range, E_SUCCESS
+ * otherwise.
+ */
+short replaceFinePoint(Calibration* cal, int index, const Point* sensorData, float magneticHeading);
+
+/**
+ * Removes fine calibration point index of a finalized calibration,
+ * rebuilding only the deviation bins between its neighbours.
+ *
+ * @param cal Existing calibration structure
+ * @param index Index into cal->calibrationData
+ * @return E_NO_SUCH_POINT if index is out of range, E_SUCCESS
+ * otherwise.
+ */
+short removeFinePoint(Calibration* cal, int index);
+
+/**
+ * Finalizes the calibration like finalizeCalibration, but fits the
+ * plane so that a minority of wild readings (a passing vehicle, a
+ * motor starting) does not tilt it.
+ *
+ * Candidate planes through three readings are scored by the median
+ * squared distance of all readings, and the readings within 2.5
+ * standard deviations of the best one are fitted by least squares.
+ * Up to half of the readings can be outliers. The work done is fixed
+ * by ROBUST_ITERATIONS and ROBUST_REFINE_PASSES. An originModel other
+ * than ORIGIN_CENTROID is fitted to the kept readings only.
+ *
+ * @param ctx Existing calibration context
+ * @param cal Points to Calibration structure. There is no need to
+ * initialize it.
+ * @param quality Optional quality output, in percent, computed over
+ * the readings that were kept.
+ * @param rejected Optional output. Will contain the number of
+ * readings left out of the fit as outliers.
+ * @return Error code.
+ */
+short finalizeCalibrationRobust(const CalibrationContext* ctx, Calibration* cal, float* quality, short* rejected);
+
+/**
+ * Starts tracking the coverage and estimated quality that
+ * calibrationProgress reports. Tracking adds to the cost of every
+ * addCalibrationPoint, so it is off unless this is called. Call it
+ * after startCalibration and before the first point is added; points
+ * added before are not tracked.
+ *
+ * @param ctx Existing calibration context
+ * @return E_SUCCESS
+ */
+short enableCoverage(CalibrationContext* ctx);
+
+/**
+ * Reports how far a calibration has got, so that the turn can stop as
+ * soon as it is good enough. Takes constant time. Needs
+ * enableCoverage.
+ *
+ * Coverage is measured around the centre of the circle fitted to the
+ * points so far, so a half turn reads about 50%. Sectors are recounted
+ * around each new fit over the points added after it, so for a while
+ * the figure partly reflects the previous one.
+ *
+ * @param ctx Existing calibration context
+ * @param coveragePct Output, percentage of COVERAGE_SECTORS sectors
+ * of the circle that readings have fallen in.
+ * @param estQuality Output, estimate of the quality that
+ * finalizeCalibration would report for the points so far.
+ * @return E_NOT_ENOUGH_CALIBRATION_POINTS until the first provisional
+ * plane is fitted after COVERAGE_FIT_INTERVAL points, and always if
+ * coverage is not tracked,
+ * E_DEGENERATE_CALIBRATION while the points do not yet span a plane,
+ * E_SUCCESS otherwise.
+ */
+short calibrationProgress(const CalibrationContext* ctx, float* coveragePct, float* estQuality);
+
+/**
+ * Begins a streaming calibration. Works like startCalibration, but
+ * for StreamCalibrationContext.
+ *
+ * @param ctx Pointer to existing StreamCalibrationContext structure.
+ * @return E_SUCCESS
+ */
+short startStreamCalibration(StreamCalibrationContext* ctx);
+
+/**
+ * Adds a calibration point to a streaming calibration context. Works
+ * like addCalibrationPoint, except that there is no limit on the
+ * number of coarse points and each one takes constant time.
+ *
+ * @param ctx Existing streaming calibration context
+ * @param sensorData Sensor data as returned by the 3-axis instrument
+ * @param magneticHeading Optional - correct magnetic heading for a
+ * fine calibration point.
+ * @return Error code
+ */
+short addStreamCalibrationPoint(StreamCalibrationContext* ctx, const Point* sensorData, const float* magneticHeading);
+
+/**
+ * Merges the points of another streaming calibration context into
+ * ctx, as if they had been added to it after its own. Contexts can so
+ * collect disjoint parts of a long run, such as one per thread or per
+ * log file, to be merged in order: finalizeStreamCalibration then gives
+ * the calibration of the whole run, to within float rounding. Compass
+ * north is the first point of the first non-empty context.
+ *
+ * @param ctx Existing streaming calibration context
+ * @param other Context to merge into it, unchanged.
+ * @return E_SUCCESS, or E_TOO_MANY_FINE_POINTS if the fine points of
+ * both do not fit, when ctx is left unchanged.
+ */
+short mergeStreamCalibration(StreamCalibrationContext* ctx, const StreamCalibrationContext* other);
+
+/**
+ * Finalizes a streaming calibration. Works like finalizeCalibration,
+ * with the plane and quality metric computed from the accumulated
+ * moments rather than from stored points.
+ *
+ * @param ctx Existing streaming calibration context
+ * @param cal Points to Calibration structure.
+ * @param quality Optional quality output, as for finalizeCalibration.
+ * @return Error code.
+ */
+short finalizeStreamCalibration(const StreamCalibrationContext* ctx, Calibration* cal, float* quality);
+
+/**
+ * Begins adaptive refinement of an existing calibration.
+ *
+ * @param ad Pointer to existing AdaptiveCalibration structure. There
+ * is no need to initialize it.
+ * @param initial Calibration to start from, typically the result of
+ * finalizeCalibration. It is copied.
+ * @param interval Budget knob: a refinement is attempted once every
+ * interval readings. Other readings only update one sector mean.
+ * @return E_SUCCESS
+ */
+short startAdaptiveCalibration(AdaptiveCalibration* ad, const Calibration* initial, uint16_t interval);
+
+/**
+ * Feeds a normal operating reading into adaptive refinement. Takes
+ * constant time, and every interval readings the time of a
+ * refinement. A refinement publishes a new plane and origin, fitted to
+ * the sector means, once every sector has had readings since the last
+ * one; until then, or if the sector means do not determine a plane,
+ * the published calibration stays as it is. Compass north keeps its
+ * direction, and the fine calibration is kept unchanged.
+ *
+ * @param ad Existing adaptive calibration
+ * @param sensorData Sensor data as returned by the 3-axis instrument
+ * @return E_SUCCESS
+ */
+short addAdaptiveSample(AdaptiveCalibration* ad, const Point* sensorData);
+
+/**
+ * Returns the latest published calibration, for getHeading. The
+ * buffer it points to is only rewritten by the refinement after next,
+ * so a reader may use it for up to interval readings.
+ *
+ * @param ad Existing adaptive calibration
+ * @return The active calibration.
+ */
+const Calibration* adaptiveCalibration(const AdaptiveCalibration* ad);
+
+/**
+ * Begins decimating headings.
+ *
+ * The filter is a boxcar over each block of ratio readings. Its phase
+ * is linear, so every heading is delayed by exactly (ratio - 1) / 2
+ * reading intervals: the output for a boat turning at a steady rate is
+ * the heading at the middle of the block. Its first null is at the
+ * output rate, so it attenuates what would alias onto the output.
+ *
+ * @param filter Pointer to existing HeadingFilter structure.
+ * @param ratio Readings per output heading, e.g. 20 for 200 Hz in and
+ * 10 Hz out. 1 gives one heading per reading, as getHeading.
+ * @return E_SUCCESS
+ */
+short startHeadingFilter(HeadingFilter* filter, uint16_t ratio);
+
+/**
+ * Feeds a reading to a heading filter. Each reading costs two dot
+ * products; only the last of a block costs an atan2 and a deviation
+ * lookup.
+ *
+ * @param filter Existing heading filter
+ * @param cal Existing calibration structure
+ * @param sensorData 3-axis sensor data provided by the instrument.
+ * @param heading Set to the magnetic heading of the block when the
+ * reading completes one.
+ * @return E_SUCCESS when heading was set, E_HEADING_PENDING otherwise.
+ */
+short filterHeading(HeadingFilter* filter, const Calibration* cal, const Point* sensorData, float* heading);
+
+/**
+ * Begins gyro-aided heading fusion.
+ *
+ * Over times shorter than timeConstant the output follows the gyro,
+ * so it turns without the lag of filtering the magnetic heading;
+ * over longer times it follows the magnetic heading, so gyro drift
+ * and bias do not accumulate. The loop is critically damped.
+ *
+ * @param fusion Pointer to existing GyroFusion structure.
+ * @param timeConstant Crossover between gyro and magnetic heading,
+ * in seconds.
+ * @return E_SUCCESS
+ */
+short startGyroFusion(GyroFusion* fusion, float timeConstant);
+
+/**
+ * Advances gyro-aided heading fusion by one step. Takes constant time.
+ *
+ * @param fusion Existing gyro fusion state
+ * @param heading Magnetic heading at the end of the step, as from
+ * getHeading. The first call starts the estimate from it.
+ * @param yawRate Gyro rate over the step in degrees per second,
+ * positive when heading increases.
+ * @param dt Length of the step in seconds. Steps should be well
+ * under timeConstant / 2; longer ones are integrated but corrected as
+ * if that long, which keeps the loop stable, but it then no longer
+ * follows the magnetic heading at the rate timeConstant sets.
+ * @param fused Output, the fused heading.
+ * @return E_SUCCESS
+ */
+short fuseHeading(GyroFusion* fusion, float heading, float yawRate, float dt, float* fused);
+
+/**
+ * Returns magnetic heading of a reading taken while the vessel heels
+ * or pitches, as getHeading does for level readings. Instead of the
+ * calibrated plane, the reading is projected onto the horizontal plane
+ * across the gravity vector taken with it, by turning it back level
+ * with the least rotation that takes gravity onto the plane normal.
+ * The hard iron offset is origin moved back along the normal by
+ * verticalField, which estimateVerticalField must have set unless
+ * tilt stays small.
+ *
+ * Heel alone, or pitch alone, is compensated exactly. Both at once
+ * leave an error of up to about heel * pitch / 2 (0.9 degrees at 20
+ * degrees heel and 5 pitch). A soft iron correction is applied after
+ * levelling the reading rather than before, which is only exact for
+ * level readings. Costs a reciprocal square root, a division and
+ * about 40 multiplications more than getHeading.
+ *
+ * @param cal Existing calibration structure. At least coarse
+ *        calibration must have been performed.
+ * @param sensorData 3-axis sensor data provided by the instrument.
+ * @param gravity Accelerometer reading taken with sensorData, in the
+ * same axes. Its length and sign do not matter. A zero vector gives
+ * the heading in the calibrated plane.
+ * @param heading Pointer to variable to store result in.
+ * @return Error code.
+ */
+short getHeadingTilt(const Calibration* cal, const Point* sensorData, const Point* gravity, float* heading);
+
+/**
+ * Estimates the vertical component of the earth's field, and with it
+ * the hard iron offset, from readings taken at various angles of heel
+ * or pitch. Level readings cannot tell them apart, since they only
+ * shift the circle of level readings along the normal. Sets
+ * cal->verticalField by least squares over all readings.
+ *
+ * @param cal Existing calibration structure, finalized from level readings.
+ * @param sensorData Array of n 3-axis readings.
+ * @param gravity Array of n accelerometer readings taken with them.
+ * @param n Number of readings.
+ * @return E_SUCCESS, or E_DEGENERATE_CALIBRATION if no reading was
+ * tilted by 5 degrees or more.
+ */
+short estimateVerticalField(Calibration* cal, const Point* sensorData, const Point* gravity, short n);
+
+/**
+ * Empties a sample ring.
+ *
+ * @param ring Pointer to existing SampleRing structure.
+ * @return E_SUCCESS
+ */
+short sampleRingInit(SampleRing* ring);
+
+/**
+ * Queues a sensor reading. Meant to be called from the data-ready
+ * interrupt, the only producer of the ring; takes constant time.
+ *
+ * @param ring Existing sample ring
+ * @param sensorData Sensor data as returned by the 3-axis instrument
+ * @return E_RING_FULL if the reading was dropped because the consumer
+ * has fallen SAMPLE_RING_SIZE readings behind, E_SUCCESS otherwise.
+ */
+short sampleRingPush(SampleRing* ring, const Point* sensorData);
+
+/**
+ * Computes headings for the readings queued in a sample ring, oldest
+ * first, with getHeadingBatch, and removes them from the ring. Meant
+ * to be called from the main loop, the only consumer of the ring.
+ * Readings pushed meanwhile are left for the next call.
+ *
+ * Like getHeadingBatch, this always uses the ATAN2_POLYNOMIAL tier,
+ * whatever HEADING_ATAN2 selects for getHeading.
+ *
+ * @param cal Existing calibration structure
+ * @param ring Existing sample ring
+ * @param headings Output, room for maxHeadings headings.
+ * @param maxHeadings Most readings to process.
+ * @return Number of headings computed, 0 if maxHeadings is not
+ * positive.
+ */
+short processPending(const Calibration* cal, SampleRing* ring, float* headings, short maxHeadings);
+
+/*
+ * Fixed-point pipeline. These functions use integer arithmetic only
+ * (including CORDIC atan2 and integer square roots), for MCUs without
+ * an FPU. They take raw sensor readings and return binary angles;
+ * headings agree with the float functions to within 0.02 degrees
+ * (before the float path's deviation bins, which interpolate
+ * calibrationData slightly differently).
+ */
+
+/**
+ * Begins a fixed-point calibration.
+ *
+ * @param ctx Pointer to existing FixedCalibrationContext structure.
+ * @return E_SUCCESS
+ */
+short startFixedCalibration(FixedCalibrationContext* ctx);
+
+/**
+ * Adds a calibration point to a fixed-point calibration context. Works
+ * like addCalibrationPoint, accepting up to FIXED_MAX_SENSOR_POINTS
+ * coarse points.
+ *
+ * @param ctx Existing fixed-point calibration context
+ * @param sensorData Raw sensor reading
+ * @param magneticHeading Optional - correct magnetic heading for a
+ * fine calibration point, as a binary angle.
+ * @return Error code
+ */
+short addFixedCalibrationPoint(FixedCalibrationContext* ctx, const RawPoint* sensorData, const uint16_t* magneticHeading);
+
+/**
+ * Finalizes a fixed-point calibration. Works like finalizeCalibration.
+ *
+ * @param ctx Existing fixed-point calibration context
+ * @param cal Points to FixedCalibration structure.
+ * @param quality Optional quality output, in hundredths of a percent.
+ * @return Error code.
+ */
+short finalizeFixedCalibration(const FixedCalibrationContext* ctx, FixedCalibration* cal, short* quality);
+
+/**
+ * Returns compass or magnetic heading for a raw sensor reading, as
+ * getHeading does, as a binary angle.
+ *
+ * @param cal Existing fixed-point calibration.
+ * @param sensorData Raw sensor reading.
+ * @param heading Pointer to variable to store result in.
+ * @return Error code.
+ */
+short getFixedHeading(const FixedCalibration* cal, const RawPoint* sensorData, uint16_t* heading);
+
+/*
+ * Storage of calibrations. Quantization adds at most 0.01 degrees to
+ * headings, plus 0.002 degrees for every field radius (distance of
+ * level readings from origin) that the largest coordinate of origin
+ * or compass north lies from zero: 0.03 degrees for a hard iron
+ * offset of ten times the earth's field.
+ */
+
+/**
+ * Packs a calibration for storage.
+ *
+ * @param cal Existing calibration structure.
+ * @param buffer Where to pack it, aligned as a PackedCalibration.
+ * @param size Size of buffer in bytes.
+ * @return E_SUCCESS, E_BUFFER_TOO_SMALL unless size is at least
+ * sizeof(PackedCalibration), or E_DEGENERATE_CALIBRATION if soft iron
+ * correction of more than 4:1 takes its axes out of Q14 range.
+ */
+short saveCalibration(const Calibration* cal, void* buffer, short size);
+
+/**
+ * Checks a stored calibration in place, so that getHeadingPacked can
+ * use it without unpacking or copying it.
+ *
+ * @param buffer Stored calibration, aligned as a PackedCalibration.
+ * @param size Number of bytes in buffer.
+ * @param view Set to buffer on success.
+ * @return E_SUCCESS, or E_CORRUPT_CALIBRATION if buffer is too short
+ * or does not hold a calibration of this version with a good CRC.
+ */
+short viewCalibration(const void* buffer, short size, const PackedCalibration** view);
+
+/**
+ * Unpacks a stored calibration, checked as by viewCalibration, and
+ * rebuilds its deviation table.
+ *
+ * @param buffer Stored calibration, aligned as a PackedCalibration.
+ * @param size Number of bytes in buffer.
+ * @param cal Points to Calibration structure.
+ * @return E_SUCCESS or E_CORRUPT_CALIBRATION.
+ */
+short loadCalibration(const void* buffer, short size, Calibration* cal);
+
+/**
+ * Returns heading as getHeading does, from a packed calibration. The
+ * fine points are interpolated as in getFixedHeading, which matches
+ * the deviation table to within 0.05 degrees.
+ *
+ * @param view Packed calibration, as checked by viewCalibration.
+ * @param sensorData 3-axis sensor data provided by the instrument.
+ * @param heading Pointer to variable to store result in.
+ * @return Error code.
+ */
+short getHeadingPacked(const PackedCalibration* view, const Point* sensorData, float* heading);
+
 #endif
@@ -3,6 +3,7 @@
 #define __COMPAXX_INT_H__
 
 #include "compaxx.h"
+#include "compaxx_math.h"
 
 typedef struct {
   float xx;
@@ -23,6 +24,18 @@ typedef struct {
 
 #define NULL (void*)0
 
+/*
+ * Orders the memory accesses before it against those after it, as
+ * seen from an interrupt or another core: an acquire-release fence.
+ * That is a DMB on Cortex-M and nothing but a compiler barrier on x86
+ * and AVR, whose single core and in-order memory need no more.
+ */
+#if defined(__AVR__)
+#define MEMORY_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define MEMORY_BARRIER() __atomic_thread_fence(__ATOMIC_ACQ_REL)
+#endif
+
 void centroid(const CalibrationCtxPoint* points, short numPoints, Point* result);
 
 void covariance(const CalibrationCtxPoint* points, short numPoints, const Point* centroid, CovarianceMatrix* result);
@@ -31,8 +44,25 @@ float matrixDet(const Matrix* m);
 
 void matrixInv(const Matrix* m, Matrix* res);
 
+short solveLinear(float* a, float* b, short n);
+
 void printPt(const Point* pt, const char* msg);
 
+float sq(float n);
+
+float max3(float a, float b, float c);
+
+void addTo(Point* a, const Point* b);
+
+void mulByScalar(Point* a, float scalar);
+
+float meanLength(const CalibrationContext* ctx);
+float rmse(const CalibrationContext* ctx, const Calibration* cal);
+
+uint16_t robustRandom(uint32_t* state);
+
+float rectangleArea(const Point* pt1, const Point* pt2, const Point* pt3);
+
 void planeFromThreePoints(const Point* p1, const Point* p2, const Point* p3, Point* cartesian);
 
 float ptPlaneDistance(const Point* pt, const Calibration* plane);
@@ -43,8 +73,92 @@ void crossProduct(const Point* p1, const Point* p2, Point* res);
 
 float vecLengthPt(const Point* pt);
 
+float vecLength(const Point* pt);
+
 void projectPoint(const Point* pt, const Point* plane, Point* proj, float* distance);
 
+float dotProduct(const Point* a, const Point* b);
+
+void pointVec(const Point* p1, const Point* p2, Point* v);
+
+void normalize(Point* pt);
+
+float radsToHeading(float rads);
+
+void sortTable(CalibrationPoint* data, int n);
+
 float getCompassHeading(const Calibration* cal, const Point* sensorData);
 
+float scanDeviation(const Calibration* cal, float compassHeading);
+
+void buildDeviationBins(Calibration* cal, int first, int count);
+
+void buildDeviationTable(Calibration* cal);
+
+short updateDeviation(Calibration* cal, int lo, int hi);
+
+void harmonicBasis(float compassHeading, float* basis);
+
+short fitHarmonics(Calibration* cal);
+
+float applyHarmonics(const float* harmonics, float compassHeading);
+
+float applyDeviation(const Calibration* cal, float compassHeading);
+
+short weightedDir(const CovarianceMatrix* covar, Point* weighted_dir);
+
+short symmetricEigen(const CovarianceMatrix* covar, float* values, Point* smallest);
+
+short jacobiEigen(const CovarianceMatrix* covar, float* values, Point* smallest);
+
+/*
+ * The eigenvalues of the covariance are the variances of the readings
+ * along its eigenvectors. Readings that spread along less than two
+ * directions, or that are nearly as thick across the plane as they
+ * are wide along it, do not determine a plane.
+ */
+#define PLANE_MIN_SPREAD          1e-4f
+#define PLANE_MAX_THICKNESS       0.5f
+
+short fitPlane(const Point* centroidPt, const CovarianceMatrix* covar, Calibration* cal);
+
+short finishCalibration(Calibration* cal, const Point* origin, const Point* rawCompassNorth, const float* softIron,
+			const CalibrationCtxPoint* finePoints, int finePointCount, short deviationModel);
+
+void softIronApply(const float* softIron, const Point* pt, Point* res);
+
+short fitOrigin(const CalibrationContext* ctx, Calibration* cal, Point* origin, float* softIron,
+		float* verticalField);
+
+void momentsReset(MomentAccumulator* acc);
+
+void compensatedAdd(float* sum, float* comp, float value);
+
+void momentsAdd(MomentAccumulator* acc, const Point* pt);
+
+void momentsMerge(MomentAccumulator* acc, const MomentAccumulator* other);
+
+void momentsCovariance(const MomentAccumulator* acc, CovarianceMatrix* result);
+
+float momentsQuality(const MomentAccumulator* acc, const Calibration* cal);
+
+void coverageReset(CoverageTracker* cov);
+
+short coverageSector(float u, float v);
+
+void coverageAdd(CalibrationContext* ctx, const Point* pt);
+
+#define Q14_ONE 16384
+
+uint16_t fixedAtan2(int32_t y, int32_t x);
+
+uint16_t binaryDeviation(const uint16_t* compassHeadings, const uint16_t* magneticHeadings, int pointCount,
+			 uint16_t compassHeading);
+
+uint16_t isqrt32(uint32_t n);
+
+uint32_t isqrt64(uint64_t n);
+
+float getCompassHeadingProjected(const Calibration* cal, const Point* sensorData);
+
 #endif
@@ -0,0 +1,63 @@
+#ifndef __COMPAXX_MATH_H__
+#define __COMPAXX_MATH_H__
+
+/*
+ * Float-only math for the library. On Cortex-M4F double precision is
+ * emulated in software, and on Cortex-M0 both are, but single
+ * precision is the cheaper of the two everywhere. Library code
+ * therefore uses f-suffixed literals and the f variants of libm only,
+ * so that no double arithmetic is linked in; `make check-float`
+ * verifies this.
+ */
+
+#include <math.h>
+
+#define PI_F          3.14159265f
+#define DEG_TO_RAD_F  (PI_F / 180.0f)
+#define RAD_TO_DEG_F  (180.0f / PI_F)
+
+/*
+ * atan on [0, 1] as an odd polynomial (Abramowitz & Stegun 4.4.49),
+ * max error 1.2e-5 rad. Shared by fastAtan2f and the batch kernels so
+ * that they agree to rounding.
+ */
+#define ATAN_C1  0.9998660f
+#define ATAN_C3 -0.3302995f
+#define ATAN_C5  0.1801410f
+#define ATAN_C7 -0.0851330f
+#define ATAN_C9  0.0208351f
+
+/*
+ * atan2 by octant reduction and the polynomial above. Max error
+ * 1.2e-5 rad (0.0007 degrees) over the full circle; atan2f(0, 0)
+ * returns 0.
+ */
+float fastAtan2f(float y, float x);
+
+/*
+ * atan2 by the same octant reduction and linear interpolation in a
+ * table of ATAN_LUT_SIZE + 1 values of atan on [0, 1]. Max error
+ * 1.4e-3 rad (0.08 degrees) with 8 intervals.
+ */
+#define ATAN_LUT_SIZE 8
+
+float lutAtan2f(float y, float x);
+
+// The atan2 tier selected by HEADING_ATAN2 for getHeading.
+#if HEADING_ATAN2 == ATAN2_LIBM
+#define headingAtan2f(y, x) atan2f(y, x)
+#elif HEADING_ATAN2 == ATAN2_LUT
+#define headingAtan2f(y, x) lutAtan2f(y, x)
+#else
+#define headingAtan2f(y, x) fastAtan2f(y, x)
+#endif
+
+/*
+ * 1 / sqrt(x) for x > 0, from the exponent trick refined by two Newton
+ * steps. Relative error below 5e-6, which is for the per-reading
+ * paths only: calibration normalizes with sqrtf, as its error would
+ * otherwise be folded into every heading.
+ */
+float fastRsqrtf(float x);
+
+#endif
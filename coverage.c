@@ -0,0 +1,226 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+#include <math.h>
+
+/*
+ * Calibration progress. The provisional plane is refitted from the
+ * running moments every COVERAGE_FIT_INTERVAL points, or every quarter
+ * of the points kept if that is more. Each refit moves the centre and
+ * the axes, so sectors are then recounted over the kept points into a
+ * second mask, COVERAGE_RECOUNT of them per point added, which
+ * replaces the reported one once all are done; new points are marked
+ * in both meanwhile. The recount ends before the next refit, and no
+ * call marks more than COVERAGE_RECOUNT + 2 points.
+ *
+ * The centre is the least squares (Kasa) circle through the points
+ * in the plane. Its normal equations need, besides the mean and
+ * covariance, only the mean of |d|^2 d over d = point - reference,
+ * where the reference is the first point; the third moments about the
+ * mean follow from it. Points are taken to lie in the plane, which
+ * only ignores their scatter across it.
+ */
+
+#define COVERAGE_RECOUNT 4
+
+void coverageReset(CoverageTracker* cov) {
+  momentsReset(&(cov->moments));
+  cov->axisU.x = cov->axisU.y = cov->axisU.z = 0.0f;
+  cov->axisV = cov->axisU;
+  cov->reference = cov->axisU;
+  cov->cubeMean = cov->axisU;
+  cov->cubeMeanComp = cov->axisU;
+  cov->centre = cov->axisU;
+  cov->quality = 0.0f;
+  cov->sectors = 0;
+  cov->sectorCount = 0;
+  cov->recount = 0;
+  cov->recountNext = -1;
+  cov->sinceFit = 0;
+  cov->status = E_NOT_ENOUGH_CALIBRATION_POINTS;
+}
+
+// tan of 1/4, 2/4 and 3/4 of an octant.
+#define SECTOR_TAN1 0.19891237f
+#define SECTOR_TAN2 0.41421356f
+#define SECTOR_TAN3 0.66817864f
+
+/*
+ * Sector of the angle atan2(v, u), counted anticlockwise from u, by
+ * the octant reduction of fastAtan2f but comparing against the sector
+ * boundaries instead of computing the angle.
+ */
+short coverageSector(float u, float v) {
+  float au = fabsf(u);
+  float av = fabsf(v);
+  float mx = au > av ? au : av;
+  float mn = au > av ? av : au;
+  short sector = (mn >= SECTOR_TAN1 * mx) + (mn >= SECTOR_TAN2 * mx) + (mn >= SECTOR_TAN3 * mx);
+  if (av > au)
+    sector = 7 - sector;
+  if (u < 0.0f)
+    sector = 15 - sector;
+  if (v < 0.0f)
+    sector = 31 - sector;
+  return sector;
+}
+
+static uint32_t coverageBit(const CoverageTracker* cov, const Point* pt) {
+  Point d;
+  pointVec(&(cov->centre), pt, &d);
+  return 1UL << coverageSector(dotProduct(&(cov->axisU), &d), dotProduct(&(cov->axisV), &d));
+}
+
+void coverageMark(CoverageTracker* cov, const Point* pt) {
+  uint32_t bit = coverageBit(cov, pt);
+  if (!(cov->sectors & bit)) {
+    cov->sectors |= bit;
+    cov->sectorCount++;
+  }
+}
+
+static void covarianceTimes(const CovarianceMatrix* c, const Point* v, Point* result) {
+  result->x = c->xx * v->x + c->xy * v->y + c->xz * v->z;
+  result->y = c->xy * v->x + c->yy * v->y + c->yz * v->z;
+  result->z = c->xz * v->x + c->yz * v->y + c->zz * v->z;
+}
+
+/*
+ * Centre of the circle through the points in the plane of unit axes
+ * u and v, or the mean if the points are too close to a line for one.
+ * With covariance C, m the mean less the reference and T the mean of
+ * |d|^2 d, the mean of |s|^2 s over s = point - mean is
+ * w = T - m tr(C) - |m|^2 m - 2 C m, and the centre is the mean plus
+ * a u + b v, where [Cuu Cuv; Cuv Cvv] [a b] = [w.u w.v] / 2.
+ */
+static void circleCentre(CoverageTracker* cov, const CovarianceMatrix* covar, const Point* u, const Point* v) {
+  const Point* mean = &(cov->moments.mean);
+  Point m, w, cm, cu, cv;
+  pointVec(&(cov->reference), mean, &m);
+  covarianceTimes(covar, &m, &cm);
+  float trace = covar->xx + covar->yy + covar->zz;
+  float msq = dotProduct(&m, &m);
+  w.x = cov->cubeMean.x - m.x * (trace + msq) - 2 * cm.x;
+  w.y = cov->cubeMean.y - m.y * (trace + msq) - 2 * cm.y;
+  w.z = cov->cubeMean.z - m.z * (trace + msq) - 2 * cm.z;
+
+  covarianceTimes(covar, u, &cu);
+  covarianceTimes(covar, v, &cv);
+  float cuu = dotProduct(u, &cu), cuv = dotProduct(v, &cu), cvv = dotProduct(v, &cv);
+  float det = cuu * cvv - cuv * cuv;
+  cov->centre = *mean;
+  if (!(det > cuu * cvv * 1e-4f))
+    return;
+  float wu = 0.5f * dotProduct(&w, u), wv = 0.5f * dotProduct(&w, v);
+  float a = (wu * cvv - wv * cuv) / det;
+  float b = (wv * cuu - wu * cuv) / det;
+  cov->centre.x += a * u->x + b * v->x;
+  cov->centre.y += a * u->y + b * v->y;
+  cov->centre.z += a * u->z + b * v->z;
+}
+
+void coverageFit(CalibrationContext* ctx) {
+  CoverageTracker* cov = &(ctx->coverage);
+  CovarianceMatrix covar;
+  float values[3];
+  Point normal;
+  momentsCovariance(&(cov->moments), &covar);
+  if (symmetricEigen(&covar, values, &normal) != E_SUCCESS ||
+      !(values[1] > values[2] * PLANE_MIN_SPREAD) || values[0] > values[1] * PLANE_MAX_THICKNESS) {
+    cov->status = E_DEGENERATE_CALIBRATION;
+    return;
+  }
+
+  // Any two axes in the plane will do for the centre.
+  Point u, v;
+  pointVec(&(cov->moments.mean), &(ctx->points[0].sensorData), &u);
+  Point across = normal;
+  mulByScalar(&across, -dotProduct(&u, &normal));
+  addTo(&u, &across);
+  if (!(dotProduct(&u, &u) > 0)) {
+    cov->status = E_DEGENERATE_CALIBRATION;
+    return;
+  }
+  normalize(&u);
+  crossProduct(&normal, &u, &v);
+  circleCentre(cov, &covar, &u, &v);
+
+  pointVec(&(cov->centre), &(ctx->points[0].sensorData), &(cov->axisU));
+  across = normal;
+  mulByScalar(&across, -dotProduct(&(cov->axisU), &normal));
+  addTo(&(cov->axisU), &across);
+  if (dotProduct(&(cov->axisU), &(cov->axisU)) > 0)
+    normalize(&(cov->axisU));
+  else
+    cov->axisU = u;
+  crossProduct(&normal, &(cov->axisU), &(cov->axisV));
+
+  float meanLen = cov->moments.sumLength / (float)cov->moments.count;
+  cov->quality = 100.0f - sqrtf(fmaxf(values[0], 0.0f)) / meanLen * 100;
+
+  cov->recount = 0;
+  cov->recountNext = 0;
+  cov->status = E_SUCCESS;
+}
+
+/*
+ * Marks the next COVERAGE_RECOUNT kept points in the recount mask,
+ * and once all are marked makes it the reported one.
+ */
+static void coverageRecount(CalibrationContext* ctx) {
+  CoverageTracker* cov = &(ctx->coverage);
+  short end = cov->recountNext + COVERAGE_RECOUNT;
+  if (end > ctx->pointCount)
+    end = ctx->pointCount;
+  for (; cov->recountNext<end; cov->recountNext++)
+    cov->recount |= coverageBit(cov, &(ctx->points[cov->recountNext].sensorData));
+  if (cov->recountNext < ctx->pointCount)
+    return;
+
+  cov->sectors = cov->recount;
+  cov->sectorCount = 0;
+  short i;
+  for (i=0; i<COVERAGE_SECTORS; i++)
+    cov->sectorCount += (cov->sectors >> i) & 1;
+  cov->recountNext = -1;
+}
+
+void coverageAdd(CalibrationContext* ctx, const Point* pt) {
+  CoverageTracker* cov = &(ctx->coverage);
+  if (cov->moments.count == 0)
+    cov->reference = *pt;
+  momentsAdd(&(cov->moments), pt);
+  Point d;
+  pointVec(&(cov->reference), pt, &d);
+  float lengthSq = dotProduct(&d, &d);
+  float count = (float)cov->moments.count;
+  compensatedAdd(&(cov->cubeMean.x), &(cov->cubeMeanComp.x), (d.x * lengthSq - cov->cubeMean.x) / count);
+  compensatedAdd(&(cov->cubeMean.y), &(cov->cubeMeanComp.y), (d.y * lengthSq - cov->cubeMean.y) / count);
+  compensatedAdd(&(cov->cubeMean.z), &(cov->cubeMeanComp.z), (d.z * lengthSq - cov->cubeMean.z) / count);
+
+  cov->sinceFit++;
+  if (cov->sinceFit >= COVERAGE_FIT_INTERVAL && cov->sinceFit * 4 >= ctx->pointCount) {
+    cov->sinceFit = 0;
+    coverageFit(ctx);
+  } else if (cov->status == E_SUCCESS) {
+    coverageMark(cov, pt);
+    cov->recount |= coverageBit(cov, pt);
+  }
+  if (cov->status == E_SUCCESS && cov->recountNext >= 0)
+    coverageRecount(ctx);
+}
+
+short enableCoverage(CalibrationContext* ctx) {
+  ctx->trackCoverage = 1;
+  coverageReset(&(ctx->coverage));
+  return E_SUCCESS;
+}
+
+short calibrationProgress(const CalibrationContext* ctx, float* coveragePct, float* estQuality) {
+  const CoverageTracker* cov = &(ctx->coverage);
+  if (cov->status != E_SUCCESS)
+    return cov->status;
+  *coveragePct = cov->sectorCount * 100.0f / COVERAGE_SECTORS;
+  *estQuality = cov->quality;
+  return E_SUCCESS;
+}
@@ -0,0 +1,170 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+#include <math.h>
+
+/*
+ * Eigen-decomposition of a symmetric 3x3 matrix. The smallest
+ * eigenvalue is the smallest root of the characteristic cubic, found
+ * by Newton's method, and the other two the roots of what remains.
+ * The eigenvector of the smallest one is a cross product of two rows
+ * of (A - lambda I). When two eigenvalues are too close for the cross
+ * products to be trusted, or the matrix is not positive semidefinite,
+ * cyclic Jacobi rotations are used instead. Both return
+ * E_DEGENERATE_CALIBRATION for a matrix that is not finite.
+ */
+
+#define EIGEN_JACOBI_SWEEPS 8
+
+/*
+ * When the two smallest eigenvalues approach each other Newton's
+ * method slows down and the cross products no longer determine the
+ * eigenvector. Below this gap, relative to the spread of the
+ * eigenvalues, or when Newton's method has not converged to within
+ * EIGEN_NEWTON_TOLERANCE of the trace in EIGEN_NEWTON_STEPS, Jacobi is
+ * used.
+ */
+#define EIGEN_MIN_GAP 1e-2f
+
+#define EIGEN_NEWTON_STEPS 8
+#define EIGEN_NEWTON_TOLERANCE 1e-7f
+
+short jacobiEigen(const CovarianceMatrix* covar, float* values, Point* smallest) {
+  float a[3][3] = {
+    { covar->xx, covar->xy, covar->xz },
+    { covar->xy, covar->yy, covar->yz },
+    { covar->xz, covar->yz, covar->zz }
+  };
+  float v[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+  short sweep, p, q, k;
+
+  for (sweep=0; ; sweep++) {
+    float off = sq(a[0][1]) + sq(a[0][2]) + sq(a[1][2]);
+    if (off <= 1e-14f * (sq(a[0][0]) + sq(a[1][1]) + sq(a[2][2])))
+      break;
+    // Finite matrices converge well within the sweeps; others never do.
+    if (sweep == EIGEN_JACOBI_SWEEPS)
+      return E_DEGENERATE_CALIBRATION;
+
+    for (p=0; p<2; p++) {
+      for (q=p + 1; q<3; q++) {
+	if (a[p][q] == 0)
+	  continue;
+	// Rotation that zeroes a[p][q]
+	float theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+	float t = (theta >= 0 ? 1 : -1) / (fabsf(theta) + sqrtf(theta * theta + 1));
+	float c = 1 / sqrtf(t * t + 1);
+	float s = t * c;
+
+	for (k=0; k<3; k++) {
+	  float akp = a[k][p];
+	  float akq = a[k][q];
+	  a[k][p] = c * akp - s * akq;
+	  a[k][q] = s * akp + c * akq;
+	}
+	for (k=0; k<3; k++) {
+	  float apk = a[p][k];
+	  float aqk = a[q][k];
+	  a[p][k] = c * apk - s * aqk;
+	  a[q][k] = s * apk + c * aqk;
+	}
+	for (k=0; k<3; k++) {
+	  float vkp = v[k][p];
+	  float vkq = v[k][q];
+	  v[k][p] = c * vkp - s * vkq;
+	  v[k][q] = s * vkp + c * vkq;
+	}
+      }
+    }
+  }
+
+  // Sort ascending, keeping track of the smallest one's column.
+  short order[3] = { 0, 1, 2 };
+  for (p=0; p<2; p++)
+    for (q=p + 1; q<3; q++)
+      if (a[order[q]][order[q]] < a[order[p]][order[p]]) {
+	short temp = order[p];
+	order[p] = order[q];
+	order[q] = temp;
+      }
+  for (k=0; k<3; k++)
+    values[k] = a[order[k]][order[k]];
+  smallest->x = v[0][order[0]];
+  smallest->y = v[1][order[0]];
+  smallest->z = v[2][order[0]];
+  return E_SUCCESS;
+}
+
+short symmetricEigen(const CovarianceMatrix* covar, float* values, Point* smallest) {
+  // Characteristic polynomial l^3 - trace l^2 + minors l - det
+  float trace = covar->xx + covar->yy + covar->zz;
+  float minorX = covar->yy * covar->zz - covar->yz * covar->yz;
+  float minorY = covar->xx * covar->zz - covar->xz * covar->xz;
+  float minorZ = covar->xx * covar->yy - covar->xy * covar->xy;
+  float minors = minorX + minorY + minorZ;
+  float det =
+    covar->xx * minorX -
+    covar->xy * (covar->xy * covar->zz - covar->yz * covar->xz) +
+    covar->xz * (covar->xy * covar->yz - covar->yy * covar->xz);
+  if (!(minors > 0) || !(det >= 0))
+    return jacobiEigen(covar, values, smallest);
+
+  // The polynomial is concave below trace / 3, where its smallest
+  // root lies, so Newton's method from 0 climbs to that root without
+  // overshooting it. It only slows down when the root is repeated.
+  float l = 0;
+  short step;
+  for (step=0; step<EIGEN_NEWTON_STEPS; step++) {
+    float f = ((l - trace) * l + minors) * l - det;
+    float slope = (3 * l - 2 * trace) * l + minors;
+    float delta = -f / slope;
+    if (!(delta > trace * EIGEN_NEWTON_TOLERANCE))
+      break;
+    l += delta;
+  }
+  if (step == EIGEN_NEWTON_STEPS)
+    return jacobiEigen(covar, values, smallest);
+
+  // The other two are the roots of the remaining quadratic.
+  float sum = trace - l;
+  float product = minors - l * sum;
+  float half = 0.5f * sqrtf(fmaxf(0.0f, sum * sum - 4 * product));
+  values[0] = l;
+  values[1] = 0.5f * sum - half;
+  values[2] = 0.5f * sum + half;
+  if (!(values[1] - values[0] > EIGEN_MIN_GAP * (values[2] - values[0])))
+    return jacobiEigen(covar, values, smallest);
+
+  Point rows[3] = {
+    { covar->xx - values[0], covar->xy, covar->xz },
+    { covar->xy, covar->yy - values[0], covar->yz },
+    { covar->xz, covar->yz, covar->zz - values[0] }
+  };
+  // This is the hot path of every calibration, so the cross products
+  // are spelled out rather than going through crossProduct.
+  Point cross[3];
+  float lengths[3];
+  short i;
+  for (i=0; i<3; i++) {
+    const Point* a = &rows[i == 2 ? 1 : 0];
+    const Point* b = &rows[i == 0 ? 1 : 2];
+    cross[i].x = a->y * b->z - a->z * b->y;
+    cross[i].y = a->z * b->x - a->x * b->z;
+    cross[i].z = a->x * b->y - a->y * b->x;
+    lengths[i] = cross[i].x * cross[i].x + cross[i].y * cross[i].y + cross[i].z * cross[i].z;
+  }
+  short best = 0;
+  if (lengths[1] > lengths[best])
+    best = 1;
+  if (lengths[2] > lengths[best])
+    best = 2;
+  float bestLength = lengths[best];
+  if (!(bestLength > 0))
+    return jacobiEigen(covar, values, smallest);
+
+  float scale = 1.0f / sqrtf(bestLength);
+  smallest->x = cross[best].x * scale;
+  smallest->y = cross[best].y * scale;
+  smallest->z = cross[best].z * scale;
+  return E_SUCCESS;
+}
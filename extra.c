@@ -3,7 +3,6 @@
 #include "compaxx_int.h"
 
 #include <math.h>
-#include <stdio.h>
 
 float matrixDet(const Matrix* m) {
   return
@@ -39,6 +38,111 @@ void matrixInv(const Matrix* m, Matrix* res) {
   res->c3 = (a11 * a22 - a12 * a21) / determ;
 }
 
+/*
+ * Plane normal as the blend of the rows of the adjugate of the
+ * covariance, weighted by their squared diagonal elements. This is
+ * what fitPlane used before symmetricEigen; it is biased towards the
+ * in-plane directions as the noise grows, and is kept for comparison.
+ */
+short weightedDir(const CovarianceMatrix* covar, Point* weighted_dir) {
+  weighted_dir->x = weighted_dir->y = weighted_dir->z = 0.0f;
+
+  float det_x = covar->yy * covar->zz - covar->yz * covar->yz;
+  float det_y = covar->xx * covar->zz - covar->xz * covar->xz;
+  float det_z = covar->xx * covar->yy - covar->xy * covar->xy;
+
+  {
+    Point axis_dir = {
+      det_x,
+      covar->xz * covar->yz - covar->xy * covar->zz,
+      covar->xy * covar->yz - covar->xz * covar->yy
+    };
+    float weight = det_x * det_x;
+    if (dotProduct(weighted_dir, &axis_dir) < 0.0f)
+      weight = -weight;
+    mulByScalar(&axis_dir, weight);
+    addTo(weighted_dir,&axis_dir);
+  }
+
+  {
+    Point axis_dir = {
+      covar->xz * covar->yz - covar->xy * covar->zz,
+      det_y,
+      covar->xy * covar->xz - covar->yz * covar->xx
+    };
+    float weight = det_y * det_y;
+    if (dotProduct(weighted_dir, &axis_dir) < 0.0f)
+      weight = -weight;
+    mulByScalar(&axis_dir, weight);
+    addTo(weighted_dir,&axis_dir);
+  }
+
+  {
+    Point axis_dir = {
+      covar->xy * covar->yz - covar->xz * covar->yy,
+      covar->xy * covar->xz - covar->yz * covar->xx,
+      det_z,
+    };
+    float weight = det_z * det_z;
+    if (dotProduct(weighted_dir, &axis_dir) < 0.0f)
+      weight = -weight;
+    mulByScalar(&axis_dir, weight);
+    addTo(weighted_dir,&axis_dir);
+  }
+
+  normalize(weighted_dir);
+
+  return E_SUCCESS;
+}
+
+/*
+ * Solves a * x = b for an n x n matrix stored by rows, by Gaussian
+ * elimination with partial pivoting. Both a and b are overwritten; b
+ * receives the solution.
+ */
+short solveLinear(float* a, float* b, short n) {
+  short row, col, k;
+  float scale = 0.0f;
+
+  for (k=0; k<n * n; k++)
+    if (fabsf(a[k]) > scale)
+      scale = fabsf(a[k]);
+
+  for (col=0; col<n; col++) {
+    short pivot = col;
+    for (row=col + 1; row<n; row++)
+      if (fabsf(a[row * n + col]) > fabsf(a[pivot * n + col]))
+	pivot = row;
+    if (fabsf(a[pivot * n + col]) <= scale * 1e-6f)
+      return E_DEGENERATE_CALIBRATION;
+
+    if (pivot != col) {
+      for (k=0; k<n; k++) {
+	float temp = a[col * n + k];
+	a[col * n + k] = a[pivot * n + k];
+	a[pivot * n + k] = temp;
+      }
+      float temp = b[col];
+      b[col] = b[pivot];
+      b[pivot] = temp;
+    }
+
+    for (row=col + 1; row<n; row++) {
+      float factor = a[row * n + col] / a[col * n + col];
+      for (k=col; k<n; k++)
+	a[row * n + k] -= factor * a[col * n + k];
+      b[row] -= factor * b[col];
+    }
+  }
+
+  for (row=n - 1; row>=0; row--) {
+    for (k=row + 1; k<n; k++)
+      b[row] -= a[row * n + k] * b[k];
+    b[row] /= a[row * n + row];
+  }
+  return E_SUCCESS;
+}
+
 void planeFromThreePoints(const Point* p1, const Point* p2, const Point* p3, Point* cartesian) {
   Point normal;
 
@@ -75,7 +179,7 @@ float rectangleArea(const Point* pt1, const Point* pt2, const Point* pt3) {
   Point ac = { pt1->x - pt3->x, pt1->y - pt3->y, pt1->z - pt3->z };
   Point cp;
   crossProduct(&ab, &ac, &cp);
-  return 0.5 * (sqrt(cp.x * cp.x + cp.y * cp.y + cp.z * cp.z));
+  return 0.5f * (sqrtf(cp.x * cp.x + cp.y * cp.y + cp.z * cp.z));
 }
 
 short finalizeCalibrationTrian(const CalibrationContext* ctx, Calibration* cal) {
@@ -118,3 +222,30 @@ short finalizeCalibrationTrian(const CalibrationContext* ctx, Calibration* cal)
   cal->planeC = accum.z / planeCount;
   return E_SUCCESS;
 }
+
+/*
+ * Compass heading computed by projecting the reading onto the
+ * calibration plane. This is what getCompassHeading did before the
+ * transform was compiled; kept as the reference for it.
+ */
+float getCompassHeadingProjected(const Calibration* cal, const Point* sensorData) {
+  Point v1;
+  Point v2;
+
+  Point plane = { cal->planeA, cal->planeB, cal->planeC };
+  Point proj;
+
+  projectPoint(sensorData, &plane, &proj, NULL);
+  pointVec(&(cal->origin), &(cal->compassNorth), &v1);
+  pointVec(&(cal->origin), &proj, &v2);
+
+  Point cross;
+  crossProduct(&v1, &v2, &cross);
+
+  Point norm = { cal->planeA, cal->planeB, cal->planeC };
+  normalize(&norm);
+  float det = dotProduct(&norm, &cross);
+  float dot = dotProduct(&v1, &v2);
+
+  return radsToHeading(atan2f(det, dot));
+}
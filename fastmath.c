@@ -0,0 +1,69 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+#include <string.h>
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define LUT_READ(table, i) pgm_read_float(&(table)[i])
+#else
+#define PROGMEM
+#define LUT_READ(table, i) ((table)[i])
+#endif
+
+// atan(i / ATAN_LUT_SIZE), kept in flash on AVR.
+static const float atanTable[ATAN_LUT_SIZE + 1] PROGMEM = {
+  0.0000000f, 0.1243550f, 0.2449787f, 0.3587707f, 0.4636476f,
+  0.5585993f, 0.6435011f, 0.7188299f, 0.7853982f
+};
+
+float fastAtan2f(float y, float x) {
+  float ax = fabsf(x);
+  float ay = fabsf(y);
+  float mx = ax > ay ? ax : ay;
+  float mn = ax > ay ? ay : ax;
+  float a = mx > 0.0f ? mn / mx : 0.0f;
+  float a2 = a * a;
+  float r = a * (ATAN_C1 + a2 * (ATAN_C3 + a2 * (ATAN_C5 + a2 * (ATAN_C7 + a2 * ATAN_C9))));
+  if (ay > ax)
+    r = PI_F / 2 - r;
+  if (x < 0.0f)
+    r = PI_F - r;
+  if (y < 0.0f)
+    r = -r;
+  return r;
+}
+
+float lutAtan2f(float y, float x) {
+  float ax = fabsf(x);
+  float ay = fabsf(y);
+  float mx = ax > ay ? ax : ay;
+  float mn = ax > ay ? ay : ax;
+  float a = mx > 0.0f ? mn / mx * ATAN_LUT_SIZE : 0.0f;
+  int i = (int)a;
+  if (i >= ATAN_LUT_SIZE)
+    i = ATAN_LUT_SIZE - 1;
+  float from = LUT_READ(atanTable, i);
+  float r = from + (LUT_READ(atanTable, i + 1) - from) * (a - (float)i);
+  if (ay > ax)
+    r = PI_F / 2 - r;
+  if (x < 0.0f)
+    r = PI_F - r;
+  if (y < 0.0f)
+    r = -r;
+  return r;
+}
+
+float fastRsqrtf(float x) {
+  // memcpy rather than a pointer cast keeps this within strict aliasing.
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  bits = 0x5f3759dfUL - (bits >> 1);
+  float r;
+  memcpy(&r, &bits, sizeof(r));
+
+  float half = 0.5f * x;
+  r = r * (1.5f - half * r * r);
+  r = r * (1.5f - half * r * r);
+  return r;
+}
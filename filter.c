@@ -0,0 +1,32 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+/*
+ * Readings are averaged as (u, v) in the calibration plane, the
+ * arguments getCompassHeading passes to atan2. The mean of unit
+ * vectors at 359 and 1 degrees points at 0, where the mean of the
+ * angles would point at 180. The sums need not be divided by the
+ * count, since atan2 only depends on their ratio.
+ */
+
+short startHeadingFilter(HeadingFilter* filter, uint16_t ratio) {
+  filter->sumU = 0.0f;
+  filter->sumV = 0.0f;
+  filter->ratio = ratio > 0 ? ratio : 1;
+  filter->count = 0;
+  return E_SUCCESS;
+}
+
+short filterHeading(HeadingFilter* filter, const Calibration* cal, const Point* sensorData, float* heading) {
+  const HeadingTransform* t = &(cal->transform);
+  filter->sumU += dotProduct(&(t->axisU), sensorData) - t->offsetU;
+  filter->sumV += dotProduct(&(t->axisV), sensorData) - t->offsetV;
+  if (++filter->count < filter->ratio)
+    return E_HEADING_PENDING;
+
+  *heading = applyDeviation(cal, radsToHeading(headingAtan2f(filter->sumV, filter->sumU)));
+  filter->sumU = 0.0f;
+  filter->sumV = 0.0f;
+  filter->count = 0;
+  return E_SUCCESS;
+}
@@ -0,0 +1,381 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+/*
+ * Integer-only calibration and heading pipeline. Nothing in here
+ * touches float, so it can be built on its own for MCUs without an
+ * FPU.
+ *
+ * Unit vectors are Q14 (16384 == 1.0), dot products of a unit vector
+ * with a reading are Q14 sensor units in 32 bits, and angles are
+ * binary angles, 65536 (or 2^32 internally) per full turn.
+ */
+
+#define FIXED_NORMAL_ITERATIONS 3
+
+/*
+ * atan(2^-i) as a fraction of a full turn, scaled by 2^32.
+ */
+static const uint32_t cordicAngles[] = {
+  536870912UL, 316933406UL, 167458907UL, 85004756UL,
+  42667331UL, 21354465UL, 10679838UL, 5340245UL,
+  2670163UL, 1335087UL, 667544UL, 333772UL,
+  166886UL, 83443UL, 41722UL, 20861UL,
+  10430UL, 5215UL, 2608UL, 1304UL,
+  652UL, 326UL, 163UL, 81UL
+};
+
+#define CORDIC_ITERATIONS (sizeof(cordicAngles) / sizeof(cordicAngles[0]))
+
+uint16_t fixedAtan2(int32_t y, int32_t x) {
+  if (x == 0 && y == 0)
+    return 0;
+
+  // Scale into [2^28, 2^29) to leave room for the CORDIC gain of
+  // about 1.65 while keeping resolution for the last iterations.
+  int32_t ax = x < 0 ? -x : x;
+  int32_t ay = y < 0 ? -y : y;
+  int32_t largest = ax > ay ? ax : ay;
+  while (largest >= ((int32_t)1 << 29)) {
+    x >>= 1;
+    y >>= 1;
+    largest >>= 1;
+  }
+  // Doubling rather than shifting, as x and y may be negative.
+  while (largest < ((int32_t)1 << 28)) {
+    x *= 2;
+    y *= 2;
+    largest <<= 1;
+  }
+
+  uint32_t angle = 0;
+  if (x < 0) {
+    x = -x;
+    y = -y;
+    angle = 0x80000000UL;
+  }
+
+  unsigned char i;
+  for (i=0; i<CORDIC_ITERATIONS; i++) {
+    int32_t dx = y >> i;
+    int32_t dy = x >> i;
+    if (y > 0) {
+      x += dx;
+      y -= dy;
+      angle += cordicAngles[i];
+    } else {
+      x -= dx;
+      y += dy;
+      angle -= cordicAngles[i];
+    }
+  }
+  return (uint16_t)((angle + 0x8000UL) >> 16);
+}
+
+uint16_t isqrt32(uint32_t n) {
+  uint32_t res = 0;
+  uint32_t bit = (uint32_t)1 << 30;
+  while (bit > n)
+    bit >>= 2;
+  while (bit) {
+    if (n >= res + bit) {
+      n -= res + bit;
+      res = (res >> 1) + bit;
+    } else {
+      res >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint16_t)res;
+}
+
+uint32_t isqrt64(uint64_t n) {
+  uint64_t res = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+  while (bit > n)
+    bit >>= 2;
+  while (bit) {
+    if (n >= res + bit) {
+      n -= res + bit;
+      res = (res >> 1) + bit;
+    } else {
+      res >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint32_t)res;
+}
+
+static int64_t abs64(int64_t n) {
+  return n < 0 ? -n : n;
+}
+
+/*
+ * Scales a vector of 64-bit components to a Q14 unit vector.
+ */
+static short toUnitQ14(const int64_t* v, int16_t* unit) {
+  int64_t largest = abs64(v[0]);
+  if (abs64(v[1]) > largest)
+    largest = abs64(v[1]);
+  if (abs64(v[2]) > largest)
+    largest = abs64(v[2]);
+  if (largest == 0)
+    return E_NOT_ENOUGH_CALIBRATION_POINTS;
+
+  unsigned char shift = 0;
+  while ((largest >> shift) >= ((int64_t)1 << 30))
+    shift++;
+
+  int64_t s[3];
+  unsigned char i;
+  for (i=0; i<3; i++)
+    s[i] = v[i] >> shift;
+  uint32_t length = isqrt64((uint64_t)(s[0] * s[0]) + (uint64_t)(s[1] * s[1]) + (uint64_t)(s[2] * s[2]));
+  for (i=0; i<3; i++)
+    unit[i] = (int16_t)(s[i] * Q14_ONE / (int64_t)length);
+  return E_SUCCESS;
+}
+
+/*
+ * Dot product of a Q14 unit vector with a reading. Intermediate sums
+ * may wrap, but the result is bounded by the length of the reading
+ * and so always fits.
+ */
+static int32_t dotQ14(const int16_t* unit, const RawPoint* pt) {
+  uint32_t dot =
+    (uint32_t)((int32_t)unit[0] * pt->x) +
+    (uint32_t)((int32_t)unit[1] * pt->y) +
+    (uint32_t)((int32_t)unit[2] * pt->z);
+  return (int32_t)dot;
+}
+
+static uint16_t fixedCompassHeading(const FixedCalibration* cal, const RawPoint* sensorData) {
+  int32_t u = (int32_t)((uint32_t)dotQ14(cal->axisU, sensorData) - (uint32_t)cal->offsetU);
+  int32_t v = (int32_t)((uint32_t)dotQ14(cal->axisV, sensorData) - (uint32_t)cal->offsetV);
+  return fixedAtan2(v, u);
+}
+
+uint16_t binaryDeviation(const uint16_t* compassHeadings, const uint16_t* magneticHeadings, int pointCount,
+			 uint16_t compassHeading) {
+  if (pointCount == 0)
+    return compassHeading;
+  if (pointCount == 1)
+    return compassHeading + magneticHeadings[0] - compassHeadings[0];
+
+  int i = 0;
+  while (i < pointCount && compassHeadings[i] < compassHeading)
+    i++;
+
+  int from = (i == 0 || i == pointCount) ? pointCount - 1 : i - 1;
+  int to = (i == 0 || i == pointCount) ? 0 : i;
+
+  // Binary angles wrap on their own, so differences need no fixing up.
+  uint16_t span = compassHeadings[to] - compassHeadings[from];
+  uint16_t offset = compassHeading - compassHeadings[from];
+  int16_t change = (int16_t)(magneticHeadings[to] - magneticHeadings[from]);
+  if (span == 0)
+    return magneticHeadings[from];
+  int32_t proportion = (int32_t)(((uint32_t)offset << 15) / span); // Q15
+  return magneticHeadings[from] + (int16_t)(((int32_t)change * proportion + 0x4000) >> 15);
+}
+
+short startFixedCalibration(FixedCalibrationContext* ctx) {
+  unsigned char i;
+  ctx->count = 0;
+  for (i=0; i<3; i++)
+    ctx->sum[i] = 0;
+  for (i=0; i<6; i++)
+    ctx->sumProducts[i] = 0;
+  ctx->sumLength = 0;
+  ctx->finePointCount = 0;
+  return E_SUCCESS;
+}
+
+short addFixedCalibrationPoint(FixedCalibrationContext* ctx, const RawPoint* sensorData, const uint16_t* magneticHeading) {
+  if (ctx->count == FIXED_MAX_SENSOR_POINTS)
+    return E_TOO_MANY_COARSE_POINTS;
+  if (magneticHeading && ctx->finePointCount == MAX_CALIBRATION_POINTS)
+    return E_TOO_MANY_FINE_POINTS;
+
+  int32_t x = sensorData->x;
+  int32_t y = sensorData->y;
+  int32_t z = sensorData->z;
+  if (ctx->count == 0)
+    ctx->firstPoint = *sensorData;
+  ctx->count++;
+  ctx->sum[0] += x;
+  ctx->sum[1] += y;
+  ctx->sum[2] += z;
+  ctx->sumProducts[0] += x * x;
+  ctx->sumProducts[1] += x * y;
+  ctx->sumProducts[2] += x * z;
+  ctx->sumProducts[3] += y * y;
+  ctx->sumProducts[4] += y * z;
+  ctx->sumProducts[5] += z * z;
+  ctx->sumLength += isqrt32((uint32_t)(x * x) + (uint32_t)(y * y) + (uint32_t)(z * z));
+
+  if (magneticHeading != NULL) {
+    ctx->finePoints[ctx->finePointCount] = *sensorData;
+    ctx->fineHeadings[ctx->finePointCount] = *magneticHeading;
+    ctx->finePointCount++;
+  }
+  return E_SUCCESS;
+}
+
+short finalizeFixedCalibration(const FixedCalibrationContext* ctx, FixedCalibration* cal, short* quality) {
+  if (ctx->count < 3)
+    return E_NOT_ENOUGH_CALIBRATION_POINTS;
+
+  // Covariance scaled by count^2, exact in 64 bits.
+  int64_t n = ctx->count;
+  int64_t c[6] = {
+    n * ctx->sumProducts[0] - (int64_t)ctx->sum[0] * ctx->sum[0],
+    n * ctx->sumProducts[1] - (int64_t)ctx->sum[0] * ctx->sum[1],
+    n * ctx->sumProducts[2] - (int64_t)ctx->sum[0] * ctx->sum[2],
+    n * ctx->sumProducts[3] - (int64_t)ctx->sum[1] * ctx->sum[1],
+    n * ctx->sumProducts[4] - (int64_t)ctx->sum[1] * ctx->sum[2],
+    n * ctx->sumProducts[5] - (int64_t)ctx->sum[2] * ctx->sum[2]
+  };
+  unsigned char covShift = 0;
+  unsigned char i;
+  int k;
+  int64_t largest = 0;
+  for (i=0; i<6; i++)
+    if (abs64(c[i]) > largest)
+      largest = abs64(c[i]);
+  while ((largest >> covShift) >= ((int64_t)1 << 30))
+    covShift++;
+  int64_t xx = c[0] >> covShift, xy = c[1] >> covShift, xz = c[2] >> covShift;
+  int64_t yy = c[3] >> covShift, yz = c[4] >> covShift, zz = c[5] >> covShift;
+
+  /*
+   * For points on a plane every row of the adjugate of the
+   * covariance is parallel to the normal. Blend the rows weighted by
+   * their squared diagonal elements, as weightedDir does, after
+   * scaling them down so the products fit.
+   */
+  int64_t rows[3][3] = {
+    { yy * zz - yz * yz, xz * yz - xy * zz, xy * yz - xz * yy },
+    { xz * yz - xy * zz, xx * zz - xz * xz, xy * xz - yz * xx },
+    { xy * yz - xz * yy, xy * xz - yz * xx, xx * yy - xy * xy }
+  };
+  unsigned char j;
+  largest = 0;
+  for (i=0; i<3; i++)
+    for (j=0; j<3; j++)
+      if (abs64(rows[i][j]) > largest)
+	largest = abs64(rows[i][j]);
+  unsigned char rowShift = 0;
+  while ((largest >> rowShift) >= ((int64_t)1 << 29))
+    rowShift++;
+  for (i=0; i<3; i++)
+    for (j=0; j<3; j++)
+      rows[i][j] >>= rowShift;
+
+  int64_t row[3] = { 0, 0, 0 };
+  for (i=0; i<3; i++) {
+    int64_t det = rows[i][i] >> 14;
+    int64_t weight = det * det;
+    int64_t along = (row[0] >> 30) * rows[i][0] + (row[1] >> 30) * rows[i][1] + (row[2] >> 30) * rows[i][2];
+    if (along < 0)
+      weight = -weight;
+    for (j=0; j<3; j++)
+      row[j] += rows[i][j] * weight;
+  }
+  /*
+   * The blend leans towards the in-plane directions as the readings
+   * get noisier. The adjugate is the inverse scaled by the
+   * determinant, so multiplying by it is a step of inverse iteration
+   * that converges on the smallest eigenvector, as fitPlane uses.
+   * Between steps the vector is only shifted down to 15 bits.
+   */
+  for (k=0; k<FIXED_NORMAL_ITERATIONS; k++) {
+    largest = abs64(row[0]);
+    for (i=1; i<3; i++)
+      if (abs64(row[i]) > largest)
+	largest = abs64(row[i]);
+    unsigned char shift = 0;
+    while ((largest >> shift) >= ((int64_t)1 << 15))
+      shift++;
+    int64_t v[3] = { row[0] >> shift, row[1] >> shift, row[2] >> shift };
+    for (i=0; i<3; i++)
+      row[i] = rows[i][0] * v[0] + rows[i][1] * v[1] + rows[i][2] * v[2];
+  }
+  int16_t normal[3];
+  if (toUnitQ14(row, normal) != E_SUCCESS)
+    return E_NOT_ENOUGH_CALIBRATION_POINTS;
+
+  // Same orientation as normalToCartesian: d = -normal . centroid >= 0.
+  int64_t side = (int64_t)normal[0] * ctx->sum[0] + (int64_t)normal[1] * ctx->sum[1] + (int64_t)normal[2] * ctx->sum[2];
+  if (side > 0)
+    for (i=0; i<3; i++)
+      normal[i] = -normal[i];
+
+  if (quality) {
+    // Variance along the normal over mean length, as in finalizeCalibration.
+    int64_t var =
+      ((int64_t)normal[0] * normal[0] * xx + (int64_t)normal[1] * normal[1] * yy + (int64_t)normal[2] * normal[2] * zz +
+       2 * ((int64_t)normal[0] * normal[1] * xy + (int64_t)normal[0] * normal[2] * xz + (int64_t)normal[1] * normal[2] * yz))
+      >> 28;
+    if (var < 0)
+      var = 0;
+    uint32_t deviation = isqrt64((uint64_t)var << covShift);
+    *quality = 10000 - (short)((uint64_t)deviation * 10000 / ctx->sumLength);
+  }
+
+  // Origin as a sum over originCount readings.
+  int64_t originSum[3] = { ctx->sum[0], ctx->sum[1], ctx->sum[2] };
+  int64_t originCount = ctx->count;
+  if (ctx->finePointCount > 4) { // Minimum 4 points to get the centre
+    originSum[0] = originSum[1] = originSum[2] = 0;
+    for (k=0; k<ctx->finePointCount; k++) {
+      originSum[0] += ctx->finePoints[k].x;
+      originSum[1] += ctx->finePoints[k].y;
+      originSum[2] += ctx->finePoints[k].z;
+    }
+    originCount = ctx->finePointCount;
+  }
+
+  // Compass north, scaled by originCount and projected onto the plane.
+  int64_t north[3] = {
+    ctx->firstPoint.x * originCount - originSum[0],
+    ctx->firstPoint.y * originCount - originSum[1],
+    ctx->firstPoint.z * originCount - originSum[2]
+  };
+  int64_t along = normal[0] * north[0] + normal[1] * north[1] + normal[2] * north[2];
+  for (i=0; i<3; i++)
+    north[i] = north[i] * ((int64_t)Q14_ONE * Q14_ONE) - along * normal[i];
+  if (toUnitQ14(north, cal->axisU) != E_SUCCESS)
+    return E_NOT_ENOUGH_CALIBRATION_POINTS;
+
+  cal->axisV[0] = (int16_t)(((int32_t)normal[1] * cal->axisU[2] - (int32_t)normal[2] * cal->axisU[1]) / Q14_ONE);
+  cal->axisV[1] = (int16_t)(((int32_t)normal[2] * cal->axisU[0] - (int32_t)normal[0] * cal->axisU[2]) / Q14_ONE);
+  cal->axisV[2] = (int16_t)(((int32_t)normal[0] * cal->axisU[1] - (int32_t)normal[1] * cal->axisU[0]) / Q14_ONE);
+
+  int64_t offsetU = cal->axisU[0] * originSum[0] + cal->axisU[1] * originSum[1] + cal->axisU[2] * originSum[2];
+  int64_t offsetV = cal->axisV[0] * originSum[0] + cal->axisV[1] * originSum[1] + cal->axisV[2] * originSum[2];
+  cal->offsetU = (int32_t)((offsetU + (offsetU < 0 ? -originCount : originCount) / 2) / originCount);
+  cal->offsetV = (int32_t)((offsetV + (offsetV < 0 ? -originCount : originCount) / 2) / originCount);
+
+  // Fine calibration, kept sorted by compass heading.
+  cal->pointCount = 0;
+  for (k=0; k<ctx->finePointCount; k++) {
+    uint16_t compass = fixedCompassHeading(cal, &(ctx->finePoints[k]));
+    int j = cal->pointCount;
+    while (j > 0 && cal->compassHeading[j - 1] > compass) {
+      cal->compassHeading[j] = cal->compassHeading[j - 1];
+      cal->magneticHeading[j] = cal->magneticHeading[j - 1];
+      j--;
+    }
+    cal->compassHeading[j] = compass;
+    cal->magneticHeading[j] = ctx->fineHeadings[k];
+    cal->pointCount++;
+  }
+  return E_SUCCESS;
+}
+
+short getFixedHeading(const FixedCalibration* cal, const RawPoint* sensorData, uint16_t* heading) {
+  *heading = binaryDeviation(cal->compassHeading, cal->magneticHeading, cal->pointCount,
+			     fixedCompassHeading(cal, sensorData));
+  return E_SUCCESS;
+}
@@ -0,0 +1,278 @@
+#include "fleet.h"
+#include "compaxx_int.h"
+#include "sensorlog.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Jobs next to end - 1 not yet taken by any thread. The owner takes
+ * from next, thieves from end.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  int next;
+  int end;
+} FleetShare;
+
+/*
+ * handovers counts the steals so far, each of which moves jobs from one
+ * share to another.
+ */
+typedef struct {
+  FleetJob* jobs;
+  int threadCount;
+  int handovers;
+  FleetShare shares[FLEET_MAX_THREADS];
+} Fleet;
+
+typedef struct {
+  Fleet* fleet;
+  int index;
+} FleetWorker;
+
+static int takeOwnJob(FleetShare* share) {
+  int job = -1;
+  pthread_mutex_lock(&(share->lock));
+  if (share->next < share->end)
+    job = share->next++;
+  pthread_mutex_unlock(&(share->lock));
+  return job;
+}
+
+/*
+ * Moves the back half of the largest other share to this thread's own,
+ * which is empty, and returns the first job of it; -1 once all shares
+ * are empty. Jobs only enter a share when they are handed over, with
+ * both shares locked, so no job is ever outside a share. A sweep can
+ * still miss jobs that are handed over from a share it has yet to look
+ * at to one it has passed, but that bumps handovers. A sweep that
+ * finds every share empty without handovers changing has seen them
+ * all empty at once; otherwise it is repeated.
+ */
+static int stealJob(Fleet* fleet, int self) {
+  FleetShare* own = &(fleet->shares[self]);
+  for (;;) {
+    int handovers = __atomic_load_n(&(fleet->handovers), __ATOMIC_ACQUIRE);
+    int victim = -1, largest = 0, i;
+    for (i=0; i<fleet->threadCount; i++) {
+      FleetShare* share = &(fleet->shares[i]);
+      if (i == self)
+	continue;
+      pthread_mutex_lock(&(share->lock));
+      int left = share->end - share->next;
+      pthread_mutex_unlock(&(share->lock));
+      if (left > largest) {
+	largest = left;
+	victim = i;
+      }
+    }
+    if (victim < 0) {
+      if (__atomic_load_n(&(fleet->handovers), __ATOMIC_ACQUIRE) == handovers)
+	return -1;
+      continue;
+    }
+
+    // Locked in index order, so two thieves never wait on each other.
+    FleetShare* share = &(fleet->shares[victim]);
+    FleetShare* first = victim < self ? share : own;
+    FleetShare* second = victim < self ? own : share;
+    pthread_mutex_lock(&(first->lock));
+    pthread_mutex_lock(&(second->lock));
+    int job = -1;
+    int left = share->end - share->next;
+    if (left > 0) {
+      own->end = share->end;
+      share->end -= (left + 1) / 2;
+      job = share->end;
+      own->next = job + 1;
+      __atomic_fetch_add(&(fleet->handovers), 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(second->lock));
+    pthread_mutex_unlock(&(first->lock));
+    if (job >= 0)
+      return job;
+    // Emptied since it was looked at
+  }
+}
+
+#define FLEET_BATCH_POINTS 64
+
+static void calibrateJob(FleetJob* job, CalibrationContext* ctx) {
+  SensorLog log;
+  job->readingCount = 0;
+  job->quality = 0.0f;
+  if (openSensorLog(&log, job->fileName) != E_SUCCESS) {
+    job->status = E_UNREADABLE_LOG;
+    return;
+  }
+
+  startCalibration(ctx);
+  ctx->retention = RETENTION_RESERVOIR;
+  Point batch[FLEET_BATCH_POINTS];
+  int n, i;
+  while ((n = readSensorLog(&log, batch, FLEET_BATCH_POINTS)) > 0)
+    for (i=0; i<n; i++)
+      addCalibrationPoint(ctx, &batch[i], NULL);
+  job->readingCount = log.readingCount;
+  closeSensorLog(&log);
+
+  if (job->readingCount == 0)
+    job->status = E_UNREADABLE_LOG;
+  else
+    job->status = finalizeCalibration(ctx, &(job->cal), &(job->quality));
+}
+
+static void* fleetWorker(void* arg) {
+  FleetWorker* worker = (FleetWorker*)arg;
+  Fleet* fleet = worker->fleet;
+  CalibrationContext ctx;
+  int job;
+
+  while ((job = takeOwnJob(&(fleet->shares[worker->index]))) >= 0 ||
+	 (job = stealJob(fleet, worker->index)) >= 0)
+    calibrateJob(&(fleet->jobs[job]), &ctx);
+  return NULL;
+}
+
+static int fleetThreads(int threadCount) {
+  if (threadCount <= 0)
+    threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threadCount < 1)
+    threadCount = 1;
+  if (threadCount > FLEET_MAX_THREADS)
+    threadCount = FLEET_MAX_THREADS;
+  return threadCount;
+}
+
+int calibrateFleet(FleetJob* jobs, int jobCount, int threadCount) {
+  Fleet fleet;
+  FleetWorker workers[FLEET_MAX_THREADS];
+  pthread_t threads[FLEET_MAX_THREADS];
+  int started[FLEET_MAX_THREADS];
+  int i;
+
+  threadCount = fleetThreads(threadCount);
+
+  fleet.jobs = jobs;
+  fleet.threadCount = threadCount;
+  fleet.handovers = 0;
+  for (i=0; i<threadCount; i++) {
+    pthread_mutex_init(&(fleet.shares[i].lock), NULL);
+    fleet.shares[i].next = (int)((long)jobCount * i / threadCount);
+    fleet.shares[i].end = (int)((long)jobCount * (i + 1) / threadCount);
+    workers[i].fleet = &fleet;
+    workers[i].index = i;
+  }
+
+  for (i=1; i<threadCount; i++)
+    started[i] = pthread_create(&threads[i], NULL, fleetWorker, &workers[i]) == 0;
+  fleetWorker(&workers[0]);
+  for (i=1; i<threadCount; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+
+  int calibrated = 0;
+  for (i=0; i<threadCount; i++)
+    pthread_mutex_destroy(&(fleet.shares[i].lock));
+  for (i=0; i<jobCount; i++)
+    if (jobs[i].status == E_SUCCESS)
+      calibrated++;
+  return calibrated;
+}
+
+void writeFleetResults(const FleetJob* jobs, int jobCount, FILE* out) {
+  int i;
+  fprintf(out, "log,status,readings,quality,hard_iron_x,hard_iron_y,hard_iron_z,normal_x,normal_y,normal_z\n");
+  for (i=0; i<jobCount; i++) {
+    const FleetJob* job = &(jobs[i]);
+    fprintf(out, "%s,%d,%ld", job->fileName, job->status, job->readingCount);
+    if (job->status == E_SUCCESS) {
+      const Point* normal = &(job->cal.transform.normal);
+      Point hardIron = *normal;
+      mulByScalar(&hardIron, -job->cal.verticalField);
+      addTo(&hardIron, &(job->cal.origin));
+      fprintf(out, ",%.2f,%.3f,%.3f,%.3f,%.5f,%.5f,%.5f\n", job->quality,
+	      hardIron.x, hardIron.y, hardIron.z, normal->x, normal->y, normal->z);
+    } else {
+      fprintf(out, ",,,,,,,\n");
+    }
+  }
+}
+
+#define MOMENT_BLOCK_POINTS 1024
+#define MOMENT_LEVELS 48
+
+typedef struct {
+  const Point* points;
+  long count;
+  MomentAccumulator moments;
+} MomentPart;
+
+/*
+ * Pairwise merging of blocks, as in pairwise summation: levels[k]
+ * holds 2^k blocks while the count of blocks so far has bit k set.
+ */
+static void* momentsWorker(void* arg) {
+  MomentPart* part = (MomentPart*)arg;
+  MomentAccumulator levels[MOMENT_LEVELS];
+  long block, blocks = (part->count + MOMENT_BLOCK_POINTS - 1) / MOMENT_BLOCK_POINTS;
+  int k;
+
+  for (block=0; block<blocks; block++) {
+    MomentAccumulator acc;
+    momentsReset(&acc);
+    long i, end = (block + 1) * MOMENT_BLOCK_POINTS;
+    if (end > part->count)
+      end = part->count;
+    for (i=block * MOMENT_BLOCK_POINTS; i<end; i++)
+      momentsAdd(&acc, &(part->points[i]));
+    for (k=0; (block >> k) & 1; k++) {
+      momentsMerge(&(levels[k]), &acc);
+      acc = levels[k];
+    }
+    levels[k] = acc;
+  }
+
+  // What is left, smallest (latest) last
+  momentsReset(&(part->moments));
+  for (k=MOMENT_LEVELS - 1; k>=0; k--)
+    if ((blocks >> k) & 1)
+      momentsMerge(&(part->moments), &(levels[k]));
+  return NULL;
+}
+
+short addStreamCalibrationPoints(StreamCalibrationContext* ctx, const Point* sensorData, long count, int threadCount) {
+  MomentPart parts[FLEET_MAX_THREADS];
+  pthread_t threads[FLEET_MAX_THREADS];
+  int started[FLEET_MAX_THREADS];
+  int i;
+
+  if (count <= 0)
+    return E_SUCCESS;
+  threadCount = fleetThreads(threadCount);
+  if (threadCount > count)
+    threadCount = (int)count;
+
+  for (i=0; i<threadCount; i++) {
+    long from = count * i / threadCount;
+    parts[i].points = sensorData + from;
+    parts[i].count = count * (i + 1) / threadCount - from;
+  }
+  for (i=1; i<threadCount; i++)
+    started[i] = pthread_create(&threads[i], NULL, momentsWorker, &parts[i]) == 0;
+  momentsWorker(&parts[0]);
+  for (i=1; i<threadCount; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      momentsWorker(&parts[i]);
+  }
+
+  if (ctx->moments.count == 0)
+    ctx->firstPoint = sensorData[0];
+  for (i=0; i<threadCount; i++)
+    momentsMerge(&(ctx->moments), &(parts[i].moments));
+  return E_SUCCESS;
+}
@@ -0,0 +1,80 @@
+#ifndef __FLEET_H__
+#define __FLEET_H__
+
+#include <stdio.h>
+#include "compaxx.h"
+
+/*
+ * Host-side batch calibration: of many sensors from their raw logs,
+ * one file per sensor as read by readSensorLog, and of one sensor from
+ * more readings than fit a CalibrationContext. Not part of the MCU
+ * library: it needs stdio and POSIX threads.
+ */
+
+#define FLEET_MAX_THREADS         64
+
+typedef struct {
+  const char* fileName;
+  /*
+   * Set by calibrateFleet: status is the result of finalizeCalibration,
+   * or E_UNREADABLE_LOG if the log cannot be opened or holds no
+   * readings, and readingCount the number of readings in the log, of
+   * which a uniform sample of up to MAX_SENSOR_POINTS is used.
+   */
+  short status;
+  long readingCount;
+  float quality;
+  Calibration cal;
+} FleetJob;
+
+/**
+ * Calibrates each job from its log, as finalizeCalibration with
+ * RETENTION_RESERVOIR, on a pool of threads. Each thread starts on an
+ * equal share of the jobs and, once done, steals half of what is left
+ * of the largest remaining share, so that long logs do not hold up the
+ * rest. Results do not depend on the number of threads. The calling
+ * thread is one of them, so all jobs are done even if no other thread
+ * can be started.
+ *
+ * @param jobs Jobs with fileName set.
+ * @param jobCount Number of jobs.
+ * @param threadCount Number of threads, up to FLEET_MAX_THREADS; 0 for
+ * one per online CPU.
+ *
+ * @return Number of jobs calibrated with E_SUCCESS.
+ */
+int calibrateFleet(FleetJob* jobs, int jobCount, int threadCount);
+
+/**
+ * Writes a results table, one CSV row per job with a header line:
+ * log, status, readings, quality, the hard iron offset and the unit
+ * plane normal. The offset is origin moved back along the normal by
+ * verticalField, which finalizeCalibration only finds with
+ * ORIGIN_ELLIPSOID. calibrateFleet uses ORIGIN_CENTROID, so these
+ * columns hold the centre of the level readings, which lies off the
+ * true offset along the normal by the vertical field.
+ *
+ * @param jobs Jobs as left by calibrateFleet.
+ * @param jobCount Number of jobs.
+ * @param out Stream to write to.
+ */
+void writeFleetResults(const FleetJob* jobs, int jobCount, FILE* out);
+
+/**
+ * Adds coarse calibration points to a streaming calibration context,
+ * as addStreamCalibrationPoint would one after the other, on a number
+ * of threads. Each thread takes an equal part of the points and sums
+ * them block by block, merging the blocks pairwise, so that tens of
+ * millions of points lose no more precision than thousands do; the
+ * parts are then merged into ctx in order.
+ *
+ * @param ctx Existing streaming calibration context
+ * @param sensorData Sensor data as returned by the 3-axis instrument
+ * @param count Number of points.
+ * @param threadCount Number of threads, up to FLEET_MAX_THREADS; 0 for
+ * one per online CPU.
+ * @return E_SUCCESS
+ */
+short addStreamCalibrationPoints(StreamCalibrationContext* ctx, const Point* sensorData, long count, int threadCount);
+
+#endif
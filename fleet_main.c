@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fleet.h"
+
+/*
+ * Calibrates a fleet from its logs, one CSV file of x,y,z readings per
+ * sensor, and writes the results table. Exits with 1 unless every log
+ * gave a calibration.
+ *
+ *   compaxx-fleet [-j threads] [-o results.csv] log.csv...
+ */
+
+static void usage() {
+  fprintf(stderr, "usage: compaxx-fleet [-j threads] [-o results.csv] log.csv...\n");
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  int threadCount = 0;
+  const char* outName = NULL;
+  int i = 1;
+
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      threadCount = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      outName = argv[++i];
+    else
+      usage();
+  }
+  int jobCount = argc - i;
+  if (jobCount == 0)
+    usage();
+
+  FleetJob* jobs = calloc(jobCount, sizeof(FleetJob));
+  if (jobs == NULL) {
+    fprintf(stderr, "Out of memory for %d logs\n", jobCount);
+    return 2;
+  }
+  int k;
+  for (k=0; k<jobCount; k++)
+    jobs[k].fileName = argv[i + k];
+
+  int calibrated = calibrateFleet(jobs, jobCount, threadCount);
+
+  FILE* out = outName ? fopen(outName, "w") : stdout;
+  if (out == NULL) {
+    fprintf(stderr, "Cannot open: %s\n", outName);
+    return 2;
+  }
+  writeFleetResults(jobs, jobCount, out);
+  if (out != stdout)
+    fclose(out);
+  fprintf(stderr, "%d of %d logs calibrated\n", calibrated, jobCount);
+  free(jobs);
+  return calibrated == jobCount ? 0 : 1;
+}
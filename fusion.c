@@ -0,0 +1,58 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+/*
+ * Complementary filter with bias estimation (a PI loop on the heading
+ * error). With natural frequency w = 1 / timeConstant and damping 1,
+ *
+ *   heading' = yawRate - bias + 2 w e
+ *   bias'    = -w^2 e
+ *
+ * where e is the magnetic heading minus the estimate, taken the short
+ * way round so that the 0/360 wrap is never crossed the long way.
+ *
+ * Stepped with Euler, the loop is only stable for w dt < 2 (sqrt(2) - 1),
+ * about 0.83, and overshoots every step from w dt = 1/2 on. Longer
+ * steps are corrected as the loop would correct one of timeConstant / 2
+ * (gain * dt = 1) with the same error, while the gyro is still
+ * integrated over all of dt.
+ */
+
+// Difference a - b in (-180, 180].
+float headingDelta(float a, float b) {
+  float d = a - b;
+  if (d > 180.0f)
+    d -= 360;
+  else if (d <= -180.0f)
+    d += 360;
+  return d;
+}
+
+short startGyroFusion(GyroFusion* fusion, float timeConstant) {
+  fusion->heading = 0.0f;
+  fusion->bias = 0.0f;
+  fusion->gain = 2.0f / timeConstant;
+  fusion->biasGain = 1.0f / (timeConstant * timeConstant);
+  fusion->started = 0;
+  return E_SUCCESS;
+}
+
+short fuseHeading(GyroFusion* fusion, float heading, float yawRate, float dt, float* fused) {
+  if (!fusion->started) {
+    fusion->heading = heading;
+    fusion->started = 1;
+  } else {
+    float predicted = fusion->heading + (yawRate - fusion->bias) * dt;
+    float error = headingDelta(heading, predicted);
+    float reach = fusion->gain * dt;
+    float scale = reach > 1.0f ? 1.0f / reach : 1.0f;
+    fusion->heading = predicted + reach * scale * error;
+    fusion->bias -= fusion->biasGain * dt * scale * scale * error;
+    if (fusion->heading < 0)
+      fusion->heading += 360;
+    else if (fusion->heading >= 360.0f)
+      fusion->heading -= 360;
+  }
+  *fused = fusion->heading;
+  return E_SUCCESS;
+}
@@ -0,0 +1,313 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+/*
+ * Origin fits for finalizeCalibration. Readings are taken relative to
+ * their centroid c, along unit axes e1 and e2 in the plane (or x, y
+ * and z for the ellipsoid), and divided by their RMS distance from c.
+ * That keeps the fourth powers summed into the normal equations near
+ * 1 and their condition within what float elimination can solve.
+ *
+ * Soft iron turns the circle of level readings into an ellipse
+ * (y - y0)' M (y - y0) = k. Its correction within the plane is
+ * sqrt(M), which maps the ellipse back onto a circle without turning
+ * it, scaled to unit determinant so that it keeps the mean radius;
+ * k then drops out. The fits equate each conic to 1 where the
+ * centroid, inside the readings, gives 0, so M comes out positive
+ * definite whenever the readings do lie on an ellipse.
+ */
+
+void softIronApply(const float* softIron, const Point* pt, Point* res) {
+  res->x = softIron[0] * pt->x + softIron[1] * pt->y + softIron[2] * pt->z;
+  res->y = softIron[3] * pt->x + softIron[4] * pt->y + softIron[5] * pt->z;
+  res->z = softIron[6] * pt->x + softIron[7] * pt->y + softIron[8] * pt->z;
+}
+
+static void normalAdd(float* ata, float* atb, const float* row, float rhs, short n) {
+  short i, j;
+  for (i=0; i<n; i++) {
+    for (j=0; j<n; j++)
+      ata[i * n + j] += row[i] * row[j];
+    atb[i] += row[i] * rhs;
+  }
+}
+
+/*
+ * Soft iron correction for the ellipse with shape [a b; b c] in the
+ * plane: its square root over the fourth root of its determinant, as
+ * the 3 x 3 matrix that acts as that along e1 and e2 and leaves the
+ * normal alone.
+ */
+static short planeSoftIron(float a, float b, float c, const Point* e1, const Point* e2, float* softIron) {
+  float det = a * c - b * b;
+  if (!(a > 0.0f && det > 0.0f))
+    return E_DEGENERATE_CALIBRATION;
+  float s = sqrtf(det);
+  float t = sqrtf(a + c + 2.0f * s) * sqrtf(s);
+  float w[4] = { (a + s) / t - 1.0f, b / t, b / t, (c + s) / t - 1.0f };
+  const float e[2][3] = { { e1->x, e1->y, e1->z }, { e2->x, e2->y, e2->z } };
+
+  short i, j, k, l;
+  for (i=0; i<3; i++)
+    for (j=0; j<3; j++) {
+      float sum = i == j ? 1.0f : 0.0f;
+      for (k=0; k<2; k++)
+	for (l=0; l<2; l++)
+	  sum += e[k][i] * w[k * 2 + l] * e[l][j];
+      softIron[i * 3 + j] = sum;
+    }
+  return E_SUCCESS;
+}
+
+static void planePoint(const Point* c, const Point* e1, const Point* e2, float scale, float y1, float y2, Point* pt) {
+  pt->x = c->x + scale * (y1 * e1->x + y2 * e2->x);
+  pt->y = c->y + scale * (y1 * e1->y + y2 * e2->y);
+  pt->z = c->z + scale * (y1 * e1->z + y2 * e2->z);
+}
+
+/*
+ * Circle u^2 + v^2 + D u + E v + F = 0 (Kasa), centred on
+ * (-D / 2, -E / 2).
+ */
+static short fitCircle(const CalibrationContext* ctx, const Point* c, const Point* e1, const Point* e2, float scale,
+		       float* centre) {
+  float ata[9] = { 0 };
+  float atb[3] = { 0 };
+  int i;
+  for (i=0; i<ctx->pointCount; i++) {
+    Point d;
+    pointVec(c, &(ctx->points[i].sensorData), &d);
+    float row[3] = { dotProduct(e1, &d) / scale, dotProduct(e2, &d) / scale, 1.0f };
+    normalAdd(ata, atb, row, -(row[0] * row[0] + row[1] * row[1]), 3);
+  }
+
+  Matrix m = { ata[0], ata[1], ata[2], ata[3], ata[4], ata[5], ata[6], ata[7], ata[8] };
+  if (!(fabsf(matrixDet(&m)) > 1e-9f))
+    return E_DEGENERATE_CALIBRATION;
+  Matrix inv;
+  matrixInv(&m, &inv);
+  centre[0] = -(inv.a1 * atb[0] + inv.a2 * atb[1] + inv.a3 * atb[2]) / 2;
+  centre[1] = -(inv.b1 * atb[0] + inv.b2 * atb[1] + inv.b3 * atb[2]) / 2;
+  return E_SUCCESS;
+}
+
+/*
+ * Conic A u^2 + B uv + C v^2 + D u + E v = 1, which cannot pass
+ * through the centroid, so needs no other constraint. With
+ * Q = [A B/2; B/2 C] its centre is -Q^-1 (D, E) / 2.
+ */
+static short fitEllipse(const CalibrationContext* ctx, const Point* c, const Point* e1, const Point* e2, float scale,
+			float* centre, float* softIron) {
+  float ata[25] = { 0 };
+  float atb[5] = { 0 };
+  int i;
+  for (i=0; i<ctx->pointCount; i++) {
+    Point d;
+    pointVec(c, &(ctx->points[i].sensorData), &d);
+    float u = dotProduct(e1, &d) / scale;
+    float v = dotProduct(e2, &d) / scale;
+    float row[5] = { u * u, u * v, v * v, u, v };
+    normalAdd(ata, atb, row, 1.0f, 5);
+  }
+  short rc = solveLinear(ata, atb, 5);
+  if (rc != E_SUCCESS)
+    return rc;
+
+  float a = atb[0], b = atb[1] / 2, cc = atb[2];
+  float det = a * cc - b * b;
+  if (!(fabsf(det) > 0.0f))
+    return E_DEGENERATE_CALIBRATION;
+  centre[0] = -(cc * atb[3] - b * atb[4]) / det / 2;
+  centre[1] = -(a * atb[4] - b * atb[3]) / det / 2;
+  return planeSoftIron(a, b, cc, e1, e2, softIron);
+}
+
+/*
+ * Quadric x' A x + 2 b' x = 1, centred on h = -A^-1 b.
+ */
+static short fitQuadric(const CalibrationContext* ctx, const Point* c, float scale, Matrix* a, Point* h) {
+  float ata[81] = { 0 };
+  float atb[9] = { 0 };
+  int i;
+  for (i=0; i<ctx->pointCount; i++) {
+    Point d;
+    pointVec(c, &(ctx->points[i].sensorData), &d);
+    mulByScalar(&d, 1.0f / scale);
+    float row[9] = { d.x * d.x, d.y * d.y, d.z * d.z, 2 * d.y * d.z, 2 * d.x * d.z, 2 * d.x * d.y,
+		     2 * d.x, 2 * d.y, 2 * d.z };
+    normalAdd(ata, atb, row, 1.0f, 9);
+  }
+  short rc = solveLinear(ata, atb, 9);
+  if (rc != E_SUCCESS)
+    return rc;
+
+  Matrix m = { atb[0], atb[5], atb[4], atb[5], atb[1], atb[3], atb[4], atb[3], atb[2] };
+  if (!(fabsf(matrixDet(&m)) > 0.0f))
+    return E_DEGENERATE_CALIBRATION;
+  Matrix inv;
+  matrixInv(&m, &inv);
+  h->x = -(inv.a1 * atb[6] + inv.a2 * atb[7] + inv.a3 * atb[8]);
+  h->y = -(inv.b1 * atb[6] + inv.b2 * atb[7] + inv.b3 * atb[8]);
+  h->z = -(inv.c1 * atb[6] + inv.c2 * atb[7] + inv.c3 * atb[8]);
+  *a = m;
+  return E_SUCCESS;
+}
+
+/*
+ * The plane that best fits level and heeled readings together is only
+ * level if heel to either side is symmetric about it, which soft iron
+ * undoes. With A = L L' (Cholesky), readings mapped to L' x lie on a
+ * sphere again, where it is restored. The normal n of their plane is
+ * L n back among the readings.
+ */
+static short levelNormal(const CalibrationContext* ctx, const Point* c, const Matrix* a, Point* normal) {
+  float l[3][3] = { { 0 } };
+  float d1 = a->a1;
+  if (!(d1 > 0.0f))
+    return E_DEGENERATE_CALIBRATION;
+  l[0][0] = sqrtf(d1);
+  l[1][0] = a->b1 / l[0][0];
+  l[2][0] = a->c1 / l[0][0];
+  float d2 = a->b2 - l[1][0] * l[1][0];
+  if (!(d2 > 0.0f))
+    return E_DEGENERATE_CALIBRATION;
+  l[1][1] = sqrtf(d2);
+  l[2][1] = (a->c2 - l[2][0] * l[1][0]) / l[1][1];
+  float d3 = a->c3 - l[2][0] * l[2][0] - l[2][1] * l[2][1];
+  if (!(d3 > 0.0f))
+    return E_DEGENERATE_CALIBRATION;
+  l[2][2] = sqrtf(d3);
+
+  CovarianceMatrix covar;
+  covariance(ctx->points, ctx->pointCount, c, &covar);
+  float cv[3][3] = { { covar.xx, covar.xy, covar.xz }, { covar.xy, covar.yy, covar.yz },
+		     { covar.xz, covar.yz, covar.zz } };
+  float m[3][3];
+  short i, j, k, q;
+  for (i=0; i<3; i++)
+    for (j=0; j<3; j++) {
+      m[i][j] = 0.0f;
+      for (k=0; k<3; k++)
+	for (q=0; q<3; q++)
+	  m[i][j] += l[k][i] * cv[k][q] * l[q][j];
+    }
+  CovarianceMatrix mapped = { m[0][0], m[0][1], m[0][2], m[1][1], m[1][2], m[2][2] };
+  float values[3];
+  Point n;
+  short rc = symmetricEigen(&mapped, values, &n);
+  if (rc != E_SUCCESS)
+    return rc;
+  normal->x = l[0][0] * n.x;
+  normal->y = l[1][0] * n.x + l[1][1] * n.y;
+  normal->z = l[2][0] * n.x + l[2][1] * n.y + l[2][2] * n.z;
+  normalize(normal);
+  return E_SUCCESS;
+}
+
+/*
+ * Level readings are the section of the quadric by the plane through
+ * the first of them, which lies off the centroid by d along the normal
+ * n when the rest were taken heeled. There, x = d n + E y for
+ * E = [e1 e2], it is the ellipse with shape Q = E' A E and centre
+ * y0 = Q^-1 E' A (h - d n).
+ */
+static short sectionEllipse(const CalibrationContext* ctx, const Point* c, const Point* e1, const Point* e2,
+			    const Point* normal, float scale, const Matrix* m, const Point* h, float* centre,
+			    float* softIron) {
+  Point ae1 = { m->a1 * e1->x + m->a2 * e1->y + m->a3 * e1->z,
+		m->b1 * e1->x + m->b2 * e1->y + m->b3 * e1->z,
+		m->c1 * e1->x + m->c2 * e1->y + m->c3 * e1->z };
+  Point ae2 = { m->a1 * e2->x + m->a2 * e2->y + m->a3 * e2->z,
+		m->b1 * e2->x + m->b2 * e2->y + m->b3 * e2->z,
+		m->c1 * e2->x + m->c2 * e2->y + m->c3 * e2->z };
+  Point level, section = *normal;
+  pointVec(c, &(ctx->points[0].sensorData), &level);
+  mulByScalar(&section, -dotProduct(normal, &level) / scale);
+  addTo(&section, h);
+  float a = dotProduct(e1, &ae1), b = dotProduct(e1, &ae2), cc = dotProduct(e2, &ae2);
+  float g1 = dotProduct(&ae1, &section), g2 = dotProduct(&ae2, &section);
+  float det = a * cc - b * b;
+  if (!(fabsf(det) > 0.0f))
+    return E_DEGENERATE_CALIBRATION;
+  centre[0] = (cc * g1 - b * g2) / det;
+  centre[1] = (a * g2 - b * g1) / det;
+  return planeSoftIron(a, b, cc, e1, e2, softIron);
+}
+
+short fitOrigin(const CalibrationContext* ctx, Calibration* cal, Point* origin, float* softIron,
+		float* verticalField) {
+  static const short unknowns[] = { 0, 3, 5, 9 };
+  if (ctx->originModel < ORIGIN_CIRCLE || ctx->originModel > ORIGIN_ELLIPSOID)
+    return E_DEGENERATE_CALIBRATION;
+  if (ctx->pointCount < unknowns[ctx->originModel])
+    return E_NOT_ENOUGH_CALIBRATION_POINTS;
+
+  Point c, normal = { cal->planeA, cal->planeB, cal->planeC };
+  centroid(ctx->points, ctx->pointCount, &c);
+  normalize(&normal);
+
+  float sumSq = 0.0f;
+  int i;
+  for (i=0; i<ctx->pointCount; i++) {
+    Point d;
+    pointVec(&c, &(ctx->points[i].sensorData), &d);
+    sumSq += dotProduct(&d, &d);
+  }
+  float scale = sqrtf(sumSq / ctx->pointCount);
+  if (!(scale > 0.0f))
+    return E_DEGENERATE_CALIBRATION;
+
+  short rc;
+  Matrix quadric = { 0 };
+  Point h;
+  if (ctx->originModel == ORIGIN_ELLIPSOID) {
+    rc = fitQuadric(ctx, &c, scale, &quadric, &h);
+    if (rc == E_SUCCESS)
+      rc = levelNormal(ctx, &c, &quadric, &normal);
+    if (rc != E_SUCCESS)
+      return rc;
+    Point cartesian;
+    normalToCartesian(&normal, &c, &cartesian);
+    cal->planeA = cartesian.x;
+    cal->planeB = cartesian.y;
+    cal->planeC = cartesian.z;
+    normal = cartesian;
+    normalize(&normal);
+  }
+
+  // Axes in the plane, e1 towards the first point
+  Point e1, e2, across;
+  pointVec(&c, &(ctx->points[0].sensorData), &e1);
+  across = normal;
+  mulByScalar(&across, -dotProduct(&e1, &normal));
+  addTo(&e1, &across);
+  if (!(dotProduct(&e1, &e1) > 0.0f))
+    return E_DEGENERATE_CALIBRATION;
+  normalize(&e1);
+  crossProduct(&normal, &e1, &e2);
+
+  float centre[2];
+  *verticalField = 0.0f;
+  for (i=0; i<9; i++)
+    softIron[i] = i % 4 == 0 ? 1.0f : 0.0f;
+  if (ctx->originModel == ORIGIN_CIRCLE)
+    rc = fitCircle(ctx, &c, &e1, &e2, scale, centre);
+  else if (ctx->originModel == ORIGIN_ELLIPSE)
+    rc = fitEllipse(ctx, &c, &e1, &e2, scale, centre, softIron);
+  else
+    rc = sectionEllipse(ctx, &c, &e1, &e2, &normal, scale, &quadric, &h, centre, softIron);
+  if (rc != E_SUCCESS)
+    return rc;
+  planePoint(&c, &e1, &e2, scale, centre[0], centre[1], origin);
+
+  // The ellipsoid centre is the hard iron offset, which level
+  // readings put some way off the plane.
+  if (ctx->originModel == ORIGIN_ELLIPSOID) {
+    Point hardIron = c, offset;
+    mulByScalar(&h, scale);
+    addTo(&hardIron, &h);
+    pointVec(&hardIron, origin, &offset);
+    *verticalField = dotProduct(&normal, &offset);
+  }
+  return E_SUCCESS;
+}
@@ -0,0 +1,61 @@
+#include "mcu.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+/*
+ * AVR platform for simavr. Timer1 runs at the CPU clock and its
+ * overflows extend it to 32 bits; the USART output is echoed by
+ * simavr and sleeping with interrupts disabled ends the simulation.
+ */
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+#define BAUD 115200
+
+static volatile uint16_t overflows = 0;
+
+ISR(TIMER1_OVF_vect) {
+  overflows++;
+}
+
+void mcuInit() {
+  UBRR0 = F_CPU / 8 / BAUD - 1;
+  UCSR0A = _BV(U2X0);
+  UCSR0B = _BV(TXEN0);
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);
+  TIMSK1 = _BV(TOIE1);
+  sei();
+}
+
+uint32_t mcuCycles() {
+  uint8_t sreg = SREG;
+  cli();
+  uint16_t low = TCNT1;
+  uint16_t high = overflows;
+  // An overflow not yet serviced belongs to this reading if the
+  // counter has already wrapped past it.
+  if ((TIFR1 & _BV(TOV1)) && low < 0x8000)
+    high++;
+  SREG = sreg;
+  return ((uint32_t)high << 16) | low;
+}
+
+void mcuPutc(char c) {
+  loop_until_bit_is_set(UCSR0A, UDRE0);
+  UDR0 = c;
+}
+
+void mcuExit(int status) {
+  loop_until_bit_is_set(UCSR0A, TXC0);
+  cli();
+  sleep_enable();
+  sleep_cpu();
+  for (;;)
+    ;
+}
@@ -0,0 +1,374 @@
+#include "../compaxx.h"
+#include "../compaxx_int.h"
+#include "mcu.h"
+
+#include <math.h>
+
+#define RUNS 16
+
+/*
+ * Benchmark firmware. Runs every public entry point a few times on
+ * synthetic readings and prints one "name,cycles/call" line per
+ * function, followed by the stack high-water mark.
+ *
+ * The float CalibrationContext needs about 4 KB of RAM and is left out
+ * on parts that do not have it, such as the ATmega328P.
+ */
+
+#if defined(__AVR__)
+#include <avr/io.h>
+#if RAMEND < 0x1000
+#define NO_FULL_CONTEXT
+#endif
+#endif
+
+void putString(const char* s) {
+  while (*s)
+    mcuPutc(*s++);
+}
+
+void putNumber(uint32_t n) {
+  char buf[11];
+  int i = 0;
+  do {
+    buf[i++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  while (i > 0)
+    mcuPutc(buf[--i]);
+}
+
+void report(const char* name, uint32_t cycles, uint16_t calls) {
+  putString(name);
+  mcuPutc(',');
+  putNumber(cycles / calls);
+  mcuPutc('\n');
+}
+
+uint32_t overhead;
+
+/*
+ * Everything large lives in static storage, so that the image's data
+ * and bss, as avr-size reports them, are most of the RAM it needs and
+ * check-mcu can hold them against the part. The benchmarks run one
+ * after the other, so their working storage is shared: the heading
+ * buffers reuse the streaming context once it is finalized.
+ */
+typedef struct {
+  SampleRing ring;
+  PackedCalibration packed;
+  float xs[RUNS];
+  float ys[RUNS];
+  float zs[RUNS];
+  float headings[RUNS];
+} HeadingWork;
+
+typedef struct {
+  FixedCalibrationContext ctx;
+  FixedCalibration cal;
+} FixedWork;
+
+static union {
+  StreamCalibrationContext stream;
+  HeadingWork heading;
+  FixedWork fixed;
+#ifndef NO_FULL_CONTEXT
+  CalibrationContext full;
+#endif
+} work;
+
+static Calibration calibration;
+
+uint32_t elapsed(uint32_t start) {
+  uint32_t cycles = mcuCycles() - start;
+  return cycles > overhead ? cycles - overhead : 0;
+}
+
+// Same tilted circle as the host benchmarks, so the numbers compare.
+void syntheticPoint(uint16_t step, uint16_t steps, Point* pt) {
+  float rad = step * 2 * PI_F / steps;
+  pt->x = 100 + 500 * cosf(rad);
+  pt->y = -200 + 500 * sinf(rad) * 0.9f;
+  pt->z = 300 + 500 * sinf(rad) * 0.3f;
+}
+
+void syntheticRaw(uint16_t step, uint16_t steps, RawPoint* pt) {
+  Point p;
+  syntheticPoint(step, steps, &p);
+  pt->x = (int16_t)p.x;
+  pt->y = (int16_t)p.y;
+  pt->z = (int16_t)p.z;
+}
+
+float syntheticMagnetic(uint16_t step, uint16_t steps) {
+  float theta = step * 360.0f / steps;
+  return fmodf(theta + 5 * sinf(theta * DEG_TO_RAD_F) + 360, 360);
+}
+
+void benchAtan2(const char* name, float (*fn)(float, float)) {
+  uint32_t cycles = 0;
+  uint16_t i;
+  volatile float sink;
+
+  for (i=0; i<RUNS; i++) {
+    Point pt;
+    syntheticPoint(i, RUNS, &pt);
+    uint32_t start = mcuCycles();
+    sink = fn(pt.y, pt.x);
+    cycles += elapsed(start);
+  }
+  (void)sink;
+  report(name, cycles, RUNS);
+}
+
+void benchHeading(Calibration* cal) {
+  HeadingWork* w = &(work.heading);
+  uint32_t cycles = 0;
+  uint16_t i;
+  float heading;
+
+  for (i=0; i<RUNS; i++) {
+    Point pt;
+    syntheticPoint(i, RUNS, &pt);
+    uint32_t start = mcuCycles();
+    getHeading(cal, &pt, &heading);
+    cycles += elapsed(start);
+  }
+  report("getHeading", cycles, RUNS);
+
+  Point gravity = { 0.052f, 0.342f, 0.938f };
+  cycles = 0;
+  for (i=0; i<RUNS; i++) {
+    Point pt;
+    syntheticPoint(i, RUNS, &pt);
+    uint32_t start = mcuCycles();
+    getHeadingTilt(cal, &pt, &gravity, &heading);
+    cycles += elapsed(start);
+  }
+  report("getHeadingTilt", cycles, RUNS);
+
+  const PackedCalibration* view;
+  saveCalibration(cal, &(w->packed), sizeof(w->packed));
+  viewCalibration(&(w->packed), sizeof(w->packed), &view);
+  cycles = 0;
+  for (i=0; i<RUNS; i++) {
+    Point pt;
+    syntheticPoint(i, RUNS, &pt);
+    uint32_t start = mcuCycles();
+    getHeadingPacked(view, &pt, &heading);
+    cycles += elapsed(start);
+  }
+  report("getHeadingPacked", cycles, RUNS);
+
+  cycles = 0;
+  for (i=0; i<RUNS; i++) {
+    Point pt;
+    syntheticPoint(i, RUNS, &pt);
+    uint32_t start = mcuCycles();
+    getCompassHeading(cal, &pt);
+    cycles += elapsed(start);
+  }
+  report("getCompassHeading", cycles, RUNS);
+
+  cycles = 0;
+  for (i=0; i<RUNS; i++) {
+    uint32_t start = mcuCycles();
+    applyDeviation(cal, i * 360.0f / RUNS);
+    cycles += elapsed(start);
+  }
+  report("applyDeviation", cycles, RUNS);
+
+  for (i=0; i<RUNS; i++) {
+    Point pt;
+    syntheticPoint(i, RUNS, &pt);
+    w->xs[i] = pt.x;
+    w->ys[i] = pt.y;
+    w->zs[i] = pt.z;
+  }
+  uint32_t start = mcuCycles();
+  getHeadingBatch(cal, w->xs, w->ys, w->zs, RUNS, w->headings);
+  report("getHeadingBatch", elapsed(start), RUNS);
+
+  sampleRingInit(&(w->ring));
+  cycles = 0;
+  for (i=0; i<RUNS && i<SAMPLE_RING_SIZE; i++) {
+    Point pt;
+    syntheticPoint(i, RUNS, &pt);
+    start = mcuCycles();
+    sampleRingPush(&(w->ring), &pt);
+    cycles += elapsed(start);
+  }
+  report("sampleRingPush", cycles, i);
+  start = mcuCycles();
+  uint16_t n = processPending(cal, &(w->ring), w->headings, RUNS);
+  report("processPending", elapsed(start), n);
+
+  HeadingFilter filter;
+  startHeadingFilter(&filter, 4);
+  cycles = 0;
+  for (i=0; i<RUNS; i++) {
+    Point pt;
+    syntheticPoint(i, RUNS, &pt);
+    start = mcuCycles();
+    filterHeading(&filter, cal, &pt, &heading);
+    cycles += elapsed(start);
+  }
+  report("filterHeading", cycles, RUNS);
+
+  GyroFusion fusion;
+  startGyroFusion(&fusion, 2.0f);
+  cycles = 0;
+  for (i=0; i<RUNS; i++) {
+    start = mcuCycles();
+    fuseHeading(&fusion, i * 22.5f, 10.0f, 0.01f, &heading);
+    cycles += elapsed(start);
+  }
+  report("fuseHeading", cycles, RUNS);
+
+  benchAtan2("atan2/libm", atan2f);
+  benchAtan2("atan2/polynomial", fastAtan2f);
+  benchAtan2("atan2/lut", lutAtan2f);
+}
+
+#ifndef NO_FULL_CONTEXT
+void benchCalibration() {
+  CalibrationContext* ctx = &(work.full);
+  uint32_t cycles = 0;
+  uint16_t i;
+
+  startCalibration(ctx);
+  for (i=0; i<MAX_SENSOR_POINTS - MAX_CALIBRATION_POINTS; i++) {
+    Point pt;
+    syntheticPoint(i, MAX_SENSOR_POINTS - MAX_CALIBRATION_POINTS, &pt);
+    uint32_t start = mcuCycles();
+    addCalibrationPoint(ctx, &pt, NULL);
+    cycles += elapsed(start);
+  }
+  for (i=0; i<MAX_CALIBRATION_POINTS; i++) {
+    Point pt;
+    float magnetic = syntheticMagnetic(i, MAX_CALIBRATION_POINTS);
+    syntheticPoint(i, MAX_CALIBRATION_POINTS, &pt);
+    addCalibrationPoint(ctx, &pt, &magnetic);
+  }
+  report("addCalibrationPoint", cycles, MAX_SENSOR_POINTS - MAX_CALIBRATION_POINTS);
+
+  uint32_t start = mcuCycles();
+  finalizeCalibration(ctx, &calibration, NULL);
+  report("finalizeCalibration", elapsed(start), 1);
+
+  start = mcuCycles();
+  finalizeCalibrationRobust(ctx, &calibration, NULL, NULL);
+  report("finalizeCalibrationRobust", elapsed(start), 1);
+}
+#endif
+
+void benchStream() {
+  StreamCalibrationContext* ctx = &(work.stream);
+  uint32_t cycles = 0;
+  uint16_t i;
+
+  startStreamCalibration(ctx);
+  for (i=0; i<MAX_SENSOR_POINTS; i++) {
+    Point pt;
+    syntheticPoint(i, MAX_SENSOR_POINTS, &pt);
+    uint32_t start = mcuCycles();
+    addStreamCalibrationPoint(ctx, &pt, NULL);
+    cycles += elapsed(start);
+  }
+  for (i=0; i<MAX_CALIBRATION_POINTS; i++) {
+    Point pt;
+    float magnetic = syntheticMagnetic(i, MAX_CALIBRATION_POINTS);
+    syntheticPoint(i, MAX_CALIBRATION_POINTS, &pt);
+    addStreamCalibrationPoint(ctx, &pt, &magnetic);
+  }
+  report("addStreamCalibrationPoint", cycles, MAX_SENSOR_POINTS);
+
+  uint32_t start = mcuCycles();
+  finalizeStreamCalibration(ctx, &calibration, NULL);
+  report("finalizeStreamCalibration", elapsed(start), 1);
+
+  benchHeading(&calibration);
+}
+
+void benchFixed() {
+  FixedCalibrationContext* ctx = &(work.fixed.ctx);
+  FixedCalibration* cal = &(work.fixed.cal);
+  uint32_t cycles = 0;
+  uint16_t i;
+
+  startFixedCalibration(ctx);
+  for (i=0; i<MAX_SENSOR_POINTS; i++) {
+    RawPoint pt;
+    syntheticRaw(i, MAX_SENSOR_POINTS, &pt);
+    uint32_t start = mcuCycles();
+    addFixedCalibrationPoint(ctx, &pt, NULL);
+    cycles += elapsed(start);
+  }
+  for (i=0; i<MAX_CALIBRATION_POINTS; i++) {
+    RawPoint pt;
+    uint16_t magnetic = ANGLE_FROM_DEGREES(syntheticMagnetic(i, MAX_CALIBRATION_POINTS));
+    syntheticRaw(i, MAX_CALIBRATION_POINTS, &pt);
+    addFixedCalibrationPoint(ctx, &pt, &magnetic);
+  }
+  report("addFixedCalibrationPoint", cycles, MAX_SENSOR_POINTS);
+
+  uint32_t start = mcuCycles();
+  finalizeFixedCalibration(ctx, cal, NULL);
+  report("finalizeFixedCalibration", elapsed(start), 1);
+
+  cycles = 0;
+  for (i=0; i<RUNS; i++) {
+    RawPoint pt;
+    uint16_t heading;
+    syntheticRaw(i, RUNS, &pt);
+    start = mcuCycles();
+    getFixedHeading(cal, &pt, &heading);
+    cycles += elapsed(start);
+  }
+  report("getFixedHeading", cycles, RUNS);
+}
+
+/*
+ * Stack high-water mark: the gap between the end of static data and
+ * the stack is painted at startup, and whatever was overwritten by the
+ * end of the run was used.
+ */
+#define STACK_PAINT 0xC5
+
+extern char __stack_paint_start[];
+extern char __stack_paint_end[];
+
+void paintStack() {
+  volatile char* p = __stack_paint_start;
+  volatile char marker;
+  while (p < &marker - 64)
+    *p++ = STACK_PAINT;
+}
+
+uint32_t stackUsed() {
+  char* p = __stack_paint_start;
+  while (p < __stack_paint_end && *p == STACK_PAINT)
+    p++;
+  return __stack_paint_end - p;
+}
+
+int main() {
+  paintStack();
+  mcuInit();
+
+  uint32_t start = mcuCycles();
+  overhead = mcuCycles() - start;
+
+  putString("function,cycles\n");
+  benchStream();
+  benchFixed();
+#ifndef NO_FULL_CONTEXT
+  benchCalibration();
+#endif
+  putString("stack,");
+  putNumber(stackUsed());
+  putString(" bytes\n");
+
+  mcuExit(0);
+  return 0;
+}
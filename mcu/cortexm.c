@@ -0,0 +1,91 @@
+#include "mcu.h"
+
+/*
+ * Cortex-M platform for qemu-system-arm. Output and exit go through
+ * semihosting; SysTick counts down at the core clock and is extended
+ * to 32 bits by its interrupt. QEMU is not cycle-accurate, so run it
+ * with -icount, which makes the count proportional to the number of
+ * instructions executed and identical from run to run.
+ */
+
+#define SYST_CSR  (*(volatile uint32_t*)0xE000E010)
+#define SYST_RVR  (*(volatile uint32_t*)0xE000E014)
+#define SYST_CVR  (*(volatile uint32_t*)0xE000E018)
+
+#define SYST_RELOAD 0x00FFFFFF
+
+#define SYS_WRITEC   0x03
+#define SYS_EXIT     0x18
+#define ADP_Stopped_ApplicationExit 0x20026
+#define ADP_Stopped_RunTimeErrorUnknown 0x20023
+
+extern uint32_t __data_load[], __data_start[], __data_end[];
+extern uint32_t __bss_start[], __bss_end[];
+extern uint32_t __stack_top[];
+
+int main();
+
+static volatile uint32_t wraps = 0;
+
+static int semihost(int op, void* arg) {
+  register int r0 __asm__("r0") = op;
+  register void* r1 __asm__("r1") = arg;
+  __asm__ volatile ("bkpt 0xAB" : "+r"(r0) : "r"(r1) : "memory");
+  return r0;
+}
+
+void resetHandler() {
+  uint32_t* src = __data_load;
+  uint32_t* dst;
+  for (dst = __data_start; dst < __data_end; )
+    *dst++ = *src++;
+  for (dst = __bss_start; dst < __bss_end; )
+    *dst++ = 0;
+  mcuExit(main());
+}
+
+void sysTickHandler() {
+  wraps++;
+}
+
+void defaultHandler() {
+  mcuExit(1);
+}
+
+__attribute__((section(".vectors"), used))
+void (* const vectors[16])() = {
+  (void (*)())__stack_top,
+  resetHandler,
+  defaultHandler,   // NMI
+  defaultHandler,   // HardFault
+  defaultHandler, defaultHandler, defaultHandler, 0, 0, 0, 0,
+  defaultHandler,   // SVCall
+  defaultHandler, 0,
+  defaultHandler,   // PendSV
+  sysTickHandler
+};
+
+void mcuInit() {
+  SYST_RVR = SYST_RELOAD;
+  SYST_CVR = 0;
+  SYST_CSR = 7;  // Core clock, interrupt, enable
+}
+
+uint32_t mcuCycles() {
+  uint32_t high, low;
+  do {
+    high = wraps;
+    low = SYST_CVR;
+  } while (high != wraps);
+  return high * (SYST_RELOAD + 1) + (SYST_RELOAD - low);
+}
+
+void mcuPutc(char c) {
+  semihost(SYS_WRITEC, &c);
+}
+
+void mcuExit(int status) {
+  semihost(SYS_EXIT, (void*)(status == 0 ? ADP_Stopped_ApplicationExit : ADP_Stopped_RunTimeErrorUnknown));
+  for (;;)
+    ;
+}
@@ -0,0 +1,21 @@
+#ifndef __MCU_H__
+#define __MCU_H__
+
+#include <stdint.h>
+
+/*
+ * Platform layer for the benchmark firmware. Each target provides a
+ * free-running cycle counter, a way to print characters and a way to
+ * stop the emulator.
+ */
+
+void mcuInit();
+
+// Cycles elapsed since mcuInit, wrapping at 2^32.
+uint32_t mcuCycles();
+
+void mcuPutc(char c);
+
+void mcuExit(int status);
+
+#endif
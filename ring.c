@@ -0,0 +1,57 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+/*
+ * Lock-free sample ring. The producer fills a slot before publishing
+ * it by advancing head, and the consumer is done with a slot before
+ * releasing it by advancing tail; the barriers keep the compiler and
+ * the CPU from moving the slot accesses past those stores. The
+ * difference head - tail, taken modulo 256, is the number of queued
+ * readings, which is why the size must divide 256.
+ */
+
+#define RING_MASK (SAMPLE_RING_SIZE - 1)
+
+short sampleRingInit(SampleRing* ring) {
+  ring->head = 0;
+  ring->tail = 0;
+  return E_SUCCESS;
+}
+
+short sampleRingPush(SampleRing* ring, const Point* sensorData) {
+  uint8_t head = ring->head;
+  if ((uint8_t)(head - ring->tail) == SAMPLE_RING_SIZE)
+    return E_RING_FULL;
+  MEMORY_BARRIER();
+
+  uint8_t slot = head & RING_MASK;
+  ring->xs[slot] = sensorData->x;
+  ring->ys[slot] = sensorData->y;
+  ring->zs[slot] = sensorData->z;
+  MEMORY_BARRIER();
+  ring->head = (uint8_t)(head + 1);
+  return E_SUCCESS;
+}
+
+short processPending(const Calibration* cal, SampleRing* ring, float* headings, short maxHeadings) {
+  if (maxHeadings <= 0)
+    return 0;
+  uint8_t tail = ring->tail;
+  short count = (uint8_t)(ring->head - tail);
+  if (count > maxHeadings)
+    count = maxHeadings;
+  MEMORY_BARRIER();
+
+  // Queued readings are contiguous but for at most one wrap.
+  uint8_t slot = tail & RING_MASK;
+  short first = SAMPLE_RING_SIZE - slot;
+  if (first > count)
+    first = count;
+  getHeadingBatch(cal, &(ring->xs[slot]), &(ring->ys[slot]), &(ring->zs[slot]), first, headings);
+  if (count > first)
+    getHeadingBatch(cal, ring->xs, ring->ys, ring->zs, count - first, &headings[first]);
+
+  MEMORY_BARRIER();
+  ring->tail = (uint8_t)(tail + count);
+  return count;
+}
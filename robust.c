@@ -0,0 +1,220 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+#include <math.h>
+
+/*
+ * Robust plane fit. Candidate planes through three readings are
+ * scored by the median of squared distances of all readings from
+ * them (least median of squares), which ignores up to half of the
+ * readings being wild. The readings close to the best candidate are
+ * then fitted by least squares, the way finalizeCalibration fits all
+ * of them.
+ *
+ * Candidates are drawn by a fixed generator for a fixed number of
+ * iterations, so the same readings always give the same calibration
+ * in the same time.
+ */
+
+#define ROBUST_SEED 12345UL
+
+// Consistency factor turning the median residual into a standard
+// deviation for normally distributed noise.
+#define MEDIAN_TO_SIGMA 1.4826f
+
+#define INLIER_SIGMAS 2.5f
+
+uint16_t robustRandom(uint32_t* state) {
+  *state = *state * 1664525UL + 1013904223UL;
+  return (uint16_t)(*state >> 16);
+}
+
+// Squared distance of a reading from a plane in cartesian form.
+float planeDistanceSq(const Point* pt, const Point* plane, float planeD, float normSq) {
+  float dist = plane->x * pt->x + plane->y * pt->y + plane->z * pt->z + planeD;
+  return dist * dist / normSq;
+}
+
+/*
+ * Returns the k-th smallest of the values, reordering them in
+ * place.
+ */
+float selectKth(float* values, short n, short k) {
+  short left = 0;
+  short right = n - 1;
+  while (left < right) {
+    float pivot = values[(left + right) / 2];
+    short i = left;
+    short j = right;
+    while (i <= j) {
+      while (values[i] < pivot)
+	i++;
+      while (values[j] > pivot)
+	j--;
+      if (i <= j) {
+	float temp = values[i];
+	values[i] = values[j];
+	values[j] = temp;
+	i++;
+	j--;
+      }
+    }
+    if (k <= j)
+      right = j;
+    else if (k >= i)
+      left = i;
+    else
+      break;
+  }
+  return values[k];
+}
+
+float medianResidual(const CalibrationContext* ctx, const Point* plane, float* residuals) {
+  float normSq = dotProduct(plane, plane);
+  if (!(normSq > 0))
+    return -1;
+  float planeD = sqrtf(fmaxf(0.0f, 1.0f - normSq));
+
+  short i;
+  for (i=0; i<ctx->pointCount; i++)
+    residuals[i] = planeDistanceSq(&(ctx->points[i].sensorData), plane, planeD, normSq);
+  return selectKth(residuals, ctx->pointCount, ctx->pointCount / 2);
+}
+
+/*
+ * Least squares over the readings within maxDistSq of the plane
+ * already in cal. Returns the number of readings left out.
+ */
+short refitInliers(const CalibrationContext* ctx, Calibration* cal, float maxDistSq, MomentAccumulator* acc) {
+  Point plane = { cal->planeA, cal->planeB, cal->planeC };
+  float normSq = dotProduct(&plane, &plane);
+  float planeD = sqrtf(fmaxf(0.0f, 1.0f - normSq));
+
+  momentsReset(acc);
+  short i;
+  for (i=0; i<ctx->pointCount; i++) {
+    const Point* pt = &(ctx->points[i].sensorData);
+    if (planeDistanceSq(pt, &plane, planeD, normSq) <= maxDistSq)
+      momentsAdd(acc, pt);
+  }
+  if (acc->count < 3)
+    return -1;
+
+  CovarianceMatrix covar;
+  momentsCovariance(acc, &covar);
+  if (fitPlane(&(acc->mean), &covar, cal) != E_SUCCESS)
+    return -1;
+  return ctx->pointCount - acc->count;
+}
+
+/*
+ * Fits the origin model of ctx to the readings within maxDistSq of the
+ * plane in cal, and finishes the calibration with it. The inliers are
+ * copied to a context of their own, which the centroid path does
+ * without.
+ */
+static short fitInlierOrigin(const CalibrationContext* ctx, Calibration* cal, float maxDistSq) {
+  CalibrationContext inliers;
+  Point plane = { cal->planeA, cal->planeB, cal->planeC };
+  float normSq = dotProduct(&plane, &plane);
+  float planeD = sqrtf(fmaxf(0.0f, 1.0f - normSq));
+
+  inliers = *ctx;
+  inliers.pointCount = 0;
+  short i;
+  for (i=0; i<ctx->pointCount; i++)
+    if (planeDistanceSq(&(ctx->points[i].sensorData), &plane, planeD, normSq) <= maxDistSq)
+      inliers.points[inliers.pointCount++] = ctx->points[i];
+
+  Point origin;
+  float softIron[9];
+  float verticalField;
+  short rc = fitOrigin(&inliers, cal, &origin, softIron, &verticalField);
+  if (rc != E_SUCCESS)
+    return rc;
+  rc = finishCalibration(cal, &origin, &(ctx->points[0].sensorData), softIron, ctx->finePoints,
+			 ctx->finePointCount, ctx->deviationModel);
+  cal->verticalField = verticalField;
+  return rc;
+}
+
+short finalizeCalibrationRobust(const CalibrationContext* ctx, Calibration* cal, float* quality, short* rejected) {
+  if (ctx->pointCount < 3)
+    return E_NOT_ENOUGH_CALIBRATION_POINTS;
+
+  float residuals[MAX_SENSOR_POINTS];
+
+  // The least squares plane is the first candidate, so clean data
+  // calibrates exactly as finalizeCalibration would.
+  Point centroidPt;
+  CovarianceMatrix covar;
+  centroid(ctx->points, ctx->pointCount, &centroidPt);
+  covariance(ctx->points, ctx->pointCount, &centroidPt, &covar);
+  Point best = { 0, 0, 0 };
+  float bestMedian = -1;
+  if (fitPlane(&centroidPt, &covar, cal) == E_SUCCESS) {
+    best.x = cal->planeA;
+    best.y = cal->planeB;
+    best.z = cal->planeC;
+    bestMedian = medianResidual(ctx, &best, residuals);
+  }
+
+  uint32_t seed = ROBUST_SEED;
+  short iter;
+  for (iter=0; iter<ROBUST_ITERATIONS; iter++) {
+    const Point* p1 = &(ctx->points[robustRandom(&seed) % ctx->pointCount].sensorData);
+    const Point* p2 = &(ctx->points[robustRandom(&seed) % ctx->pointCount].sensorData);
+    const Point* p3 = &(ctx->points[robustRandom(&seed) % ctx->pointCount].sensorData);
+    if (!(rectangleArea(p1, p2, p3) > 0))
+      continue;
+
+    Point candidate;
+    planeFromThreePoints(p1, p2, p3, &candidate);
+    float median = medianResidual(ctx, &candidate, residuals);
+    if (median >= 0 && (bestMedian < 0 || median < bestMedian)) {
+      best = candidate;
+      bestMedian = median;
+    }
+  }
+  if (bestMedian < 0)
+    return E_DEGENERATE_CALIBRATION;
+
+  // Small sample correction after Rousseeuw & Leroy.
+  short n = ctx->pointCount;
+  float sigma = MEDIAN_TO_SIGMA * (n > 3 ? 1.0f + 5.0f / (n - 3) : 1.0f) * sqrtf(bestMedian);
+  float maxDistSq = sq(INLIER_SIGMAS * sigma);
+  if (maxDistSq <= 0)
+    maxDistSq = sq(meanLength(ctx) * 1e-6f);
+
+  cal->planeA = best.x;
+  cal->planeB = best.y;
+  cal->planeC = best.z;
+  MomentAccumulator acc;
+  short outliers = 0;
+  for (iter=0; iter<ROBUST_REFINE_PASSES; iter++) {
+    outliers = refitInliers(ctx, cal, maxDistSq, &acc);
+    if (outliers < 0)
+      return E_DEGENERATE_CALIBRATION;
+  }
+
+  if (rejected)
+    *rejected = outliers;
+
+  short rc;
+  if (ctx->originModel != ORIGIN_CENTROID) {
+    rc = fitInlierOrigin(ctx, cal, maxDistSq);
+  } else {
+    Point origin;
+    if (ctx->finePointCount > 4) // Minimum 4 points to get the centre
+      centroid(ctx->finePoints, ctx->finePointCount, &origin);
+    else
+      origin = acc.mean;
+    rc = finishCalibration(cal, &origin, &(ctx->points[0].sensorData), NULL, ctx->finePoints, ctx->finePointCount,
+			   ctx->deviationModel);
+  }
+
+  // The ellipsoid fit can tilt the plane, so quality comes after it.
+  if (rc == E_SUCCESS && quality)
+    *quality = momentsQuality(&acc, cal);
+  return rc;
+}
@@ -0,0 +1,154 @@
+#include "sensorlog.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Digits of a number that are kept: they fit a uint64_t and their
+ * powers of ten are exact in a double. Further decimals are below
+ * float precision and are skipped; an integer part that long is not
+ * a reading.
+ */
+#define MAX_DIGITS 18
+
+static const double powersOfTen[MAX_DIGITS + 1] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+  1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+
+short openSensorLog(SensorLog* log, const char* fileName) {
+  int fd = open(fileName, O_RDONLY);
+  if (fd < 0)
+    return E_UNREADABLE_LOG;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return E_UNREADABLE_LOG;
+  }
+
+  // An empty file cannot be mapped, but is a valid, empty log.
+  const char* data = NULL;
+  if (st.st_size > 0) {
+    void* mapped = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      close(fd);
+      return E_UNREADABLE_LOG;
+    }
+    madvise(mapped, (size_t)st.st_size, MADV_SEQUENTIAL);
+    data = (const char*)mapped;
+  }
+  close(fd);
+
+  openSensorLogBuffer(log, data, (size_t)st.st_size);
+  log->mappedSize = (size_t)st.st_size;
+  return E_SUCCESS;
+}
+
+void openSensorLogBuffer(SensorLog* log, const char* data, size_t size) {
+  log->data = data;
+  log->next = data;
+  log->end = data + size;
+  log->mappedSize = 0;
+  log->readingCount = 0;
+  log->skippedCount = 0;
+}
+
+void closeSensorLog(SensorLog* log) {
+  if (log->mappedSize > 0)
+    munmap((void*)log->data, log->mappedSize);
+  log->data = log->next = log->end = NULL;
+  log->mappedSize = 0;
+}
+
+static const char* skipBlanks(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  return p;
+}
+
+/*
+ * Scans [-+]digits[.digits] into value, or returns NULL if there are
+ * no digits. The digits are read as one integer and then divided by
+ * the power of ten of the fraction, which rounds the same as strtof
+ * bar double rounding.
+ */
+static const char* scanNumber(const char* p, const char* end, float* value) {
+  p = skipBlanks(p, end);
+  int negative = 0;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+
+  const char* start = p;
+  uint64_t mantissa = 0;
+  unsigned digit;
+  while (p < end && (digit = (unsigned)(*p - '0')) < 10) {
+    if (p - start == MAX_DIGITS)
+      return NULL; // Too large for a reading
+    mantissa = mantissa * 10 + digit;
+    p++;
+  }
+
+  int places = 0;
+  if (p < end && *p == '.') {
+    int kept = (int)(p++ - start);
+    while (p < end && (digit = (unsigned)(*p - '0')) < 10) {
+      if (kept < MAX_DIGITS) {
+	mantissa = mantissa * 10 + digit;
+	places++;
+	kept++;
+      }
+      p++;
+    }
+    if (p - start == 1)
+      return NULL; // Just a point
+  } else if (p == start) {
+    return NULL;
+  }
+
+  float result = places ? (float)((double)mantissa / powersOfTen[places]) : (float)mantissa;
+  *value = negative ? -result : result;
+  return p;
+}
+
+/*
+ * Parses x,y,z at the start of a line, returning the start of the next
+ * line, or NULL if the line is not a reading.
+ */
+static const char* scanReading(const char* p, const char* end, Point* pt) {
+  if (!(p = scanNumber(p, end, &(pt->x))) || (p = skipBlanks(p, end)) == end || *p++ != ',')
+    return NULL;
+  if (!(p = scanNumber(p, end, &(pt->y))) || (p = skipBlanks(p, end)) == end || *p++ != ',')
+    return NULL;
+  if (!(p = scanNumber(p, end, &(pt->z))))
+    return NULL;
+  p = skipBlanks(p, end);
+  if (p < end && *p == '\r')
+    p++;
+  if (p == end)
+    return p;
+  return *p == '\n' ? p + 1 : NULL;
+}
+
+int readSensorLog(SensorLog* log, Point* points, int maxPoints) {
+  const char* p = log->next;
+  const char* end = log->end;
+  int n = 0;
+
+  while (n < maxPoints && p < end) {
+    const char* next = scanReading(p, end, &points[n]);
+    if (next) {
+      n++;
+    } else {
+      next = memchr(p, '\n', (size_t)(end - p));
+      next = next ? next + 1 : end;
+      log->skippedCount++;
+    }
+    p = next;
+  }
+  log->next = p;
+  log->readingCount += n;
+  return n;
+}
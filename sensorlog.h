@@ -0,0 +1,62 @@
+#ifndef __SENSORLOG_H__
+#define __SENSORLOG_H__
+
+#include <stddef.h>
+#include "compaxx.h"
+
+/*
+ * Host-side reading of sensor logs: text with one x,y,z reading per
+ * line, as plain decimal numbers. Files are mapped into memory and
+ * parsed in place, in batches of Points, with no allocation per line.
+ * Lines that are not readings, such as a header, are skipped.
+ */
+
+typedef struct {
+  const char* data;
+  const char* next;
+  const char* end;
+  size_t mappedSize;
+  /*
+   * Readings returned so far, and lines skipped as not readings.
+   */
+  long readingCount;
+  long skippedCount;
+} SensorLog;
+
+/**
+ * Maps a log file for reading.
+ *
+ * @param log SensorLog structure; there is no need to initialize it.
+ * @param fileName Log to read.
+ * @return E_SUCCESS, or E_UNREADABLE_LOG if it cannot be opened.
+ */
+short openSensorLog(SensorLog* log, const char* fileName);
+
+/**
+ * Reads a log already in memory, which must outlive the SensorLog.
+ *
+ * @param log SensorLog structure; there is no need to initialize it.
+ * @param data Log text, not necessarily terminated.
+ * @param size Number of bytes in data.
+ */
+void openSensorLogBuffer(SensorLog* log, const char* data, size_t size);
+
+/**
+ * Parses the next readings.
+ *
+ * @param log Open log.
+ * @param points Where to store them.
+ * @param maxPoints Most readings to return.
+ * @return Number of readings stored, less than maxPoints only at the
+ * end of the log.
+ */
+int readSensorLog(SensorLog* log, Point* points, int maxPoints);
+
+/**
+ * Unmaps a log opened with openSensorLog. Does nothing for a buffer.
+ *
+ * @param log Open log.
+ */
+void closeSensorLog(SensorLog* log);
+
+#endif
@@ -0,0 +1,206 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+#include <string.h>
+
+/*
+ * Packing for storage. Everything is kept in the order and the float
+ * format of the target; CALIBRATION_MAGIC tells when that differs.
+ */
+
+#define HARMONIC_SCALE 128.0f
+#define BINARY_PER_DEGREE (65536.0f / 360.0f)
+
+/* The layout is fixed: a change here needs a new CALIBRATION_VERSION. */
+typedef char packedCalibrationSize[sizeof(PackedCalibration) == 212 ? 1 : -1];
+
+/*
+ * Soft iron is symmetric, so only its upper triangle is stored, by
+ * rows: xx xy xz yy yz zz. Lower gives the same entries by columns.
+ */
+static const uint8_t softIronUpper[6] = { 0, 1, 2, 4, 5, 8 };
+static const uint8_t softIronLower[6] = { 0, 3, 6, 4, 7, 8 };
+
+/*
+ * CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF), bit by bit,
+ * as a table would take more flash than the whole calibration.
+ */
+static uint16_t crc16(const uint8_t* data, int length) {
+  uint16_t crc = 0xFFFF;
+  int i, bit;
+  for (i=0; i<length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (bit=0; bit<8; bit++)
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
+
+static uint16_t packedCrc(const PackedCalibration* packed) {
+  const uint8_t* start = (const uint8_t*)&(packed->version);
+  return crc16(start, (int)((const uint8_t*)(packed + 1) - start));
+}
+
+/*
+ * Rounds value times scale to int16, returning 0 if it does not fit.
+ */
+static short quantize(float value, float scale, int16_t* q) {
+  float scaled = floorf(value * scale + 0.5f);
+  if (!(scaled >= -32768.0f && scaled <= 32767.0f))
+    return 0;
+  *q = (int16_t)scaled;
+  return 1;
+}
+
+static short quantizePoint(const Point* p, float scale, int16_t* q) {
+  return quantize(p->x, scale, &q[0]) && quantize(p->y, scale, &q[1]) && quantize(p->z, scale, &q[2]);
+}
+
+static void dequantizePoint(const int16_t* q, float scale, Point* p) {
+  p->x = q[0] * scale;
+  p->y = q[1] * scale;
+  p->z = q[2] * scale;
+}
+
+static uint16_t degreesToBinary(float degrees) {
+  return (uint16_t)(uint32_t)floorf(degrees * BINARY_PER_DEGREE + 0.5f);
+}
+
+static float largestMagnitude(const Point* p, float largest) {
+  if (fabsf(p->x) > largest)
+    largest = fabsf(p->x);
+  if (fabsf(p->y) > largest)
+    largest = fabsf(p->y);
+  if (fabsf(p->z) > largest)
+    largest = fabsf(p->z);
+  return largest;
+}
+
+short saveCalibration(const Calibration* cal, void* buffer, short size) {
+  PackedCalibration* packed = (PackedCalibration*)buffer;
+  const HeadingTransform* t = &(cal->transform);
+  int i;
+
+  if (size < (short)sizeof(PackedCalibration))
+    return E_BUFFER_TOO_SMALL;
+  memset(packed, 0, sizeof(PackedCalibration));
+  packed->magic = CALIBRATION_MAGIC;
+  packed->version = CALIBRATION_VERSION;
+  packed->pointCount = (uint8_t)cal->pointCount;
+  packed->deviationModel = (uint8_t)cal->deviationModel;
+
+  float largest = largestMagnitude(&(cal->origin), fabsf(cal->verticalField));
+  largest = largestMagnitude(&(cal->compassNorth), largest);
+  packed->positionScale = largest > 0.0f ? largest / 32767.0f : 1.0f;
+  float toPosition = 1.0f / packed->positionScale;
+
+  // Folded soft iron stretches the axes by up to its largest factor.
+  if (!quantizePoint(&(t->axisU), Q14_ONE, packed->axisU) ||
+      !quantizePoint(&(t->axisV), Q14_ONE, packed->axisV) ||
+      !quantizePoint(&(t->normal), Q14_ONE, packed->normal) ||
+      !quantizePoint(&(cal->origin), toPosition, packed->origin) ||
+      !quantizePoint(&(cal->compassNorth), toPosition, packed->compassNorth) ||
+      !quantize(cal->verticalField, toPosition, &(packed->verticalField)))
+    return E_DEGENERATE_CALIBRATION;
+
+  for (i=0; i<6; i++)
+    if (!quantize(cal->softIron[softIronUpper[i]], Q14_ONE, &(packed->softIron[i])))
+      return E_DEGENERATE_CALIBRATION;
+
+  if (cal->deviationModel == DEVIATION_MODEL_HARMONIC)
+    for (i=0; i<HARMONIC_COEFFICIENTS; i++)
+      if (!quantize(cal->harmonics[i], HARMONIC_SCALE, &(packed->harmonics[i])))
+	return E_DEGENERATE_CALIBRATION;
+
+  // Rounding can take a heading just short of 360 to 0, so re-sort.
+  for (i=0; i<cal->pointCount; i++) {
+    uint16_t compass = degreesToBinary(cal->calibrationData[i].compassHeading);
+    int j = i;
+    while (j > 0 && packed->compassHeading[j - 1] > compass) {
+      packed->compassHeading[j] = packed->compassHeading[j - 1];
+      packed->magneticHeading[j] = packed->magneticHeading[j - 1];
+      j--;
+    }
+    packed->compassHeading[j] = compass;
+    packed->magneticHeading[j] = degreesToBinary(cal->calibrationData[i].magneticHeading);
+  }
+
+  packed->crc = packedCrc(packed);
+  return E_SUCCESS;
+}
+
+short viewCalibration(const void* buffer, short size, const PackedCalibration** view) {
+  const PackedCalibration* packed = (const PackedCalibration*)buffer;
+  if (size < (short)sizeof(PackedCalibration) ||
+      packed->magic != CALIBRATION_MAGIC ||
+      packed->version != CALIBRATION_VERSION ||
+      packed->pointCount > MAX_CALIBRATION_POINTS ||
+      packed->crc != packedCrc(packed))
+    return E_CORRUPT_CALIBRATION;
+  *view = packed;
+  return E_SUCCESS;
+}
+
+short loadCalibration(const void* buffer, short size, Calibration* cal) {
+  const PackedCalibration* packed;
+  Point normal, cartesian;
+  int i;
+
+  if (viewCalibration(buffer, size, &packed) != E_SUCCESS)
+    return E_CORRUPT_CALIBRATION;
+
+  dequantizePoint(packed->origin, packed->positionScale, &(cal->origin));
+  dequantizePoint(packed->compassNorth, packed->positionScale, &(cal->compassNorth));
+  cal->verticalField = packed->verticalField * packed->positionScale;
+  dequantizePoint(packed->normal, 1.0f / Q14_ONE, &normal);
+  normalize(&normal);
+  normalToCartesian(&normal, &(cal->origin), &cartesian);
+  cal->planeA = cartesian.x;
+  cal->planeB = cartesian.y;
+  cal->planeC = cartesian.z;
+
+  for (i=0; i<6; i++)
+    cal->softIron[softIronUpper[i]] = cal->softIron[softIronLower[i]] = packed->softIron[i] * (1.0f / Q14_ONE);
+  compileTransform(cal);
+
+  cal->pointCount = packed->pointCount;
+  for (i=0; i<cal->pointCount; i++) {
+    cal->calibrationData[i].compassHeading = packed->compassHeading[i] / BINARY_PER_DEGREE;
+    cal->calibrationData[i].magneticHeading = packed->magneticHeading[i] / BINARY_PER_DEGREE;
+  }
+  sortTable(cal->calibrationData, cal->pointCount);
+
+  cal->deviationModel = packed->deviationModel;
+  if (cal->deviationModel == DEVIATION_MODEL_HARMONIC)
+    for (i=0; i<HARMONIC_COEFFICIENTS; i++)
+      cal->harmonics[i] = packed->harmonics[i] * (1.0f / HARMONIC_SCALE);
+  else
+    buildDeviationTable(cal);
+  return E_SUCCESS;
+}
+
+short getHeadingPacked(const PackedCalibration* view, const Point* sensorData, float* heading) {
+  float scale = view->positionScale;
+  float dx = sensorData->x - view->origin[0] * scale;
+  float dy = sensorData->y - view->origin[1] * scale;
+  float dz = sensorData->z - view->origin[2] * scale;
+
+  // Both axes carry the same Q14 scale, which the angle ignores.
+  float u = view->axisU[0] * dx + view->axisU[1] * dy + view->axisU[2] * dz;
+  float v = view->axisV[0] * dx + view->axisV[1] * dy + view->axisV[2] * dz;
+  float compassHeading = radsToHeading(headingAtan2f(v, u));
+
+  if (view->deviationModel == DEVIATION_MODEL_HARMONIC) {
+    float harmonics[HARMONIC_COEFFICIENTS];
+    int i;
+    for (i=0; i<HARMONIC_COEFFICIENTS; i++)
+      harmonics[i] = view->harmonics[i] * (1.0f / HARMONIC_SCALE);
+    *heading = applyHarmonics(harmonics, compassHeading);
+    return E_SUCCESS;
+  }
+
+  uint16_t magnetic = binaryDeviation(view->compassHeading, view->magneticHeading, view->pointCount,
+				      degreesToBinary(compassHeading));
+  *heading = magnetic / BINARY_PER_DEGREE;
+  return E_SUCCESS;
+}
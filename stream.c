@@ -0,0 +1,170 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+#include <math.h>
+
+void momentsReset(MomentAccumulator* acc) {
+  acc->count = 0;
+  acc->mean.x = acc->mean.y = acc->mean.z = 0.0f;
+  acc->mxx = acc->mxy = acc->mxz = acc->myy = acc->myz = acc->mzz = 0.0f;
+  acc->sumLength = 0.0f;
+  acc->meanComp = acc->mean;
+  acc->mxxComp = acc->mxyComp = acc->mxzComp = acc->myyComp = acc->myzComp = acc->mzzComp = 0.0f;
+  acc->sumLengthComp = 0.0f;
+}
+
+/*
+ * Kahan summation: adds value to sum, with comp holding what rounding
+ * has dropped so far, taken back out of the next value.
+ */
+void compensatedAdd(float* sum, float* comp, float value) {
+  float corrected = value - *comp;
+  float next = *sum + corrected;
+  *comp = (next - *sum) - corrected;
+  *sum = next;
+}
+
+void momentsAdd(MomentAccumulator* acc, const Point* pt) {
+  acc->count++;
+
+  // Deviation from the mean before and after the update; their
+  // products accumulate the co-moments without cancellation.
+  Point before;
+  pointVec(&(acc->mean), pt, &before);
+  compensatedAdd(&(acc->mean.x), &(acc->meanComp.x), before.x / (float)acc->count);
+  compensatedAdd(&(acc->mean.y), &(acc->meanComp.y), before.y / (float)acc->count);
+  compensatedAdd(&(acc->mean.z), &(acc->meanComp.z), before.z / (float)acc->count);
+  Point after;
+  pointVec(&(acc->mean), pt, &after);
+
+  compensatedAdd(&(acc->mxx), &(acc->mxxComp), before.x * after.x);
+  compensatedAdd(&(acc->mxy), &(acc->mxyComp), before.x * after.y);
+  compensatedAdd(&(acc->mxz), &(acc->mxzComp), before.x * after.z);
+  compensatedAdd(&(acc->myy), &(acc->myyComp), before.y * after.y);
+  compensatedAdd(&(acc->myz), &(acc->myzComp), before.y * after.z);
+  compensatedAdd(&(acc->mzz), &(acc->mzzComp), before.z * after.z);
+  compensatedAdd(&(acc->sumLength), &(acc->sumLengthComp), vecLength(pt));
+}
+
+/*
+ * Chan's pairwise update: with d the difference of the two means,
+ * the merged co-moments are the sum of both plus d d' na nb / n. The
+ * sums of other go in with their own compensation taken off, and the
+ * result is compensated as momentsAdd compensates a single reading.
+ */
+void momentsMerge(MomentAccumulator* acc, const MomentAccumulator* other) {
+  if (other->count == 0)
+    return;
+  if (acc->count == 0) {
+    *acc = *other;
+    return;
+  }
+
+  long count = acc->count + other->count;
+  float share = (float)other->count / (float)count;
+  float weight = (float)acc->count * share;
+  Point d;
+  pointVec(&(acc->mean), &(other->mean), &d);
+  d.x += acc->meanComp.x - other->meanComp.x;
+  d.y += acc->meanComp.y - other->meanComp.y;
+  d.z += acc->meanComp.z - other->meanComp.z;
+  compensatedAdd(&(acc->mean.x), &(acc->meanComp.x), d.x * share);
+  compensatedAdd(&(acc->mean.y), &(acc->meanComp.y), d.y * share);
+  compensatedAdd(&(acc->mean.z), &(acc->meanComp.z), d.z * share);
+
+  compensatedAdd(&(acc->mxx), &(acc->mxxComp), (other->mxx - other->mxxComp) + d.x * d.x * weight);
+  compensatedAdd(&(acc->mxy), &(acc->mxyComp), (other->mxy - other->mxyComp) + d.x * d.y * weight);
+  compensatedAdd(&(acc->mxz), &(acc->mxzComp), (other->mxz - other->mxzComp) + d.x * d.z * weight);
+  compensatedAdd(&(acc->myy), &(acc->myyComp), (other->myy - other->myyComp) + d.y * d.y * weight);
+  compensatedAdd(&(acc->myz), &(acc->myzComp), (other->myz - other->myzComp) + d.y * d.z * weight);
+  compensatedAdd(&(acc->mzz), &(acc->mzzComp), (other->mzz - other->mzzComp) + d.z * d.z * weight);
+  compensatedAdd(&(acc->sumLength), &(acc->sumLengthComp), other->sumLength - other->sumLengthComp);
+  acc->count = count;
+}
+
+void momentsCovariance(const MomentAccumulator* acc, CovarianceMatrix* result) {
+  result->xx = acc->mxx / (float)acc->count;
+  result->xy = acc->mxy / (float)acc->count;
+  result->xz = acc->mxz / (float)acc->count;
+  result->yy = acc->myy / (float)acc->count;
+  result->yz = acc->myz / (float)acc->count;
+  result->zz = acc->mzz / (float)acc->count;
+}
+
+/*
+ * Same metric as finalizeCalibration computes from the points. The
+ * plane passes through the mean, so the mean squared distance of the
+ * points from it is the variance along the unit normal.
+ */
+float momentsQuality(const MomentAccumulator* acc, const Calibration* cal) {
+  CovarianceMatrix covar;
+  momentsCovariance(acc, &covar);
+
+  Point n = { cal->planeA, cal->planeB, cal->planeC };
+  normalize(&n);
+  float mse =
+    n.x * n.x * covar.xx + n.y * n.y * covar.yy + n.z * n.z * covar.zz +
+    2 * (n.x * n.y * covar.xy + n.x * n.z * covar.xz + n.y * n.z * covar.yz);
+  if (mse < 0)
+    mse = 0;
+
+  return 100.0f - sqrtf(mse) / (acc->sumLength / (float)acc->count) * 100;
+}
+
+short startStreamCalibration(StreamCalibrationContext* ctx) {
+  momentsReset(&(ctx->moments));
+  ctx->finePointCount = 0;
+  ctx->deviationModel = DEVIATION_MODEL_TABLE;
+  return E_SUCCESS;
+}
+
+short addStreamCalibrationPoint(StreamCalibrationContext* ctx, const Point* sensorData, const float* magneticHeading) {
+  if (magneticHeading && ctx->finePointCount == MAX_CALIBRATION_POINTS)
+    return E_TOO_MANY_FINE_POINTS;
+
+  if (ctx->moments.count == 0)
+    ctx->firstPoint = *sensorData;
+  momentsAdd(&(ctx->moments), sensorData);
+  if (magneticHeading != NULL) {
+    ctx->finePoints[ctx->finePointCount].sensorData = *sensorData;
+    ctx->finePoints[ctx->finePointCount].magneticHeading = *magneticHeading;
+    ctx->finePointCount++;
+  }
+  return E_SUCCESS;
+}
+
+short mergeStreamCalibration(StreamCalibrationContext* ctx, const StreamCalibrationContext* other) {
+  if (ctx->finePointCount + other->finePointCount > MAX_CALIBRATION_POINTS)
+    return E_TOO_MANY_FINE_POINTS;
+
+  if (ctx->moments.count == 0)
+    ctx->firstPoint = other->firstPoint;
+  momentsMerge(&(ctx->moments), &(other->moments));
+  int i;
+  for (i=0; i<other->finePointCount; i++)
+    ctx->finePoints[ctx->finePointCount++] = other->finePoints[i];
+  return E_SUCCESS;
+}
+
+short finalizeStreamCalibration(const StreamCalibrationContext* ctx, Calibration* cal, float* quality) {
+  if (ctx->moments.count < 3)
+    return E_NOT_ENOUGH_CALIBRATION_POINTS;
+
+  CovarianceMatrix covar;
+  momentsCovariance(&(ctx->moments), &covar);
+  short rc = fitPlane(&(ctx->moments.mean), &covar, cal);
+  if (rc != E_SUCCESS)
+    return rc;
+
+  if (quality)
+    *quality = momentsQuality(&(ctx->moments), cal);
+
+  Point origin;
+  if (ctx->finePointCount > 4) // Minimum 4 points to get the centre
+    centroid(ctx->finePoints, ctx->finePointCount, &origin);
+  else
+    origin = ctx->moments.mean;
+
+  return finishCalibration(cal, &origin, &(ctx->firstPoint), NULL, ctx->finePoints, ctx->finePointCount,
+			   ctx->deviationModel);
+}
@@ -3,6 +3,8 @@
 #include <assert.h>
 #include "compaxx.h"
 #include "compaxx_int.h"
+#include "fleet.h"
+#include "sensorlog.h"
 
 #include <math.h>
 #include <stdlib.h>
@@ -11,46 +13,55 @@
 
 #define ASSERT_EQ(a, b, err) assert(fabs(a - b) < err)
 
+#define PI 3.14159265
+
+// Heading error in degrees that the HEADING_ATAN2 tier adds on its own.
+#if HEADING_ATAN2 == ATAN2_LUT
+#define ATAN2_TOLERANCE 0.08
+#else
+#define ATAN2_TOLERANCE 0.0
+#endif
+
+// getHeadingBatch always uses ATAN2_POLYNOMIAL, so it may differ from
+// getHeading by that tier's 0.0007 degrees, plus float rounding of
+// headings near 360, as well as by the selected tier's error.
+#define BATCH_TOLERANCE (0.001 + ATAN2_TOLERANCE)
+
 #define RUNTEST(name) \
   if (rc == E_SUCCESS) { \
     printf("------ " #name " ------\n"); \
     rc = name(); \
   }
 
-void getfields(const char* line, Point* pt)
-{
-  const char* tok;
-  tok = strtok((char*)line, ",");
-  pt->x = atof(tok);
-  tok = strtok(NULL, ",");
-  pt->y = atof(tok);
-  tok = strtok(NULL, ",\n");
-  pt->z = atof(tok);
+void printPt(const Point* pt, const char* msg) {
+  printf("%s: (%f, %f, %f)\n", msg, pt->x, pt->y, pt->z);
 }
 
-float calibrateFromCsv(const char* fileName, Calibration* cal) {
-  FILE* stream = fopen(fileName, "r");
+#define MAX_CSV_POINTS 1024
 
-  if (stream == NULL) {
+// Reads up to maxPoints readings of a log.
+int readLog(const char* fileName, Point* points, int maxPoints) {
+  SensorLog log;
+  if (openSensorLog(&log, fileName) != E_SUCCESS) {
     printf("Cannot open: %s\n", fileName);
-    return 0.0;
+    return 0;
   }
+  int n = readSensorLog(&log, points, maxPoints);
+  closeSensorLog(&log);
+  return n;
+}
+
+float calibrateFromCsv(const char* fileName, Calibration* cal) {
+  Point points[MAX_SENSOR_POINTS];
+  int n = readLog(fileName, points, MAX_SENSOR_POINTS);
+  if (n == 0)
+    return 0.0;
 
   CalibrationContext ctx;
   startCalibration(&ctx);
-
-  int pointCount = 0;
-  char line[1024];
-  while (fgets(line, 1024, stream) && pointCount < MAX_SENSOR_POINTS) {
-    Point p;
-    char* tmp = strdup(line);
-    getfields(tmp, &p);
-    addCalibrationPoint(&ctx, &p, NULL);
-    pointCount++;
-    // NOTE strtok clobbers tmp
-    free(tmp);
-  }
-  fclose(stream);
+  int i;
+  for (i=0; i<n; i++)
+    addCalibrationPoint(&ctx, &points[i], NULL);
   float quality;
   finalizeCalibration(&ctx, cal, &quality);
   return quality;
@@ -219,24 +230,70 @@ int testPlaneFromThreePoints() {
 }
 
 void testPoints(const Calibration* cal, const char* fileName) {
-  FILE* stream = fopen(fileName, "r");
-
-  if (stream == NULL) {
-    printf("Cannot open: %s\n", fileName);
-    return;
-  }
-  char line[1024];
-  while (fgets(line, 1024, stream)) {
-    Point p;
-    char* tmp = strdup(line);
-    getfields(tmp, &p);
-    float heading = getCompassHeading(cal, &p);
+  Point points[MAX_CSV_POINTS];
+  int n = readLog(fileName, points, MAX_CSV_POINTS), i;
+  for (i=0; i<n; i++) {
+    float heading = getCompassHeading(cal, &points[i]);
     assert(heading >= 0 && heading <= 360);
     //printf("%f\n", heading);
-    // NOTE strtok clobbers tmp
-    free(tmp);
   }
-  fclose(stream);
+}
+
+/*
+ * The in-place parser should read what sscanf does, in batches of any
+ * size, skip what is not a reading and cope with a missing final
+ * newline and CRLF line ends.
+ */
+int testSensorLog() {
+  const char text[] =
+    "x,y,z\n"
+    "182,1391,-841\r\n"
+    " -1.5 , +2.25,3.\n"
+    "\n"
+    "1,2\n"
+    "1,2,3,4\n"
+    ".,1,2\n"
+    "123456789012345678901,1,2\n"
+    "0.000123456789,-0,0.00000000000000000000000000000001";
+  const Point expected[] = { { 182, 1391, -841 }, { -1.5, 2.25, 3 }, { 0.000123456789f, 0, 0 } };
+  Point points[MAX_CSV_POINTS];
+  SensorLog log;
+  int i, j;
+
+  openSensorLogBuffer(&log, text, sizeof(text) - 1);
+  assert(readSensorLog(&log, points, 10) == 3);
+  assert(readSensorLog(&log, points + 3, 10) == 0);
+  for (i=0; i<3; i++)
+    assert(points[i].x == expected[i].x && points[i].y == expected[i].y && points[i].z == expected[i].z);
+  assert(log.readingCount == 3);
+  assert(log.skippedCount == 6);
+  closeSensorLog(&log);
+
+  assert(openSensorLog(&log, "./data/missing.csv") == E_UNREADABLE_LOG);
+
+  const char* files[] = { "./data/rot45.csv", "./data/flat1.csv", "./data/flat2.csv" };
+  for (i=0; i<3; i++) {
+    int batch = i * 5 + 1, n = 0, k;
+    assert(openSensorLog(&log, files[i]) == E_SUCCESS);
+    while ((k = readSensorLog(&log, points + n, batch)) > 0)
+      n += k;
+    assert(log.readingCount == n);
+    closeSensorLog(&log);
+
+    FILE* stream = fopen(files[i], "r");
+    char line[1024];
+    j = 0;
+    while (fgets(line, sizeof(line), stream)) {
+      Point p;
+      assert(sscanf(line, "%f,%f,%f", &p.x, &p.y, &p.z) == 3);
+      assert(p.x == points[j].x && p.y == points[j].y && p.z == points[j].z);
+      j++;
+    }
+    fclose(stream);
+    assert(j == n);
+    printf("%s: %d readings in batches of %d\n", files[i], n, batch);
+  }
+  return E_SUCCESS;
 }
 
 int testVectorData() {
@@ -258,6 +315,1367 @@ int testVectorData() {
     testPoints(&cal, files[i]);
     i++;
   }
+  return E_SUCCESS;
+}
+
+float headingDiff(float a, float b) {
+  float diff = fabs(a - b);
+  return diff > 180 ? 360 - diff : diff;
+}
+
+int loadCsv(const char* fileName, float* xs, float* ys, float* zs, int maxPoints) {
+  Point points[MAX_CSV_POINTS];
+  int n = readLog(fileName, points, maxPoints < MAX_CSV_POINTS ? maxPoints : MAX_CSV_POINTS), i;
+  for (i=0; i<n; i++) {
+    xs[i] = points[i].x;
+    ys[i] = points[i].y;
+    zs[i] = points[i].z;
+  }
+  return n;
+}
+
+/*
+ * Calibrates from the readings, turning every 10th one into a fine
+ * point with a synthetic deviation of 5 degrees * sin(heading).
+ */
+void calibrateWithDeviation(const float* xs, const float* ys, const float* zs, int n, Calibration* cal) {
+  CalibrationContext ctx;
+  Calibration coarse;
+  int i;
+
+  startCalibration(&ctx);
+  for (i=0; i<n && i<MAX_SENSOR_POINTS; i++) {
+    Point p = { xs[i], ys[i], zs[i] };
+    addCalibrationPoint(&ctx, &p, NULL);
+  }
+  finalizeCalibration(&ctx, &coarse, NULL);
+
+  startCalibration(&ctx);
+  for (i=0; i<n && i<MAX_SENSOR_POINTS; i++) {
+    Point p = { xs[i], ys[i], zs[i] };
+    if (i % 10 == 0 && ctx.finePointCount < MAX_CALIBRATION_POINTS) {
+      float compass = getCompassHeading(&coarse, &p);
+      float magnetic = fmod(compass + 5 * sin(compass * PI / 180) + 360, 360);
+      addCalibrationPoint(&ctx, &p, &magnetic);
+    } else {
+      addCalibrationPoint(&ctx, &p, NULL);
+    }
+  }
+  finalizeCalibration(&ctx, cal, NULL);
+}
+
+int testCompiledTransform() {
+  const char* files[] = {
+    "./data/rot45.csv",
+    "./data/flat1.csv",
+    "./data/flat2.csv",
+    NULL
+  };
+
+  int i = 0;
+  while (files[i] != NULL) {
+    Calibration cal;
+    calibrateFromCsv(files[i], &cal);
+
+    Point points[MAX_CSV_POINTS];
+    int n = readLog(files[i], points, MAX_CSV_POINTS), j;
+    assert(n > 0);
+    float maxErr = 0.0;
+    for (j=0; j<n; j++) {
+      float err = headingDiff(getCompassHeading(&cal, &points[j]), getCompassHeadingProjected(&cal, &points[j]));
+      maxErr = fmax(maxErr, err);
+    }
+    printf("%s: max difference %f\n", files[i], maxErr);
+    ASSERT_EQ(maxErr, 0, 0.01 + ATAN2_TOLERANCE);
+    i++;
+  }
+  return E_SUCCESS;
+}
+
+int testHeadingBatch() {
+  const char* files[] = {
+    "./data/rot45.csv",
+    "./data/flat1.csv",
+    "./data/flat2.csv",
+    NULL
+  };
+  float xs[MAX_CSV_POINTS], ys[MAX_CSV_POINTS], zs[MAX_CSV_POINTS];
+  float headings[MAX_CSV_POINTS];
+
+  int i = 0;
+  while (files[i] != NULL) {
+    int n = loadCsv(files[i], xs, ys, zs, MAX_CSV_POINTS);
+    Calibration cal;
+    calibrateWithDeviation(xs, ys, zs, n, &cal);
+
+    short rc = getHeadingBatch(&cal, xs, ys, zs, n, headings);
+    assert(rc == E_SUCCESS);
+
+    float maxErr = 0.0;
+    int j;
+    for (j=0; j<n; j++) {
+      Point p = { xs[j], ys[j], zs[j] };
+      float heading;
+      getHeading(&cal, &p, &heading);
+      maxErr = fmax(maxErr, headingDiff(heading, headings[j]));
+    }
+    printf("%s: %i readings, max difference %f\n", files[i], n, maxErr);
+    ASSERT_EQ(maxErr, 0, BATCH_TOLERANCE);
+    i++;
+  }
+  return E_SUCCESS;
+}
+
+int testStreamCalibration() {
+  const char* files[] = {
+    "./data/rot45.csv",
+    "./data/flat1.csv",
+    "./data/flat2.csv",
+    NULL
+  };
+  float xs[MAX_CSV_POINTS], ys[MAX_CSV_POINTS], zs[MAX_CSV_POINTS];
+
+  printf("Context size: %i bytes, streaming: %i bytes\n",
+	 (int)sizeof(CalibrationContext), (int)sizeof(StreamCalibrationContext));
+
+  int i = 0;
+  while (files[i] != NULL) {
+    int n = loadCsv(files[i], xs, ys, zs, MAX_SENSOR_POINTS);
+
+    CalibrationContext ctx;
+    StreamCalibrationContext stream;
+    startCalibration(&ctx);
+    startStreamCalibration(&stream);
+    int j;
+    for (j=0; j<n; j++) {
+      Point p = { xs[j], ys[j], zs[j] };
+      float magnetic = j * 360.0 / n;
+      const float* fine = (j % 20 == 0) ? &magnetic : NULL;
+      addCalibrationPoint(&ctx, &p, fine);
+      short rc = addStreamCalibrationPoint(&stream, &p, fine);
+      assert(rc == E_SUCCESS);
+    }
+
+    Calibration cal, streamCal;
+    float quality, streamQuality;
+    finalizeCalibration(&ctx, &cal, &quality);
+    short rc = finalizeStreamCalibration(&stream, &streamCal, &streamQuality);
+    assert(rc == E_SUCCESS);
+
+    float maxErr = 0.0;
+    for (j=0; j<n; j++) {
+      Point p = { xs[j], ys[j], zs[j] };
+      maxErr = fmax(maxErr, headingDiff(getCompassHeading(&cal, &p), getCompassHeading(&streamCal, &p)));
+    }
+    printf("%s: quality %f / %f, max heading difference %f\n", files[i], quality, streamQuality, maxErr);
+    ASSERT_EQ(streamCal.planeA, cal.planeA, 0.0001);
+    ASSERT_EQ(streamCal.planeB, cal.planeB, 0.0001);
+    ASSERT_EQ(streamCal.planeC, cal.planeC, 0.0001);
+    ASSERT_EQ(streamQuality, quality, 0.01);
+    ASSERT_EQ(maxErr, 0, 0.01);
+    i++;
+  }
+  return E_SUCCESS;
+}
+
+/*
+ * Streaming contexts over parts of a log, merged, should give the same
+ * calibration as one context over all of it. Over a million readings
+ * the parallel driver should keep the mean to within 0.01, which a
+ * single pass in float does not.
+ */
+int testStreamMerge() {
+  float xs[MAX_CSV_POINTS], ys[MAX_CSV_POINTS], zs[MAX_CSV_POINTS];
+  int n = loadCsv("./data/rot45.csv", xs, ys, zs, MAX_CSV_POINTS);
+  StreamCalibrationContext whole, parts[3], merged;
+  int i, j;
+
+  startStreamCalibration(&whole);
+  for (i=0; i<3; i++)
+    startStreamCalibration(&parts[i]);
+  startStreamCalibration(&merged);
+  for (j=0; j<n; j++) {
+    Point p = { xs[j], ys[j], zs[j] };
+    float magnetic = j * 360.0 / n;
+    const float* fine = (j % 20 == 0) ? &magnetic : NULL;
+    addStreamCalibrationPoint(&whole, &p, fine);
+    addStreamCalibrationPoint(&parts[j * 3 / n], &p, fine);
+  }
+  for (i=0; i<3; i++)
+    assert(mergeStreamCalibration(&merged, &parts[i]) == E_SUCCESS);
+  assert(merged.moments.count == n);
+  assert(merged.finePointCount == whole.finePointCount);
+
+  Calibration cal, mergedCal;
+  float quality, mergedQuality;
+  assert(finalizeStreamCalibration(&whole, &cal, &quality) == E_SUCCESS);
+  assert(finalizeStreamCalibration(&merged, &mergedCal, &mergedQuality) == E_SUCCESS);
+  float maxErr = 0.0;
+  for (j=0; j<n; j++) {
+    Point p = { xs[j], ys[j], zs[j] };
+    maxErr = fmax(maxErr, headingDiff(getCompassHeading(&cal, &p), getCompassHeading(&mergedCal, &p)));
+  }
+  printf("merged: quality %f / %f, max heading difference %f\n", quality, mergedQuality, maxErr);
+  ASSERT_EQ(mergedCal.planeA, cal.planeA, 0.0001);
+  ASSERT_EQ(mergedCal.planeB, cal.planeB, 0.0001);
+  ASSERT_EQ(mergedCal.planeC, cal.planeC, 0.0001);
+  ASSERT_EQ(mergedQuality, quality, 0.01);
+  ASSERT_EQ(maxErr, 0, 0.01);
+
+  // Too many fine points leaves the context as it was
+  assert(mergeStreamCalibration(&merged, &whole) == E_SUCCESS);
+  assert(mergeStreamCalibration(&merged, &whole) == E_TOO_MANY_FINE_POINTS);
+  assert(merged.moments.count == 2 * n);
+
+  // A million readings on a tilted circle, against a mean in double
+  long count = 1000000, k;
+  Point* points = malloc(count * sizeof(Point));
+  double sum[3] = { 0, 0, 0 };
+  srand(7);
+  for (k=0; k<count; k++) {
+    double a = k * 0.01;
+    points[k].x = 1000 + 500 * cos(a) + rand() % 11 - 5;
+    points[k].y = -2000 + 450 * sin(a) + rand() % 11 - 5;
+    points[k].z = 3000 + 150 * sin(a) + rand() % 11 - 5;
+    sum[0] += points[k].x;
+    sum[1] += points[k].y;
+    sum[2] += points[k].z;
+  }
+  StreamCalibrationContext serial;
+  startStreamCalibration(&serial);
+  for (k=0; k<count; k++)
+    addStreamCalibrationPoint(&serial, &points[k], NULL);
+  Point mean = { sum[0] / count, sum[1] / count, sum[2] / count };
+  Point d;
+  pointVec(&mean, &(serial.moments.mean), &d);
+  printf("single pass: mean off by %f\n", vecLength(&d));
+
+  int threads[] = { 1, 4 };
+  Calibration parallelCal[2];
+  for (i=0; i<2; i++) {
+    StreamCalibrationContext ctx;
+    startStreamCalibration(&ctx);
+    assert(addStreamCalibrationPoints(&ctx, points, count, threads[i]) == E_SUCCESS);
+    assert(ctx.moments.count == count);
+    assert(memcmp(&(ctx.firstPoint), &points[0], sizeof(Point)) == 0);
+    pointVec(&mean, &(ctx.moments.mean), &d);
+    printf("%d threads: mean off by %f\n", threads[i], vecLength(&d));
+    ASSERT_EQ(vecLength(&d), 0, 0.01);
+    for (j=0; j<12; j++) {
+      float magnetic = j * 30;
+      addStreamCalibrationPoint(&ctx, &points[j * 52], &magnetic);
+    }
+    assert(finalizeStreamCalibration(&ctx, &parallelCal[i], &quality) == E_SUCCESS);
+  }
+  for (k=0; k<count; k+=997)
+    ASSERT_EQ(headingDiff(getCompassHeading(&parallelCal[0], &points[k]),
+			  getCompassHeading(&parallelCal[1], &points[k])), 0, 0.01);
+  free(points);
+  return E_SUCCESS;
+}
+
+// From the cross product as well as the dot, as acos of a float dot
+// product cannot resolve angles much under 0.02 degrees.
+float normalAngle(const Calibration* cal, const Point* expected) {
+  Point n = { cal->planeA, cal->planeB, cal->planeC };
+  Point across;
+  crossProduct(&n, expected, &across);
+  return atan2(vecLength(&across), fabs(dotProduct(&n, expected))) * 180 / PI;
+}
+
+/*
+ * Readings on a tilted circle with every 8th one replaced by a spike,
+ * as a passing vehicle would cause. The robust fit should find the
+ * plane of the circle; the plain fit is pulled off it.
+ */
+int testRobustCalibration() {
+  Point normal = { 0, -0.3, 0.9 };
+  normalize(&normal);
+
+  CalibrationContext clean, noisy;
+  startCalibration(&clean);
+  startCalibration(&noisy);
+  int j, spikes = 0;
+  for (j=0; j<MAX_SENSOR_POINTS; j++) {
+    float rad = j * 2 * PI / MAX_SENSOR_POINTS;
+    Point p = {
+      100 + 500 * cos(rad) + 5 * sin(j * 7.7),
+      -200 + 450 * sin(rad) + 5 * sin(j * 3.1),
+      300 + 150 * sin(rad) + 5 * sin(j * 5.3)
+    };
+    addCalibrationPoint(&clean, &p, NULL);
+    if (j % 8 == 4) {
+      p.x += 800 * sin(j);
+      p.y += 800 * cos(j * 1.3);
+      p.z += 600;
+      spikes++;
+    }
+    addCalibrationPoint(&noisy, &p, NULL);
+  }
+
+  Calibration plain, robust, robustClean;
+  float quality;
+  short rejected, rejectedClean;
+  finalizeCalibration(&noisy, &plain, NULL);
+  short rc = finalizeCalibrationRobust(&noisy, &robust, &quality, &rejected);
+  assert(rc == E_SUCCESS);
+  rc = finalizeCalibrationRobust(&clean, &robustClean, NULL, &rejectedClean);
+  assert(rc == E_SUCCESS);
+
+  printf("%i spikes, %i rejected, quality %f, plane error plain %f robust %f clean %f (%i rejected)\n",
+	 spikes, rejected, quality, normalAngle(&plain, &normal), normalAngle(&robust, &normal),
+	 normalAngle(&robustClean, &normal), rejectedClean);
+  assert(rejected >= spikes);
+  ASSERT_EQ(normalAngle(&robust, &normal), 0, 0.5);
+  ASSERT_EQ(normalAngle(&robustClean, &normal), 0, 0.5);
+  assert(normalAngle(&robust, &normal) < normalAngle(&plain, &normal));
+
+  rc = finalizeCalibrationRobust(&clean, &robust, NULL, NULL);
+  assert(rc == E_SUCCESS);
+  startCalibration(&noisy);
+  Point p = { 1, 2, 3 };
+  for (j=0; j<10; j++)
+    addCalibrationPoint(&noisy, &p, NULL);
+  rc = finalizeCalibrationRobust(&noisy, &robust, NULL, NULL);
+  assert(rc == E_DEGENERATE_CALIBRATION);
+  return E_SUCCESS;
+}
+
+/*
+ * One slow turn logged at 20 times the capacity of points[]: without
+ * retention only the first 18 degrees of it fit, with reservoir
+ * sampling the kept points cover the whole circle.
+ */
+int testRetention() {
+  Point normal = { 0, -0.3, 0.9 };
+  normalize(&normal);
+
+  CalibrationContext ctx;
+  startCalibration(&ctx);
+  ctx.retention = RETENTION_RESERVOIR;
+  int j, n = 20 * MAX_SENSOR_POINTS;
+  Point first;
+  for (j=0; j<n; j++) {
+    float rad = j * 2 * PI / n;
+    Point p = {
+      100 + 500 * cos(rad) + 5 * sin(j * 7.7),
+      -200 + 450 * sin(rad) + 5 * sin(j * 3.1),
+      300 + 150 * sin(rad) + 5 * sin(j * 5.3)
+    };
+    if (j == 0)
+      first = p;
+    short rc = addCalibrationPoint(&ctx, &p, NULL);
+    assert(rc == E_SUCCESS);
+  }
+  assert(ctx.pointCount == MAX_SENSOR_POINTS);
+  assert(ctx.seenCount == (uint32_t)n);
+  assert(memcmp(&(ctx.points[0].sensorData), &first, sizeof(Point)) == 0);
+
+  int octants[8] = { 0 };
+  for (j=0; j<ctx.pointCount; j++) {
+    const Point* p = &(ctx.points[j].sensorData);
+    float rad = atan2((p->y + 200) / 450, (p->x - 100) / 500);
+    octants[(int)floor((rad + PI) / (PI / 4)) & 7]++;
+  }
+  for (j=0; j<8; j++)
+    assert(octants[j] > MAX_SENSOR_POINTS / 16);
+
+  Calibration cal;
+  short rc = finalizeCalibration(&ctx, &cal, NULL);
+  assert(rc == E_SUCCESS);
+  printf("%i readings, plane error %f\n", n, normalAngle(&cal, &normal));
+  ASSERT_EQ(normalAngle(&cal, &normal), 0, 0.5);
+
+  startCalibration(&ctx);
+  Point p = { 1, 2, 3 };
+  for (j=0; j<MAX_SENSOR_POINTS; j++)
+    addCalibrationPoint(&ctx, &p, NULL);
+  rc = addCalibrationPoint(&ctx, &p, NULL);
+  assert(rc == E_TOO_MANY_COARSE_POINTS);
+  return E_SUCCESS;
+}
+
+int testCalibrationProgress() {
+  int j;
+  for (j=0; j<3600; j++) {
+    float deg = j * 0.1 + 0.03;
+    short sector = coverageSector(cos(deg * PI / 180), sin(deg * PI / 180));
+    assert(sector == (short)(deg * COVERAGE_SECTORS / 360));
+  }
+
+  CalibrationContext ctx;
+  startCalibration(&ctx);
+  enableCoverage(&ctx);
+  float coverage, quality, quarterTurn = 0, halfTurn = 0;
+  for (j=0; j<MAX_SENSOR_POINTS; j++) {
+    float rad = j * 2 * PI / MAX_SENSOR_POINTS;
+    Point p = {
+      100 + 500 * cos(rad) + 5 * sin(j * 7.7),
+      -200 + 450 * sin(rad) + 5 * sin(j * 3.1),
+      300 + 150 * sin(rad) + 5 * sin(j * 5.3)
+    };
+    addCalibrationPoint(&ctx, &p, NULL);
+    short rc = calibrationProgress(&ctx, &coverage, &quality);
+    if (j < COVERAGE_FIT_INTERVAL - 1)
+      assert(rc == E_NOT_ENOUGH_CALIBRATION_POINTS);
+    else
+      assert(rc == E_SUCCESS);
+    if (j == MAX_SENSOR_POINTS / 4)
+      quarterTurn = coverage;
+    if (j == MAX_SENSOR_POINTS / 2)
+      halfTurn = coverage;
+  }
+
+  Calibration cal;
+  float finalQuality;
+  finalizeCalibration(&ctx, &cal, &finalQuality);
+  printf("coverage after quarter turn %f, half turn %f, full turn %f, quality %f / %f\n", quarterTurn, halfTurn,
+	 coverage, quality, finalQuality);
+  ASSERT_EQ(quarterTurn, 25, 10);
+  ASSERT_EQ(halfTurn, 50, 10);
+  ASSERT_EQ(coverage, 100, 0.001);
+  ASSERT_EQ(quality, finalQuality, 0.1);
+
+  startCalibration(&ctx);
+  enableCoverage(&ctx);
+  Point p = { 1, 2, 3 };
+  for (j=0; j<COVERAGE_FIT_INTERVAL; j++)
+    addCalibrationPoint(&ctx, &p, NULL);
+  assert(calibrationProgress(&ctx, &coverage, &quality) == E_DEGENERATE_CALIBRATION);
+
+  // Not tracked unless asked for
+  startCalibration(&ctx);
+  for (j=0; j<MAX_SENSOR_POINTS; j++) {
+    float rad = j * 2 * PI / MAX_SENSOR_POINTS;
+    Point q = { 500 * cos(rad), 500 * sin(rad), 0 };
+    addCalibrationPoint(&ctx, &q, NULL);
+  }
+  assert(calibrationProgress(&ctx, &coverage, &quality) == E_NOT_ENOUGH_CALIBRATION_POINTS);
+  return E_SUCCESS;
+}
+
+void circlePoint(const Point* centre, const Point* e1, const Point* e2, float deg, Point* pt) {
+  float r = 500;
+  pt->x = centre->x + r * (cos(deg * PI / 180) * e1->x + sin(deg * PI / 180) * e2->x);
+  pt->y = centre->y + r * (cos(deg * PI / 180) * e1->y + sin(deg * PI / 180) * e2->y);
+  pt->z = centre->z + r * (cos(deg * PI / 180) * e1->z + sin(deg * PI / 180) * e2->z);
+}
+
+/*
+ * The mounting drifts by 3 degrees and the hard iron by 40 units after
+ * calibration. The boat then mostly holds one course, with an
+ * occasional full turn, and the adaptive calibration should follow.
+ */
+int testAdaptiveCalibration() {
+  Point centre = { 100, -200, 300 };
+  Point e1 = { 1, 0, 0 };
+  Point e2 = { 0, 0.95, 0.31 };
+  normalize(&e2);
+
+  CalibrationContext ctx;
+  startCalibration(&ctx);
+  int j;
+  for (j=0; j<MAX_SENSOR_POINTS; j++) {
+    Point p;
+    circlePoint(&centre, &e1, &e2, j * 360.0 / MAX_SENSOR_POINTS, &p);
+    addCalibrationPoint(&ctx, &p, NULL);
+  }
+  static Calibration initial;
+  finalizeCalibration(&ctx, &initial, NULL);
+
+  Point drifted = { 130, -175, 310 };
+  Point f2 = { 0, 0.93, 0.36 };
+  normalize(&f2);
+  Point f1 = e1;
+  Point normal;
+  crossProduct(&f1, &f2, &normal);
+  normalize(&normal);
+
+  static AdaptiveCalibration ad;
+  startAdaptiveCalibration(&ad, &initial, 50);
+  static Calibration before;
+  const Calibration* previous = NULL;
+  for (j=0; j<20000; j++) {
+    // A full turn over 400 readings once every 2000, otherwise
+    // holding 30 degrees.
+    float deg = (j % 2000) < 400 ? 30 + (j % 2000) * 0.9 : 30 + 3 * sin(j * 0.1);
+    Point p;
+    circlePoint(&drifted, &f1, &f2, deg, &p);
+    p.x += sin(j * 7.7);
+    p.y += sin(j * 3.1);
+    p.z += sin(j * 5.3);
+
+    uint32_t published = ad.published;
+    addAdaptiveSample(&ad, &p);
+    if (ad.published == 1 && published == 0) {
+      // The calibration handed out before the swap is left intact.
+      assert(previous != adaptiveCalibration(&ad));
+      assert(memcmp(previous, &before, sizeof(Calibration)) == 0);
+    }
+    previous = adaptiveCalibration(&ad);
+    if (ad.published == 0)
+      before = *previous;
+  }
+
+  const Calibration* cal = adaptiveCalibration(&ad);
+  Point origin;
+  Point cartesian = { cal->planeA, cal->planeB, cal->planeC };
+  projectPoint(&drifted, &cartesian, &origin, NULL);
+  pointVec(&(cal->origin), &origin, &origin);
+  printf("%u published, plane error %f (initially %f), origin error %f\n", (unsigned)ad.published,
+	 normalAngle(cal, &normal), normalAngle(&initial, &normal), vecLength(&origin));
+  assert(ad.published > 0);
+  assert(normalAngle(&initial, &normal) > 2);
+  ASSERT_EQ(normalAngle(cal, &normal), 0, 0.2);
+  ASSERT_EQ(vecLength(&origin), 0, 2);
+
+  // The drift tilts the plane about north, which should stay at 0.
+  Point p;
+  circlePoint(&drifted, &f1, &f2, 0, &p);
+  float north = getCompassHeading(cal, &p);
+  ASSERT_EQ(headingDiff(north, 0), 0, 0.5);
+  for (j=0; j<360; j+=15) {
+    circlePoint(&drifted, &f1, &f2, j, &p);
+    ASSERT_EQ(headingDiff(getCompassHeading(cal, &p), north), headingDiff(j, 0), 0.5);
+  }
+  return E_SUCCESS;
+}
+
+/*
+ * getHeadingBatch and processPending against getHeading every tenth
+ * of a degree round a circle in the calibration plane, which takes
+ * the polynomial through every octant whatever HEADING_ATAN2 is.
+ */
+int testBatchAgainstHeading() {
+  Calibration cal;
+  calibrateFromCsv("./data/flat1.csv", &cal);
+  Point normal = { cal.planeA, cal.planeB, cal.planeC };
+  normalize(&normal);
+  Point e1, e2, across = normal;
+  pointVec(&(cal.origin), &(cal.compassNorth), &e1);
+  mulByScalar(&across, -dotProduct(&e1, &normal));
+  addTo(&e1, &across);
+  normalize(&e1);
+  crossProduct(&normal, &e1, &e2);
+
+  static float xs[3600], ys[3600], zs[3600], batch[3600];
+  int j;
+  for (j=0; j<3600; j++) {
+    Point p;
+    circlePoint(&(cal.origin), &e1, &e2, j * 0.1, &p);
+    xs[j] = p.x;
+    ys[j] = p.y;
+    zs[j] = p.z;
+  }
+  assert(getHeadingBatch(&cal, xs, ys, zs, 3600, batch) == E_SUCCESS);
+
+  static SampleRing ring;
+  sampleRingInit(&ring);
+  float pending[SAMPLE_RING_SIZE];
+  float batchErr = 0, pendingErr = 0;
+  for (j=0; j<3600; j++) {
+    Point p = { xs[j], ys[j], zs[j] };
+    float heading;
+    getHeading(&cal, &p, &heading);
+    batchErr = fmax(batchErr, headingDiff(batch[j], heading));
+
+    assert(sampleRingPush(&ring, &p) == E_SUCCESS);
+    assert(processPending(&cal, &ring, pending, SAMPLE_RING_SIZE) == 1);
+    pendingErr = fmax(pendingErr, headingDiff(pending[0], heading));
+  }
+  printf("max difference from getHeading: getHeadingBatch %f, processPending %f\n", batchErr, pendingErr);
+  ASSERT_EQ(batchErr, 0, BATCH_TOLERANCE);
+  ASSERT_EQ(pendingErr, 0, BATCH_TOLERANCE);
+  return E_SUCCESS;
+}
+
+/*
+ * Readings pushed and drained in uneven chunks, so that the indices
+ * wrap past 256 and the queued readings past the end of the arrays.
+ */
+int testSampleRing() {
+  static Calibration cal;
+  calibrateFromCsv("./data/flat1.csv", &cal);
+  Point centre = { 100, -200, 300 };
+  Point e1 = { 1, 0, 0 };
+  Point e2 = { 0, 1, 0 };
+
+  static SampleRing ring;
+  sampleRingInit(&ring);
+  float headings[SAMPLE_RING_SIZE];
+  int pushed = 0, processed = 0;
+  while (processed < 1000) {
+    int burst = 1 + pushed % (SAMPLE_RING_SIZE + 3);
+    int j;
+    for (j=0; j<burst; j++) {
+      Point p;
+      circlePoint(&centre, &e1, &e2, pushed * 7.3, &p);
+      short rc = sampleRingPush(&ring, &p);
+      if (rc == E_RING_FULL) {
+	assert((uint8_t)(ring.head - ring.tail) == SAMPLE_RING_SIZE);
+	break;
+      }
+      assert(rc == E_SUCCESS);
+      pushed++;
+    }
+
+    short n = processPending(&cal, &ring, headings, 1 + processed % SAMPLE_RING_SIZE);
+    for (j=0; j<n; j++) {
+      Point p;
+      float heading;
+      circlePoint(&centre, &e1, &e2, (processed + j) * 7.3, &p);
+      getHeading(&cal, &p, &heading);
+      ASSERT_EQ(headingDiff(headings[j], heading), 0, BATCH_TOLERANCE);
+    }
+    processed += n;
+  }
+  assert(processed + (uint8_t)(ring.head - ring.tail) == pushed);
+
+  // No room for headings leaves the ring as it is.
+  uint8_t tail = ring.tail;
+  if (ring.head == tail)
+    sampleRingPush(&ring, &centre);
+  assert(processPending(&cal, &ring, headings, 0) == 0);
+  assert(processPending(&cal, &ring, headings, -1) == 0);
+  assert(ring.tail == tail);
+  while (processPending(&cal, &ring, headings, SAMPLE_RING_SIZE) > 0)
+    ;
+  assert(ring.head == ring.tail);
+  return E_SUCCESS;
+}
+
+/*
+ * A steady turn through north, decimated by odd and even ratios. Each
+ * output should be the heading at the middle of its block.
+ */
+int testHeadingFilter() {
+  Point centre = { 100, -200, 300 };
+  Point e1 = { 1, 0, 0 };
+  Point e2 = { 0, 0.95, 0.31 };
+  normalize(&e2);
+  CalibrationContext ctx;
+  startCalibration(&ctx);
+  int j;
+  for (j=0; j<MAX_SENSOR_POINTS; j++) {
+    Point p;
+    circlePoint(&centre, &e1, &e2, j * 360.0 / MAX_SENSOR_POINTS, &p);
+    addCalibrationPoint(&ctx, &p, NULL);
+  }
+  static Calibration cal;
+  finalizeCalibration(&ctx, &cal, NULL);
+
+  int ratios[] = { 1, 4, 5, 20, 0 };
+  int k;
+  for (k=0; ratios[k] > 0; k++) {
+    HeadingFilter filter;
+    startHeadingFilter(&filter, ratios[k]);
+    float maxErr = 0.0;
+    int outputs = 0;
+    for (j=0; j<400; j++) {
+      float deg = 300 + j * 0.7;
+      Point p;
+      circlePoint(&centre, &e1, &e2, deg, &p);
+      float heading;
+      short rc = filterHeading(&filter, &cal, &p, &heading);
+      if ((j + 1) % ratios[k] != 0) {
+	assert(rc == E_HEADING_PENDING);
+	continue;
+      }
+      assert(rc == E_SUCCESS);
+      outputs++;
+
+      // Middle of the block, (ratio - 1) / 2 readings back.
+      circlePoint(&centre, &e1, &e2, deg - (ratios[k] - 1) / 2.0 * 0.7, &p);
+      maxErr = fmax(maxErr, headingDiff(heading, getCompassHeading(&cal, &p)));
+    }
+    printf("ratio %i: %i outputs, max error %f\n", ratios[k], outputs, maxErr);
+    assert(outputs == 400 / ratios[k]);
+    ASSERT_EQ(maxErr, 0, 0.01);
+  }
+  return E_SUCCESS;
+}
+
+// Roughly normal noise with standard deviation sigma.
+float replayNoise(uint32_t* seed, float sigma) {
+  float sum = 0;
+  int i;
+  for (i=0; i<4; i++)
+    sum += robustRandom(seed) / 65536.0;
+  return (sum - 2) * sigma * sqrt(3.0);
+}
+
+/*
+ * Replays magnetic heading over 60 s at 100 Hz with two 120 degree
+ * tacks at 30 degrees/s, one of them through north, and errs the
+ * gyro by 0.5 degrees/s of bias. Magnetic heading low-passed alone to
+ * the same noise as the fusion should lag far behind it in the tacks.
+ */
+void replayTacks(float timeConstant, int useGyro, float* noise, float* turnError, float* bias) {
+  const float dt = 0.01;
+  uint32_t seed = 4321;
+  GyroFusion fusion;
+  startGyroFusion(&fusion, timeConstant);
+  float truth = 30, u = 0, v = 0;
+  double noiseSq = 0, turnSq = 0;
+  int noiseN = 0, turnN = 0;
+  int j;
+  for (j=0; j<6000; j++) {
+    float t = j * dt;
+    float rate = (t >= 10 && t < 14) ? -30 : ((t >= 30 && t < 34) ? 30 : 0);
+    truth = fmod(truth + rate * dt + 360, 360);
+    float magnetic = fmod(truth + replayNoise(&seed, 2) + 360, 360);
+    float gyro = rate + 0.5 + replayNoise(&seed, 0.2);
+
+    float out;
+    if (useGyro) {
+      fuseHeading(&fusion, magnetic, gyro, dt, &out);
+    } else {
+      // First order low pass of the heading vector.
+      float alpha = dt / (timeConstant + dt);
+      u += alpha * (cos(magnetic * PI / 180) - u);
+      v += alpha * (sin(magnetic * PI / 180) - v);
+      out = fmod(atan2(v, u) * 180 / PI + 360, 360);
+    }
+
+    float err = headingDiff(out, truth);
+    if ((t >= 20 && t < 30) || t >= 45) {
+      noiseSq += err * err;
+      noiseN++;
+    } else if ((t >= 10 && t < 16) || (t >= 30 && t < 36)) {
+      turnSq += err * err;
+      turnN++;
+    }
+  }
+  *noise = sqrt(noiseSq / noiseN);
+  *turnError = sqrt(turnSq / turnN);
+  *bias = fusion.bias;
+}
+
+int testGyroFusion() {
+  float noise, turnError, bias;
+  replayTacks(2.0, 1, &noise, &turnError, &bias);
+  printf("fused: noise %f, error in tacks %f, bias %f\n", noise, turnError, bias);
+  ASSERT_EQ(bias, 0.5, 0.1);
+
+  // The least filtering of magnetic heading alone that is as quiet.
+  float timeConstant, magNoise = 1e9, magTurnError = 0, unused;
+  for (timeConstant = 0.05; magNoise > noise; timeConstant *= 1.25)
+    replayTacks(timeConstant, 0, &magNoise, &magTurnError, &unused);
+  printf("magnetic only: time constant %f, noise %f, error in tacks %f\n", timeConstant / 1.25, magNoise, magTurnError);
+  assert(turnError * 4 < magTurnError);
+
+  // Steps beyond the limit of the loop, timeConstant / 2 to 0.83 of it,
+  // still settle on the heading and the gyro bias.
+  float dts[] = { 0.4, 0.9, 2, 10 };
+  int k, j;
+  for (k=0; k<4; k++) {
+    GyroFusion fusion;
+    float fused;
+    startGyroFusion(&fusion, 1);
+    fuseHeading(&fusion, 350, 0, dts[k], &fused);
+    for (j=0; j<200; j++)
+      fuseHeading(&fusion, 10, 3, dts[k], &fused);
+    ASSERT_EQ(headingDiff(fused, 10), 0, 0.01);
+    ASSERT_EQ(fusion.bias, 3, 0.01);
+  }
+  return E_SUCCESS;
+}
+
+/*
+ * Reading and gravity of a vessel at heading, pitch and heel in degrees
+ * (yaw, pitch and roll in that order), with the sensor along its axes:
+ * x forward, y starboard, z down. The earth's field dips 66 degrees.
+ */
+void vesselReading(float heading, float pitch, float heel, Point* pt, Point* gravity) {
+  Point field = { 200, 0, 450 };
+  Point down = { 0, 0, 1 };
+  Point hardIron = { 100, -200, 300 };
+  float angles[] = { -heading * PI / 180, -pitch * PI / 180, -heel * PI / 180 };
+  Point* vs[] = { &field, &down };
+  int i, k;
+  for (i=0; i<2; i++) {
+    Point* w = vs[i];
+    for (k=0; k<3; k++) {
+      float c = cos(angles[k]), s = sin(angles[k]);
+      Point r = *w;
+      if (k == 0) {
+	w->x = c * r.x - s * r.y;
+	w->y = s * r.x + c * r.y;
+      } else if (k == 1) {
+	w->x = c * r.x + s * r.z;
+	w->z = c * r.z - s * r.x;
+      } else {
+	w->y = c * r.y - s * r.z;
+	w->z = s * r.y + c * r.z;
+      }
+    }
+  }
+  *pt = field;
+  addTo(pt, &hardIron);
+  *gravity = down;
+}
+
+/*
+ * Reading of a vessel as vesselReading, through soft iron that
+ * stretches the field by 30% across the fore and aft axis and couples
+ * it with the vertical.
+ */
+void ironReading(float heading, float pitch, float heel, Point* pt, Point* gravity) {
+  static const float softIron[9] = { 1.15, 0.15, 0, 0.15, 1.15, 0.1, 0, 0.1, 0.9 };
+  Point hardIron = { 100, -200, 300 };
+  Point field;
+  vesselReading(heading, pitch, heel, pt, gravity);
+  pointVec(&hardIron, pt, &field);
+  softIronApply(softIron, &field, pt);
+  addTo(pt, &hardIron);
+}
+
+typedef void (*VesselReading)(float heading, float pitch, float heel, Point* pt, Point* gravity);
+
+// Largest error of getHeadingTilt, and of getHeading, over a full turn.
+void tiltErrors(const Calibration* cal, VesselReading reading, float north, float pitch, float heel,
+		float* tiltErr, float* levelErr) {
+  Point p, g;
+  float heading, east;
+  reading(north + 90, 0, 0, &p, &g);
+  getHeading(cal, &p, &east);
+  float sense = headingDiff(east, 90) < headingDiff(east, 270) ? 1 : -1;
+
+  *tiltErr = 0;
+  *levelErr = 0;
+  int j;
+  for (j=0; j<360; j+=5) {
+    float expected = fmod(360 + sense * j, 360);
+    reading(north + j, pitch, heel, &p, &g);
+    getHeadingTilt(cal, &p, &g, &heading);
+    *tiltErr = fmax(*tiltErr, headingDiff(heading, expected));
+    getHeading(cal, &p, &heading);
+    *levelErr = fmax(*levelErr, headingDiff(heading, expected));
+  }
+}
+
+/*
+ * Calibrates level, then estimates the vertical field from readings at
+ * 20 degrees of heel either way. Heel alone should then be compensated
+ * exactly wherever compass north lies, and heel with pitch to within
+ * about half their product, 0.9 degrees.
+ */
+int testTiltCompensation() {
+  float norths[] = { 0, 37 };
+  int k;
+  for (k=0; k<2; k++) {
+    CalibrationContext ctx;
+    startCalibration(&ctx);
+    Point p, g;
+    int j;
+    for (j=0; j<MAX_SENSOR_POINTS; j++) {
+      vesselReading(norths[k] + j * 360.0 / MAX_SENSOR_POINTS, 0, 0, &p, &g);
+      addCalibrationPoint(&ctx, &p, NULL);
+    }
+    static Calibration cal;
+    assert(finalizeCalibration(&ctx, &cal, NULL) == E_SUCCESS);
+    assert(cal.verticalField == 0);
+
+    // Level readings cannot separate the hard iron from the field.
+    Point ps[24], gs[24];
+    for (j=0; j<12; j++)
+      vesselReading(j * 30, 0, 0, &ps[j], &gs[j]);
+    assert(estimateVerticalField(&cal, ps, gs, 12) == E_DEGENERATE_CALIBRATION);
+
+    for (j=0; j<24; j++)
+      vesselReading(j * 15, 0, j % 2 ? 20 : -20, &ps[j], &gs[j]);
+    assert(estimateVerticalField(&cal, ps, gs, 24) == E_SUCCESS);
+    Point normal = cal.transform.normal, hardIron = cal.origin;
+    mulByScalar(&normal, -cal.verticalField);
+    addTo(&hardIron, &normal);
+    ASSERT_EQ(hardIron.x, 100, 0.5);
+    ASSERT_EQ(hardIron.y, -200, 0.5);
+    ASSERT_EQ(hardIron.z, 300, 0.5);
+
+    // Without gravity there is nothing to compensate.
+    Point zero = { 0, 0, 0 };
+    float heading, level;
+    vesselReading(50, 0, 0, &p, &g);
+    getHeadingTilt(&cal, &p, &zero, &heading);
+    getHeading(&cal, &p, &level);
+    assert(heading == level);
+
+    float tiltErr, levelErr;
+    tiltErrors(&cal, vesselReading, norths[k], 0, 20, &tiltErr, &levelErr);
+    printf("north %.0f, heel 20: max error %f, uncompensated %f\n", norths[k], tiltErr, levelErr);
+    ASSERT_EQ(tiltErr, 0, 0.02 + 2 * ATAN2_TOLERANCE);
+    assert(levelErr > 20);
+
+    tiltErrors(&cal, vesselReading, norths[k], 5, 20, &tiltErr, &levelErr);
+    printf("north %.0f, heel 20, pitch 5: max error %f, uncompensated %f\n", norths[k], tiltErr, levelErr);
+    ASSERT_EQ(tiltErr, 0, 1 + 2 * ATAN2_TOLERANCE);
+  }
+  return E_SUCCESS;
+}
+
+// Calibrates from the given readings with each origin model up to last.
+void originErrors(const Point* points, int n, VesselReading reading, float north, short last, float* errors,
+		  Calibration* cals) {
+  short model;
+  for (model=ORIGIN_CENTROID; model<=last; model++) {
+    CalibrationContext ctx;
+    startCalibration(&ctx);
+    ctx.originModel = model;
+    int j;
+    for (j=0; j<n; j++)
+      addCalibrationPoint(&ctx, &points[j], NULL);
+    assert(finalizeCalibration(&ctx, &cals[model], NULL) == E_SUCCESS);
+    float unused;
+    tiltErrors(&cals[model], reading, north, 0, 0, &unused, &errors[model]);
+  }
+}
+
+/*
+ * Half a turn should give the circle and ellipse the origin that only
+ * a whole turn gives the centroid, and the ellipse should also undo
+ * soft iron. With heeled turns added the ellipsoid should find the
+ * hard iron offset in 3D, and level headings to within the tilt left
+ * in the plane through all the turns, about 0.3 degrees.
+ */
+int testOriginFit() {
+  const char* names[] = { "centroid", "circle", "ellipse", "ellipsoid" };
+  static Calibration cals[4];
+  Point points[MAX_SENSOR_POINTS], g;
+  float errors[4];
+  int j;
+
+  for (j=0; j<60; j++)
+    vesselReading(20 + j * 3, 0, 0, &points[j], &g);
+  originErrors(points, 60, vesselReading, 20, ORIGIN_ELLIPSE, errors, cals);
+  printf("half turn: %s %f, %s %f, %s %f\n", names[0], errors[0], names[1], errors[1], names[2], errors[2]);
+  assert(errors[ORIGIN_CENTROID] > 10);
+  ASSERT_EQ(errors[ORIGIN_CIRCLE], 0, 0.05 + ATAN2_TOLERANCE);
+  ASSERT_EQ(errors[ORIGIN_ELLIPSE], 0, 0.05 + ATAN2_TOLERANCE);
+
+  for (j=0; j<60; j++)
+    ironReading(20 + j * 3, 0, 0, &points[j], &g);
+  originErrors(points, 60, ironReading, 20, ORIGIN_ELLIPSE, errors, cals);
+  printf("half turn, soft iron: %s %f, %s %f, %s %f\n", names[0], errors[0], names[1], errors[1], names[2], errors[2]);
+  assert(errors[ORIGIN_CIRCLE] > 5);
+  ASSERT_EQ(errors[ORIGIN_ELLIPSE], 0, 0.05 + ATAN2_TOLERANCE);
+
+  // Turns level and at 20 degrees of heel either way
+  VesselReading readings[] = { vesselReading, ironReading };
+  int k;
+  for (k=0; k<2; k++) {
+    for (j=0; j<MAX_SENSOR_POINTS; j++)
+      readings[k](20 + (j / 3) * 360.0 / (MAX_SENSOR_POINTS / 3), 0, (j % 3 - 1) * 20, &points[j], &g);
+    readings[k](20, 0, 0, &points[0], &g);
+    originErrors(points, MAX_SENSOR_POINTS, readings[k], 20, ORIGIN_ELLIPSOID, errors, cals);
+    printf("heeled turns%s: %s %f, %s %f, %s %f, %s %f\n", k ? ", soft iron" : "", names[0], errors[0],
+	   names[1], errors[1], names[2], errors[2], names[3], errors[3]);
+    ASSERT_EQ(errors[ORIGIN_ELLIPSOID], 0, 0.5 + ATAN2_TOLERANCE);
+    assert(errors[ORIGIN_ELLIPSOID] < errors[ORIGIN_CENTROID]);
+
+    // Without soft iron across the plane its centre is the hard iron offset.
+    if (readings[k] == vesselReading) {
+      Calibration* cal = &cals[ORIGIN_ELLIPSOID];
+      Point normal = cal->transform.normal, hardIron = cal->origin;
+      mulByScalar(&normal, -cal->verticalField);
+      addTo(&hardIron, &normal);
+      ASSERT_EQ(hardIron.x, 100, 1);
+      ASSERT_EQ(hardIron.y, -200, 1);
+      ASSERT_EQ(hardIron.z, 300, 1);
+    }
+  }
+
+  // Quality is of the plane the ellipsoid leaves, not the first one.
+  CalibrationContext ctx;
+  startCalibration(&ctx);
+  ctx.originModel = ORIGIN_ELLIPSOID;
+  for (j=0; j<MAX_SENSOR_POINTS; j++)
+    addCalibrationPoint(&ctx, &points[j], NULL);
+  float quality;
+  assert(finalizeCalibration(&ctx, &cals[0], &quality) == E_SUCCESS);
+  float expected = 100.0f - rmse(&ctx, &cals[0]) / meanLength(&ctx) * 100;
+  ASSERT_EQ(quality, expected, 0.001);
+
+  // Too few points for the fit
+  startCalibration(&ctx);
+  ctx.originModel = ORIGIN_ELLIPSE;
+  for (j=0; j<4; j++)
+    addCalibrationPoint(&ctx, &points[j * 3], NULL);
+  assert(finalizeCalibration(&ctx, &cals[0], NULL) == E_NOT_ENOUGH_CALIBRATION_POINTS);
+  return E_SUCCESS;
+}
+
+/*
+ * Half a turn with every 8th reading a spike: the robust fit should
+ * leave the spikes out of the circle fit as well as the plane fit.
+ */
+int testRobustOriginFit() {
+  CalibrationContext ctx;
+  startCalibration(&ctx);
+  ctx.originModel = ORIGIN_CIRCLE;
+  Point p, g;
+  int j;
+  for (j=0; j<60; j++) {
+    vesselReading(20 + j * 3, 0, 0, &p, &g);
+    if (j % 8 == 4) {
+      p.x += 300;
+      p.z += 200;
+    }
+    addCalibrationPoint(&ctx, &p, NULL);
+  }
+
+  Calibration cal;
+  float quality, error, unused;
+  short rejected;
+  assert(finalizeCalibrationRobust(&ctx, &cal, &quality, &rejected) == E_SUCCESS);
+  tiltErrors(&cal, vesselReading, 20, 0, 0, &unused, &error);
+  printf("half turn with spikes: %i rejected, quality %f, circle error %f\n", rejected, quality, error);
+  assert(rejected >= 7);
+  ASSERT_EQ(error, 0, 0.05 + ATAN2_TOLERANCE);
+  ASSERT_EQ(quality, 100, 0.01);
+  return E_SUCCESS;
+}
+
+/*
+ * Moving the hard iron offset by hand: once recompiled, readings moved
+ * by the same amount read as before.
+ */
+int testCompileTransform() {
+  CalibrationContext ctx;
+  startCalibration(&ctx);
+  Point p, g;
+  int j;
+  for (j=0; j<36; j++) {
+    vesselReading(j * 10, 0, 0, &p, &g);
+    addCalibrationPoint(&ctx, &p, NULL);
+  }
+  Calibration cal;
+  assert(finalizeCalibration(&ctx, &cal, NULL) == E_SUCCESS);
+
+  float before[36];
+  for (j=0; j<36; j++) {
+    vesselReading(j * 10 + 5, 0, 0, &p, &g);
+    getHeading(&cal, &p, &before[j]);
+  }
+
+  Point shift = { 30, -20, 10 };
+  addTo(&(cal.origin), &shift);
+  addTo(&(cal.compassNorth), &shift);
+  compileTransform(&cal);
+  for (j=0; j<36; j++) {
+    float after;
+    vesselReading(j * 10 + 5, 0, 0, &p, &g);
+    addTo(&p, &shift);
+    getHeading(&cal, &p, &after);
+    ASSERT_EQ(headingDiff(before[j], after), 0, 1e-3);
+  }
+  return E_SUCCESS;
+}
+
+#define EEPROM_SIZE 1024
+
+/*
+ * File standing in for an EEPROM: erased to 0xFF, written and read at
+ * byte addresses.
+ */
+FILE* eepromOpen() {
+  FILE* eeprom = tmpfile();
+  assert(eeprom);
+  int i;
+  for (i=0; i<EEPROM_SIZE; i++)
+    fputc(0xFF, eeprom);
+  return eeprom;
+}
+
+void eepromWrite(FILE* eeprom, long address, const void* data, size_t size) {
+  assert(address + size <= EEPROM_SIZE);
+  fseek(eeprom, address, SEEK_SET);
+  assert(fwrite(data, 1, size, eeprom) == size);
+  fflush(eeprom);
+}
+
+void eepromRead(FILE* eeprom, long address, void* data, size_t size) {
+  assert(address + size <= EEPROM_SIZE);
+  fseek(eeprom, address, SEEK_SET);
+  assert(fread(data, 1, size, eeprom) == size);
+}
+
+// Largest difference from cal of the loaded calibration and the packed one.
+void packedErrors(const Calibration* cal, const Calibration* loaded, const PackedCalibration* view,
+		  float* loadErr, float* packedErr) {
+  *loadErr = 0;
+  *packedErr = 0;
+  int j;
+  for (j=0; j<360; j++) {
+    Point p, g;
+    float expected, heading;
+    ironReading(j, 0, 0, &p, &g);
+    getHeading(cal, &p, &expected);
+    getHeading(loaded, &p, &heading);
+    *loadErr = fmax(*loadErr, headingDiff(heading, expected));
+    getHeadingPacked(view, &p, &heading);
+    *packedErr = fmax(*packedErr, headingDiff(heading, expected));
+  }
+}
+
+/*
+ * A calibration with soft iron and fine points should survive the trip
+ * through EEPROM to within the quantization error, about 0.01 degrees
+ * here, and getHeadingPacked should follow the deviation table to
+ * within 0.05. Damage of any kind should be caught.
+ */
+int testSerialization() {
+  short models[] = { DEVIATION_MODEL_TABLE, DEVIATION_MODEL_HARMONIC };
+  FILE* eeprom = eepromOpen();
+  int k, j;
+  for (k=0; k<2; k++) {
+    CalibrationContext ctx;
+    startCalibration(&ctx);
+    ctx.originModel = ORIGIN_ELLIPSE;
+    ctx.deviationModel = models[k];
+    Point p, g;
+    for (j=0; j<MAX_SENSOR_POINTS - 12; j++) {
+      ironReading(j * 360.0 / (MAX_SENSOR_POINTS - 12), 0, 0, &p, &g);
+      addCalibrationPoint(&ctx, &p, NULL);
+    }
+    for (j=0; j<12; j++) {
+      float magnetic = fmod(j * 30 + 4 * sin(j * 30 * PI / 180) + 360, 360);
+      ironReading(j * 30, 0, 0, &p, &g);
+      addCalibrationPoint(&ctx, &p, &magnetic);
+    }
+    static Calibration cal, loaded;
+    assert(finalizeCalibration(&ctx, &cal, NULL) == E_SUCCESS);
+
+    PackedCalibration packed, stored;
+    assert(saveCalibration(&cal, &packed, sizeof(packed) - 1) == E_BUFFER_TOO_SMALL);
+    assert(saveCalibration(&cal, &packed, sizeof(packed)) == E_SUCCESS);
+    eepromWrite(eeprom, 64, &packed, sizeof(packed));
+
+    // As at boot: read it back, check it and use it where it is.
+    const PackedCalibration* view;
+    eepromRead(eeprom, 64, &stored, sizeof(stored));
+    assert(viewCalibration(&stored, sizeof(stored), &view) == E_SUCCESS);
+    assert(view == &stored);
+    assert(loadCalibration(&stored, sizeof(stored), &loaded) == E_SUCCESS);
+    assert(loaded.deviationModel == models[k]);
+    assert(loaded.pointCount == 12);
+
+    float loadErr, packedErr;
+    packedErrors(&cal, &loaded, view, &loadErr, &packedErr);
+    printf("model %d: loaded %f, packed %f\n", models[k], loadErr, packedErr);
+    ASSERT_EQ(loadErr, 0, 0.01 + 2 * ATAN2_TOLERANCE);
+    ASSERT_EQ(packedErr, 0, (models[k] == DEVIATION_MODEL_TABLE ? 0.05 : 0.01) + 2 * ATAN2_TOLERANCE);
+  }
+
+  // Erased, too short, flipped bit, other version, other byte order.
+  PackedCalibration stored;
+  const PackedCalibration* view;
+  eepromRead(eeprom, 512, &stored, sizeof(stored));
+  assert(viewCalibration(&stored, sizeof(stored), &view) == E_CORRUPT_CALIBRATION);
+  eepromRead(eeprom, 64, &stored, sizeof(stored));
+  assert(viewCalibration(&stored, sizeof(stored) - 1, &view) == E_CORRUPT_CALIBRATION);
+  for (j=0; j<(int)sizeof(stored); j+=7) {
+    eepromRead(eeprom, 64, &stored, sizeof(stored));
+    ((uint8_t*)&stored)[j] ^= 0x10;
+    assert(viewCalibration(&stored, sizeof(stored), &view) == E_CORRUPT_CALIBRATION);
+    assert(loadCalibration(&stored, sizeof(stored), NULL) == E_CORRUPT_CALIBRATION);
+  }
+  eepromRead(eeprom, 64, &stored, sizeof(stored));
+  stored.version++;
+  assert(viewCalibration(&stored, sizeof(stored), &view) == E_CORRUPT_CALIBRATION);
+  eepromRead(eeprom, 64, &stored, sizeof(stored));
+  stored.magic = (uint16_t)((CALIBRATION_MAGIC >> 8) | (CALIBRATION_MAGIC << 8));
+  assert(viewCalibration(&stored, sizeof(stored), &view) == E_CORRUPT_CALIBRATION);
+  fclose(eeprom);
+  return E_SUCCESS;
+}
+
+/*
+ * The fleet engine should give every log the same calibration however
+ * many threads share the work, flag logs it cannot read, and match a
+ * reservoir calibration of the whole log.
+ */
+int testFleetCalibration() {
+  const char* files[] = { "./data/rot45.csv", "./data/flat1.csv", "./data/flat2.csv" };
+  static FleetJob jobs[2][20];
+  int threads[] = { 1, 4 };
+  int k, j;
+
+  for (k=0; k<2; k++) {
+    for (j=0; j<19; j++)
+      jobs[k][j].fileName = files[j % 3];
+    jobs[k][19].fileName = "./data/missing.csv";
+    assert(calibrateFleet(jobs[k], 20, threads[k]) == 19);
+  }
+  for (j=0; j<20; j++) {
+    assert(jobs[1][j].status == jobs[0][j].status);
+    assert(jobs[1][j].readingCount == jobs[0][j].readingCount);
+    assert(jobs[1][j].quality == jobs[0][j].quality);
+    assert(memcmp(&(jobs[1][j].cal.origin), &(jobs[0][j].cal.origin), sizeof(Point)) == 0);
+  }
+  assert(jobs[0][19].status == E_UNREADABLE_LOG);
+  assert(jobs[0][1].readingCount == 388);
+
+  for (j=0; j<3; j++) {
+    CalibrationContext ctx;
+    startCalibration(&ctx);
+    ctx.retention = RETENTION_RESERVOIR;
+    float xs[MAX_CSV_POINTS], ys[MAX_CSV_POINTS], zs[MAX_CSV_POINTS];
+    int n = loadCsv(files[j], xs, ys, zs, MAX_CSV_POINTS), i;
+    for (i=0; i<n; i++) {
+      Point p = { xs[i], ys[i], zs[i] };
+      addCalibrationPoint(&ctx, &p, NULL);
+    }
+    static Calibration cal;
+    float quality;
+    assert(finalizeCalibration(&ctx, &cal, &quality) == E_SUCCESS);
+    printf("%s: Quality: %f\n", files[j], jobs[0][j].quality);
+    assert(jobs[0][j].readingCount == n);
+    assert(jobs[0][j].quality == quality);
+    ASSERT_EQ(quality, 100, 10);
+  }
+
+  // Header and one row per log
+  FILE* results = tmpfile();
+  writeFleetResults(jobs[1], 20, results);
+  rewind(results);
+  char line[256];
+  int lines = 0;
+  while (fgets(line, sizeof(line), results))
+    if (lines++ == 0)
+      assert(strncmp(line, "log,status,readings,quality,hard_iron_x,", 40) == 0);
+  fclose(results);
+  assert(lines == 21);
+  return E_SUCCESS;
+}
+
+// Reading k of a circle of radius 500 tilted about y, with +-5 noise.
+void tiltedCirclePoint(long k, Point* p) {
+  double a = k * 0.01, noise = (k * 7919) % 11 - 5;
+  p->x = 1000 + 500 * cos(a) * 0.98 + noise * 0.196;
+  p->y = -2000 + 500 * sin(a);
+  p->z = 3000 + 500 * cos(a) * 0.196 - noise * 0.98;
+}
+
+/*
+ * Ten million readings one at a time, and in two halves merged, should
+ * give the plane and quality that ten thousand do: float sums without
+ * compensation stop moving long before.
+ */
+int testStreamPrecision() {
+  long counts[] = { 10000, 10000000 };
+  Point normal = { 0.196, 0, -0.98 };
+  normalize(&normal);
+  StreamCalibrationContext ctx, halves[2];
+  float quality[2], mergedQuality;
+  Calibration cal;
+  Point p;
+  long k;
+  int i;
+
+  for (i=0; i<2; i++) {
+    startStreamCalibration(&ctx);
+    startStreamCalibration(&halves[0]);
+    startStreamCalibration(&halves[1]);
+    for (k=0; k<counts[i]; k++) {
+      tiltedCirclePoint(k, &p);
+      addStreamCalibrationPoint(&ctx, &p, NULL);
+      if (i == 1)
+	addStreamCalibrationPoint(&halves[k * 2 / counts[i]], &p, NULL);
+    }
+    assert(finalizeStreamCalibration(&ctx, &cal, &quality[i]) == E_SUCCESS);
+    printf("%ld readings: quality %f, plane error %f\n", counts[i], quality[i], normalAngle(&cal, &normal));
+    ASSERT_EQ(normalAngle(&cal, &normal), 0, 0.01);
+  }
+  ASSERT_EQ(quality[1], quality[0], 0.001);
+
+  assert(mergeStreamCalibration(&halves[0], &halves[1]) == E_SUCCESS);
+  assert(finalizeStreamCalibration(&halves[0], &cal, &mergedQuality) == E_SUCCESS);
+  printf("merged halves: quality %f, plane error %f\n", mergedQuality, normalAngle(&cal, &normal));
+  ASSERT_EQ(normalAngle(&cal, &normal), 0, 0.01);
+  ASSERT_EQ(mergedQuality, quality[0], 0.001);
+  return E_SUCCESS;
+}
+
+float angleToDegrees(uint16_t angle) {
+  return angle * 360.0 / 65536;
+}
+
+int testFixedCalibration() {
+  const char* files[] = {
+    "./data/rot45.csv",
+    "./data/flat1.csv",
+    "./data/flat2.csv",
+    NULL
+  };
+  float xs[MAX_CSV_POINTS], ys[MAX_CSV_POINTS], zs[MAX_CSV_POINTS];
+
+  int i = 0;
+  while (files[i] != NULL) {
+    int n = loadCsv(files[i], xs, ys, zs, MAX_CSV_POINTS);
+
+    Calibration cal;
+    calibrateWithDeviation(xs, ys, zs, n, &cal);
+
+    // Same points and fine headings, in fixed point.
+    CalibrationContext ctx;
+    Calibration coarse;
+    startCalibration(&ctx);
+    int j;
+    for (j=0; j<n && j<MAX_SENSOR_POINTS; j++) {
+      Point p = { xs[j], ys[j], zs[j] };
+      addCalibrationPoint(&ctx, &p, NULL);
+    }
+    float quality;
+    finalizeCalibration(&ctx, &coarse, &quality);
+
+    FixedCalibrationContext fixedCtx;
+    startFixedCalibration(&fixedCtx);
+    for (j=0; j<n && j<MAX_SENSOR_POINTS; j++) {
+      Point p = { xs[j], ys[j], zs[j] };
+      RawPoint raw = { (int16_t)xs[j], (int16_t)ys[j], (int16_t)zs[j] };
+      if (j % 10 == 0) {
+	float compass = getCompassHeading(&coarse, &p);
+	float magnetic = fmod(compass + 5 * sin(compass * PI / 180) + 360, 360);
+	uint16_t angle = (uint16_t)(magnetic * 65536 / 360 + 0.5);
+	addFixedCalibrationPoint(&fixedCtx, &raw, &angle);
+      } else {
+	addFixedCalibrationPoint(&fixedCtx, &raw, NULL);
+      }
+    }
+    FixedCalibration fixedCal;
+    short fixedQuality;
+    short rc = finalizeFixedCalibration(&fixedCtx, &fixedCal, &fixedQuality);
+    assert(rc == E_SUCCESS);
+
+    float maxErr = 0.0;
+    for (j=0; j<n; j++) {
+      Point p = { xs[j], ys[j], zs[j] };
+      RawPoint raw = { (int16_t)xs[j], (int16_t)ys[j], (int16_t)zs[j] };
+      uint16_t fixedHeading;
+      getFixedHeading(&fixedCal, &raw, &fixedHeading);
+      // Fixed point interpolates calibrationData directly, so compare
+      // against that rather than the binned table.
+      float heading = scanDeviation(&cal, getCompassHeading(&cal, &p));
+      maxErr = fmax(maxErr, headingDiff(heading, angleToDegrees(fixedHeading)));
+    }
+    printf("%s: quality %f / %f, max heading difference %f\n", files[i], quality, fixedQuality / 100.0, maxErr);
+    ASSERT_EQ(fixedQuality / 100.0, quality, 0.1);
+    ASSERT_EQ(maxErr, 0, 0.02 + 2 * ATAN2_TOLERANCE);
+    i++;
+  }
+
+  // CORDIC against libm around the full circle.
+  float maxErr = 0.0;
+  float theta;
+  for (theta = 0; theta < 360; theta += 0.1) {
+    int32_t x = (int32_t)(1e6 * cos(theta * PI / 180));
+    int32_t y = (int32_t)(1e6 * sin(theta * PI / 180));
+    float expected = atan2(y, x) * 180 / PI;
+    maxErr = fmax(maxErr, headingDiff(angleToDegrees(fixedAtan2(y, x)), fmod(expected + 360, 360)));
+  }
+  printf("fixedAtan2: max error %f\n", maxErr);
+  ASSERT_EQ(maxErr, 0, 0.005);
+  return E_SUCCESS;
 }
 
 void polarToCartesian(float r, float theta, float* x, float* y) {
@@ -300,6 +1718,378 @@ int testFineCalibration() {
   return E_SUCCESS;
 }
 
+int testDeviationTable() {
+  int counts[] = { 1, 3, 8, 13, MAX_CALIBRATION_POINTS, 0 };
+  float r = 1000;
+
+  int k = 0;
+  while (counts[k] > 0) {
+    CalibrationContext ctx;
+    startCalibration(&ctx);
+
+    int i;
+    for (i=0; i<counts[k]; i++) {
+      // Uneven spacing, so bins and fine points do not line up.
+      float theta = fmod(i * 360.0 / counts[k] + 7 * sin(i), 360);
+      float magnetic = fmod(theta + 5 * sin(theta * PI / 180) + 360, 360);
+      Point sensorData;
+      polarToCartesian(r, theta, &(sensorData.x), &(sensorData.y));
+      sensorData.z = 0;
+      addCalibrationPoint(&ctx, &sensorData, &magnetic);
+    }
+    for (i=0; i<MAX_SENSOR_POINTS - counts[k]; i++) {
+      Point sensorData;
+      polarToCartesian(r, i * 360.0 / (MAX_SENSOR_POINTS - counts[k]), &(sensorData.x), &(sensorData.y));
+      sensorData.z = 0;
+      addCalibrationPoint(&ctx, &sensorData, NULL);
+    }
+
+    Calibration cal;
+    finalizeCalibration(&ctx, &cal, NULL);
+
+    float maxErr = 0.0;
+    float compass;
+    for (compass = 0; compass < 360; compass += 0.05)
+      maxErr = fmax(maxErr, headingDiff(applyDeviation(&cal, compass), scanDeviation(&cal, compass)));
+    printf("%i fine points: max difference %f\n", counts[k], maxErr);
+    ASSERT_EQ(maxErr, 0, 0.05);
+    k++;
+  }
+  return E_SUCCESS;
+}
+
+/*
+ * A full table whose last entry is short of 360: headings past it
+ * interpolate across north to the first entry, without looking past
+ * the end of the table.
+ */
+int testDeviationTableEnd() {
+  static Calibration cal;
+  int i;
+  cal.pointCount = MAX_CALIBRATION_POINTS;
+  for (i=0; i<MAX_CALIBRATION_POINTS; i++) {
+    cal.calibrationData[i].compassHeading = 5 + i * 9.5f;
+    cal.calibrationData[i].magneticHeading = 7 + i * 9.5f;
+  }
+  // Last entry at 337.5 -> 339.5, first at 5 -> 7: +2 all the way round
+  float compass;
+  for (compass = 337.5; compass < 365; compass += 0.5) {
+    float heading = scanDeviation(&cal, fmod(compass, 360));
+    ASSERT_EQ(headingDiff(heading, fmod(compass + 2, 360)), 0, 0.001);
+  }
+  return E_SUCCESS;
+}
+
+// Fails unless calibrationData is sorted and the bins match a full rebuild.
+void assertDeviationConsistent(const Calibration* cal) {
+  int i;
+  for (i=1; i<cal->pointCount; i++)
+    assert(cal->calibrationData[i - 1].compassHeading <= cal->calibrationData[i].compassHeading);
+#if DEVIATION_TABLE_BINS > 0
+  static Calibration rebuilt;
+  rebuilt = *cal;
+  buildDeviationTable(&rebuilt);
+  for (i=0; i<DEVIATION_TABLE_BINS; i++) {
+    ASSERT_EQ(cal->deviationTable[i].slope, rebuilt.deviationTable[i].slope, 1e-6);
+    ASSERT_EQ(cal->deviationTable[i].offset, rebuilt.deviationTable[i].offset, 1e-6);
+  }
+#endif
+}
+
+/*
+ * Fine points inserted, replaced and removed one at a time, down to
+ * none and back up to a full table, keeping the deviation table the
+ * same as a full rebuild would make it.
+ */
+int testFinePointEdits() {
+  float r = 1000;
+  CalibrationContext ctx;
+  startCalibration(&ctx);
+  int i;
+  for (i=0; i<8; i++) {
+    float theta = i * 45 + 10;
+    float magnetic = fmod(theta + 5 * sin(theta * PI / 180) + 360, 360);
+    Point sensorData;
+    polarToCartesian(r, theta, &(sensorData.x), &(sensorData.y));
+    sensorData.z = 0;
+    addCalibrationPoint(&ctx, &sensorData, &magnetic);
+  }
+  for (i=0; i<MAX_SENSOR_POINTS - 8; i++) {
+    Point sensorData;
+    polarToCartesian(r, i * 360.0 / (MAX_SENSOR_POINTS - 8), &(sensorData.x), &(sensorData.y));
+    sensorData.z = 0;
+    addCalibrationPoint(&ctx, &sensorData, NULL);
+  }
+  static Calibration cal;
+  finalizeCalibration(&ctx, &cal, NULL);
+
+  for (i=0; i<120; i++) {
+    float theta = fmod(i * 137.5 + 3 * sin(i), 360);
+    float magnetic = fmod(theta + 5 * sin(theta * PI / 180) + 2 * cos(i) + 360, 360);
+    Point sensorData;
+    polarToCartesian(r, theta, &(sensorData.x), &(sensorData.y));
+    sensorData.z = 0;
+
+    int count = cal.pointCount;
+    short rc;
+    if (i < 40 || (i >= 80 && count < MAX_CALIBRATION_POINTS)) {
+      rc = insertFinePoint(&cal, &sensorData, magnetic);
+      if (count == MAX_CALIBRATION_POINTS) {
+	assert(rc == E_TOO_MANY_FINE_POINTS);
+	continue;
+      }
+      assert(cal.pointCount == count + 1);
+    } else if (i < 44) {
+      rc = replaceFinePoint(&cal, (i * 7) % count, &sensorData, magnetic);
+      assert(cal.pointCount == count);
+    } else {
+      rc = removeFinePoint(&cal, (i * 7) % count);
+      assert(cal.pointCount == count - 1);
+    }
+    assert(rc == E_SUCCESS);
+    if (i == 79)
+      assert(cal.pointCount == 0);
+    assertDeviationConsistent(&cal);
+  }
+
+  assert(cal.pointCount == MAX_CALIBRATION_POINTS);
+  assert(removeFinePoint(&cal, cal.pointCount) == E_NO_SUCH_POINT);
+  assert(removeFinePoint(&cal, -1) == E_NO_SUCH_POINT);
+  return E_SUCCESS;
+}
+
+float trueDeviation(const float* coeffs, float theta) {
+  float rad = theta * PI / 180;
+  return coeffs[0] + coeffs[1] * sin(rad) + coeffs[2] * cos(rad) + coeffs[3] * sin(2 * rad) + coeffs[4] * cos(2 * rad);
+}
+
+int testHarmonicDeviation() {
+  float coeffs[HARMONIC_COEFFICIENTS] = { 1.5, 3.0, -2.0, 0.8, -0.5 };
+  int counts[] = { 5, 8, MAX_CALIBRATION_POINTS, 0 };
+  float r = 1000;
+
+  int k = 0;
+  while (counts[k] > 0) {
+    CalibrationContext ctx;
+    startCalibration(&ctx);
+    ctx.deviationModel = DEVIATION_MODEL_HARMONIC;
+
+    int i;
+    for (i=0; i<counts[k]; i++) {
+      float theta = i * 360.0 / counts[k];
+      float magnetic = fmod(theta + trueDeviation(coeffs, theta) + 360, 360);
+      Point sensorData;
+      polarToCartesian(r, theta, &(sensorData.x), &(sensorData.y));
+      sensorData.z = 0;
+      addCalibrationPoint(&ctx, &sensorData, &magnetic);
+    }
+
+    Calibration cal;
+    short rc = finalizeCalibration(&ctx, &cal, NULL);
+    assert(rc == E_SUCCESS);
+    for (i=0; i<HARMONIC_COEFFICIENTS; i++)
+      ASSERT_EQ(cal.harmonics[i], coeffs[i], 0.01 + ATAN2_TOLERANCE);
+
+    float maxErr = 0.0;
+    float theta;
+    for (theta = 0; theta < 360; theta += 0.5) {
+      Point sensorData;
+      polarToCartesian(r, theta, &(sensorData.x), &(sensorData.y));
+      sensorData.z = 0;
+      float heading;
+      getHeading(&cal, &sensorData, &heading);
+      maxErr = fmax(maxErr, headingDiff(heading, fmod(theta + trueDeviation(coeffs, theta) + 360, 360)));
+    }
+    printf("%i fine points: max error %f\n", counts[k], maxErr);
+    ASSERT_EQ(maxErr, 0, 0.01 + 2 * ATAN2_TOLERANCE);
+    k++;
+  }
+  return E_SUCCESS;
+}
+
+// Largest error of an atan2 against libm over the full circle.
+double maxAtan2Error(float (*fn)(float, float)) {
+  double maxErr = 0.0;
+  int i;
+  for (i=0; i<100000; i++) {
+    double theta = i * 2 * PI / 100000;
+    float r = randFloat(1e-3, 1e4);
+    float y = r * sin(theta), x = r * cos(theta);
+    double err = fabs(fn(y, x) - atan2(y, x));
+    if (err > PI)
+      err = 2 * PI - err;
+    maxErr = fmax(maxErr, err);
+  }
+  return maxErr;
+}
+
+int testFastMath() {
+  double maxErr = maxAtan2Error(atan2f);
+  printf("atan2f: max error %g rad\n", maxErr);
+  ASSERT_EQ(maxErr, 0, 1e-6);
+
+  maxErr = maxAtan2Error(fastAtan2f);
+  printf("fastAtan2f: max error %g rad\n", maxErr);
+  ASSERT_EQ(maxErr, 0, 1.2e-5);
+  ASSERT_EQ(fastAtan2f(0, 0), 0, 1e-9);
+
+  maxErr = maxAtan2Error(lutAtan2f);
+  printf("lutAtan2f: max error %g rad\n", maxErr);
+  ASSERT_EQ(maxErr, 0, 1.4e-3);
+  ASSERT_EQ(lutAtan2f(0, 0), 0, 1e-9);
+
+  maxErr = 0.0;
+  float x;
+  for (x=1e-6; x<1e6; x*=1.001)
+    maxErr = fmax(maxErr, fabs(fastRsqrtf(x) * sqrt(x) - 1));
+  printf("fastRsqrtf: max relative error %g\n", maxErr);
+  ASSERT_EQ(maxErr, 0, 5e-6);
+
+  // Calibration normalizes to float precision, not that of fastRsqrtf.
+  maxErr = 0.0;
+  for (x=1e-3; x<1e3; x*=1.01) {
+    Point p = { x, 1.7f, -0.3f * x };
+    normalize(&p);
+    maxErr = fmax(maxErr, fabs(sqrt((double)p.x * p.x + (double)p.y * p.y + (double)p.z * p.z) - 1));
+  }
+  printf("normalize: max length error %g\n", maxErr);
+  ASSERT_EQ(maxErr, 0, 5e-7);
+  return E_SUCCESS;
+}
+
+// Largest component of A v - lambda v, for the smallest eigenpair.
+float eigenResidual(const CovarianceMatrix* m, const float* values, const Point* v) {
+  Point av = {
+    m->xx * v->x + m->xy * v->y + m->xz * v->z - values[0] * v->x,
+    m->xy * v->x + m->yy * v->y + m->yz * v->z - values[0] * v->y,
+    m->xz * v->x + m->yz * v->y + m->zz * v->z - values[0] * v->z
+  };
+  return max3(fabs(av.x), fabs(av.y), fabs(av.z));
+}
+
+/*
+ * Matrices R diag(l) R^T with known eigenvalues, including repeated
+ * ones that need the Jacobi fallback, then the plane normal against
+ * weightedDir on noisy random planes.
+ */
+int testSymmetricEigen() {
+  float spectra[][3] = {
+    { 1, 10, 100 },
+    { 0, 50000, 90000 },
+    { 3, 3, 80 },
+    { 7, 40, 40 },
+    { 5, 5, 5 },
+    { 1e-3, 1e4, 1e4 + 1 },
+    { -1, -1, -1 }
+  };
+  int k;
+  for (k=0; spectra[k][0] >= 0; k++) {
+    int trial;
+    for (trial=0; trial<50; trial++) {
+      Point u = { randFloat(-1, 1), randFloat(-1, 1), randFloat(-1, 1) };
+      Point w = { randFloat(-1, 1), randFloat(-1, 1), randFloat(-1, 1) };
+      normalize(&u);
+      Point v;
+      crossProduct(&u, &w, &v);
+      normalize(&v);
+      crossProduct(&u, &v, &w);
+      Point* r[3] = { &u, &v, &w };
+      float* l = spectra[k];
+      CovarianceMatrix m = {
+	l[0] * r[0]->x * r[0]->x + l[1] * r[1]->x * r[1]->x + l[2] * r[2]->x * r[2]->x,
+	l[0] * r[0]->x * r[0]->y + l[1] * r[1]->x * r[1]->y + l[2] * r[2]->x * r[2]->y,
+	l[0] * r[0]->x * r[0]->z + l[1] * r[1]->x * r[1]->z + l[2] * r[2]->x * r[2]->z,
+	l[0] * r[0]->y * r[0]->y + l[1] * r[1]->y * r[1]->y + l[2] * r[2]->y * r[2]->y,
+	l[0] * r[0]->y * r[0]->z + l[1] * r[1]->y * r[1]->z + l[2] * r[2]->y * r[2]->z,
+	l[0] * r[0]->z * r[0]->z + l[1] * r[1]->z * r[1]->z + l[2] * r[2]->z * r[2]->z
+      };
+
+      float values[3];
+      Point smallest;
+      short rc = symmetricEigen(&m, values, &smallest);
+      assert(rc == E_SUCCESS);
+      ASSERT_EQ(values[0], l[0], l[2] * 1e-4);
+      ASSERT_EQ(values[1], l[1], l[2] * 1e-3);
+      ASSERT_EQ(values[2], l[2], l[2] * 1e-3);
+      ASSERT_EQ(vecLength(&smallest), 1, 1e-4);
+      ASSERT_EQ(eigenResidual(&m, values, &smallest), 0, l[2] * 1e-3);
+
+      rc = jacobiEigen(&m, values, &smallest);
+      assert(rc == E_SUCCESS);
+      ASSERT_EQ(values[0], l[0], l[2] * 1e-4);
+      ASSERT_EQ(eigenResidual(&m, values, &smallest), 0, l[2] * 1e-3);
+    }
+  }
+
+  Point normal = { 0.1, 0.2, 0.3 };
+  normalize(&normal);
+  float noise[] = { 1.0, 10.0, 50.0, 100.0, 200.0, 300.0, -1.0 };
+  for (k=0; noise[k] >= 0; k++) {
+    double eigenMse = 0.0, blendMse = 0.0;
+    int trial;
+    for (trial=0; trial<20; trial++) {
+      CalibrationCtxPoint points[NPOINTS];
+      int i;
+      for (i=0; i<NPOINTS; i++) {
+	Point p = { randFloat(0, RANGE), randFloat(0, RANGE), 0 };
+	p.z = (-normal.x * p.x - normal.y * p.y) / normal.z;
+	p.x += randFloat(-noise[k], noise[k]);
+	p.y += randFloat(-noise[k], noise[k]);
+	p.z += randFloat(-noise[k], noise[k]);
+	points[i].sensorData = p;
+      }
+      Point centroidPt, eigenNormal, blendNormal;
+      CovarianceMatrix covar;
+      float values[3];
+      centroid(points, NPOINTS, &centroidPt);
+      covariance(points, NPOINTS, &centroidPt, &covar);
+      symmetricEigen(&covar, values, &eigenNormal);
+      weightedDir(&covar, &blendNormal);
+
+      // Mean squared distance of the points from each fitted plane
+      for (i=0; i<NPOINTS; i++) {
+	Point r;
+	pointVec(&centroidPt, &(points[i].sensorData), &r);
+	eigenMse += sq(dotProduct(&r, &eigenNormal)) / NPOINTS;
+	blendMse += sq(dotProduct(&r, &blendNormal)) / NPOINTS;
+      }
+    }
+    printf("noise %f: RMS distance from plane eigen %f weightedDir %f\n", noise[k], sqrt(eigenMse / 20), sqrt(blendMse / 20));
+    // The eigen normal is the least squares one, so weightedDir can
+    // only match it to within float rounding, as at low noise; as the
+    // noise grows weightedDir falls clearly behind.
+    assert(eigenMse <= blendMse * (1 + 1e-5));
+    if (noise[k] >= 50)
+      assert(eigenMse < blendMse * 0.999);
+  }
+
+  // Not finite
+  CovarianceMatrix bad = { NAN, 0, 0, 1, 0, 1 };
+  float values[3];
+  Point smallest;
+  assert(symmetricEigen(&bad, values, &smallest) == E_DEGENERATE_CALIBRATION);
+  assert(jacobiEigen(&bad, values, &smallest) == E_DEGENERATE_CALIBRATION);
+
+  // Points along a line, and a cloud as thick as it is wide, do not
+  // determine a plane.
+  CalibrationContext ctx;
+  Calibration cal;
+  int i;
+  startCalibration(&ctx);
+  for (i=0; i<NPOINTS; i++) {
+    Point p = { 10 * i, 20 * i + randFloat(-1, 1), 5 * i };
+    addCalibrationPoint(&ctx, &p, NULL);
+  }
+  assert(finalizeCalibration(&ctx, &cal, NULL) == E_DEGENERATE_CALIBRATION);
+  startCalibration(&ctx);
+  for (i=0; i<MAX_SENSOR_POINTS; i++) {
+    Point p = { randFloat(0, RANGE), randFloat(0, RANGE), randFloat(0, RANGE) };
+    addCalibrationPoint(&ctx, &p, NULL);
+  }
+  assert(finalizeCalibration(&ctx, &cal, NULL) == E_DEGENERATE_CALIBRATION);
+  return E_SUCCESS;
+}
+
 int main(int argc, char** argv) {
   int rc = E_SUCCESS;
 
@@ -307,14 +2097,41 @@ int main(int argc, char** argv) {
 
   RUNTEST(testCoarseCalibrationXYplane);
   RUNTEST(testCoarseCalibrationRandomPlane);
+  RUNTEST(testSensorLog);
   RUNTEST(testVectorData);
+  RUNTEST(testCompiledTransform);
+  RUNTEST(testHeadingBatch);
+  RUNTEST(testStreamCalibration);
+  RUNTEST(testStreamMerge);
+  RUNTEST(testStreamPrecision);
+  RUNTEST(testRobustCalibration);
+  RUNTEST(testRetention);
+  RUNTEST(testCalibrationProgress);
+  RUNTEST(testAdaptiveCalibration);
+  RUNTEST(testSampleRing);
+  RUNTEST(testBatchAgainstHeading);
+  RUNTEST(testHeadingFilter);
+  RUNTEST(testGyroFusion);
+  RUNTEST(testTiltCompensation);
+  RUNTEST(testOriginFit);
+  RUNTEST(testRobustOriginFit);
+  RUNTEST(testCompileTransform);
+  RUNTEST(testSerialization);
+  RUNTEST(testFleetCalibration);
+  RUNTEST(testFixedCalibration);
   RUNTEST(testPlaneFromThreePoints);
   RUNTEST(testMatrixInv);
   RUNTEST(testFineCalibration);
+  RUNTEST(testDeviationTable);
+  RUNTEST(testDeviationTableEnd);
+  RUNTEST(testFinePointEdits);
+  RUNTEST(testHarmonicDeviation);
+  RUNTEST(testSymmetricEigen);
+  RUNTEST(testFastMath);
 
   if (rc == E_SUCCESS)
     printf("SUCCESS\n");
   else
     printf("** FAILED\n");
-  return 0;
+  return rc == E_SUCCESS ? 0 : 1;
 }
@@ -0,0 +1,99 @@
+#include "compaxx.h"
+#include "compaxx_int.h"
+
+/*
+ * Level readings lie in the calibrated plane, whose unit normal is
+ * n = transform.normal. Tilted, the same field is seen rotated so that
+ * the vertical is the gravity vector g instead, taken here with the
+ * sign that puts it on the same side as n. The reading is turned back
+ * by the least rotation taking g onto n, about k = g x n. With
+ * c = g . n that is (Rodrigues)
+ *
+ *   R r = c r + k x r + k (k . r) / (1 + c)
+ *
+ * where 1 + c stays above 1 for tilts under 90 degrees. Heel and
+ * pitch are each such a rotation, about the fore and aft or the
+ * athwartships axis, wherever compass north lies in the plane.
+ */
+
+/*
+ * Unit vertical for gravity, turned to the side of the plane normal.
+ * Returns 0 for a zero vector.
+ */
+static short tiltVertical(const Point* normal, const Point* gravity, Point* vertical) {
+  float length = dotProduct(gravity, gravity);
+  if (!(length > 0.0f))
+    return 0;
+  float scale = fastRsqrtf(length);
+  if (dotProduct(normal, gravity) < 0.0f)
+    scale = -scale;
+  vertical->x = gravity->x * scale;
+  vertical->y = gravity->y * scale;
+  vertical->z = gravity->z * scale;
+  return 1;
+}
+
+short getHeadingTilt(const Calibration* cal, const Point* sensorData, const Point* gravity, float* heading) {
+  const HeadingTransform* t = &(cal->transform);
+  const Point* normal = &(t->normal);
+  Point vertical, axis, field, turn;
+
+  if (!tiltVertical(normal, gravity, &vertical))
+    return getHeading(cal, sensorData, heading);
+
+  // Reading relative to the hard iron offset
+  field.x = sensorData->x - cal->origin.x + cal->verticalField * normal->x;
+  field.y = sensorData->y - cal->origin.y + cal->verticalField * normal->y;
+  field.z = sensorData->z - cal->origin.z + cal->verticalField * normal->z;
+
+  crossProduct(&vertical, normal, &axis);
+  crossProduct(&axis, &field, &turn);
+  float c = dotProduct(&vertical, normal);
+  float k = dotProduct(&axis, &field) / (1.0f + c);
+  field.x = c * field.x + turn.x + k * axis.x;
+  field.y = c * field.y + turn.y + k * axis.y;
+  field.z = c * field.z + turn.z + k * axis.z;
+
+  float u = dotProduct(&(t->axisU), &field);
+  float v = dotProduct(&(t->axisV), &field);
+  *heading = applyDeviation(cal, radsToHeading(headingAtan2f(v, u)));
+  return E_SUCCESS;
+}
+
+/*
+ * 1 - cos(5 degrees) squared: the least sum of squared tilt terms
+ * below that a reading tilted by 5 degrees gives.
+ */
+#define TILT_MIN_WEIGHT 1.45e-5f
+
+/*
+ * The field along the vertical is the same at any tilt. With the
+ * reading r = p - origin and vertical g as above, level readings give
+ * it as verticalField, since r lies in the plane, and tilted ones as
+ * r . g + verticalField (n . g). Each reading thus gives
+ *
+ *   r . g = verticalField (1 - n . g)
+ *
+ * which is solved for verticalField by least squares.
+ */
+short estimateVerticalField(Calibration* cal, const Point* sensorData, const Point* gravity, short n) {
+  const HeadingTransform* t = &(cal->transform);
+  const Point* normal = &(t->normal);
+  Point vertical, r;
+  float sumRW = 0.0f, sumWW = 0.0f;
+  short i;
+
+  for (i=0; i<n; i++) {
+    if (!tiltVertical(normal, &(gravity[i]), &vertical))
+      continue;
+    pointVec(&(cal->origin), &(sensorData[i]), &r);
+    float w = 1.0f - dotProduct(normal, &vertical);
+    sumRW += dotProduct(&r, &vertical) * w;
+    sumWW += w * w;
+  }
+  if (!(sumWW >= TILT_MIN_WEIGHT))
+    return E_DEGENERATE_CALIBRATION;
+
+  cal->verticalField = sumRW / sumWW;
+  return E_SUCCESS;
+}